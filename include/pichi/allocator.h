@@ -0,0 +1,111 @@
+#ifndef PICHI_ALLOCATOR_H
+#define PICHI_ALLOCATOR_H
+
+#include <vector>
+#include <mutex>
+#include "tensor.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the allocators used for the data arrays of tensors.
+ *
+ * Every tensor takes its data array from an allocator. Unless another one
+ * is set (see setAllocator), this is a global PoolAllocator, which keeps
+ * released arrays in a pool and hands them out again to later tensors of
+ * similar size. Programs doing many contractions typically create and
+ * release intermediates of the same few sizes over and over, which then
+ * only costs the allocation of the first of them.
+ *
+ * Rank 0 tensors (scalars) keep their single element in the tensor itself
+ * and never use an allocator. A tensor which has been moved from is a
+ * scalar, so moving tensors never allocates.
+ *
+ * The arrays handed out by the PoolAllocator are aligned to 64 bytes (a
+ * cache line).
+ *
+ * ***********************************************************************/
+
+/*
+ * Interface of an allocator for tensor data. allocate returns an array of
+ * (at least) n elements, which is given back through deallocate with the
+ * same n. Allocators must be thread safe, since tensors are created and
+ * destroyed by the threads of parallel contractions.
+ */
+class TensorAllocator {
+
+public:
+
+  virtual ~TensorAllocator() {};
+
+  virtual cdouble* allocate(long long n) = 0;
+  virtual void deallocate(cdouble* data, long long n) = 0;
+
+};
+
+/*
+ * Allocator keeping released arrays for reuse. The arrays are sorted in
+ * size classes, which grow in steps of a quarter of a power of two, such
+ * that an array is at most 25% larger than requested. A request is served
+ * from the pool if it holds an array of the right class (a hit), and
+ * allocated otherwise (a miss).
+ *
+ * The pool holds at most limit elements (16 bytes each); arrays released
+ * beyond that are freed. A limit of 0 means no limit.
+ */
+class PoolAllocator : public TensorAllocator {
+
+public:
+
+  struct Stats {
+    long long hits;
+    long long misses;
+    long long pooled; // The number of elements held in the pool
+  };
+
+  explicit PoolAllocator(long long limit);
+  ~PoolAllocator();
+
+  PoolAllocator(const PoolAllocator&) = delete;
+  PoolAllocator& operator=(const PoolAllocator&) = delete;
+
+  cdouble* allocate(long long n) override;
+  void deallocate(cdouble* data, long long n) override;
+
+  /*
+   * Gets the number of hits and misses since the pool was created, and the
+   * number of elements in the pool.
+   */
+  Stats getStats() const;
+
+  /*
+   * Frees all the arrays in the pool.
+   */
+  void clear();
+
+private:
+
+  mutable std::mutex mtx;
+  std::vector<std::vector<cdouble*>> pool; // Released arrays by size class
+  long long limit;
+  Stats stats;
+
+};
+
+/*
+ * Sets the allocator used for the data of tensors created from now on, or
+ * the default pool if it is null. Tensors keep the allocator they were
+ * created with, which must outlive them.
+ */
+void setAllocator(TensorAllocator*);
+TensorAllocator* getAllocator();
+
+/*
+ * Gets the default pool. It holds at most 2^24 elements (256 MiB).
+ */
+PoolAllocator& defaultPool();
+
+}
+
+#endif //PICHI_ALLOCATOR_H
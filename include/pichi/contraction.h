@@ -3,6 +3,7 @@
 
 #include "tensor.h"
 #include "graph.h"
+#include "workspace.h"
 #include <unordered_map>
 #include <queue>
 
@@ -41,35 +42,199 @@ namespace pichi {
  *
  * The result of this contraction is a rank 4 tensor.
  *
+ * All contract functions take an optional workspace (see WORKSPACE.H), from
+ * which the scratch buffers of the contraction are taken. Without one, the
+ * buffers are allocated for each contraction.
+ *
  * ***********************************************************************/
 
 /*
  * Contracts indices on a single tensor, resulting in a new tensor. If all
- * indices are contracted, the output is a rank 0 tensor.
+ * indices are contracted, the output is a rank 0 tensor. Only the diagonal
+ * elements of the contracted indices are read, straight from the tensor as
+ * it is stored, so its storage is not changed. The free indices are stored
+ * on the output in the same order as on the input. The output elements are
+ * split between the threads (see setThreads).
  */
 void contract(Tensor& tensor, const std::vector<std::pair<int, int>>& idx,
-              Tensor& out);
+              Tensor& out, ContractionWorkspace* workspace = nullptr);
 
 
 /*
  * Contract indices on two tensors. The resulting tensor is returned.
+ * The contraction is carried out by the currently selected engine (see
+ * below). Complete contractions (no free indices) are always computed
+ * directly as an inner product of the two tensors.
  */
 void contract(Tensor& tensor1, Tensor& tensor2,
-                const std::vector<std::pair<int, int>>& idx, Tensor& out);
+                const std::vector<std::pair<int, int>>& idx, Tensor& out,
+                ContractionWorkspace* workspace = nullptr);
+
+
+/*
+ * Engines for contracting two tensors:
+ *
+ * Slice: Iterates through 2-dimensional slices of the tensors, multiplying
+ * one pair of slices at a time. Contracted indices which are not sliced are
+ * looped over, and the trace of each product is accumulated.
+ *
+ * TTGT: (Transpose-Transpose-GEMM-Transpose) Reorders the storage of both
+ * tensors, such that all contracted indices are fused into one dimension
+ * and all free indices into another. The contraction is then done as a
+ * single matrix-matrix multiplication, writing directly to the output.
+ * If both tensors are planar (see TENSOR.H), the real and imaginary planes
+ * are multiplied as real matrices, and the output is planar.
+ *
+ * Strided: Does the same matrix multiplication as TTGT without reordering
+ * the input tensors. The blocks of the matrices are packed directly from
+ * the tensors as they are stored, and the storage of the inputs is never
+ * changed. The output stores the free indices of each tensor in the order
+ * in which they are stored on the input.
+ *
+ * Auto: Chooses an engine based on the contraction. Contractions of two or
+ * more indices use TTGT, single index contractions use Slice. Contractions
+ * of two planar tensors always use TTGT, and complete contractions of two
+ * planar tensors multiply their planes directly as well.
+ *
+ * The Slice engine converts planar tensors to the interleaved format. The
+ * other engines read planar tensors without converting them, and give an
+ * interleaved output unless both inputs are planar. Contractions of a
+ * single tensor read the planes of a planar tensor directly, and give an
+ * interleaved output.
+ *
+ * The engine is a global setting, which defaults to Auto.
+ */
+enum class Engine {Auto, Slice, TTGT, Strided};
+
+void setEngine(Engine);
+Engine getEngine();
+
+
+/*
+ * Methods for the matrix multiplication of the TTGT engine:
+ *
+ * Standard: A complex matrix product, or four real products of the real and
+ * imaginary planes of planar tensors.
+ *
+ * Gauss: The 3M method. The real and imaginary planes of the tensors are
+ * multiplied with three real matrix products instead of four, which saves
+ * 25% of the operations. The planes of interleaved tensors are split into
+ * scratch buffers first. The rounding error of the imaginary part is
+ * somewhat larger, but still of the order of the machine precision times
+ * the magnitude of the products of the elements.
+ *
+ * The products of the Slice engine are too small to gain from the Gauss
+ * method, and are always standard.
+ *
+ * The method is a global setting, which defaults to Standard.
+ */
+enum class GemmMethod {Standard, Gauss};
+
+void setGemmMethod(GemmMethod);
+GemmMethod getGemmMethod();
+
+
+/*
+ * Backends for the matrix-matrix multiplications done by the engines:
+ *
+ * Armadillo: Uses Armadillo matrices wrapped around the tensor data.
+ *
+ * BLAS: Calls cblas_zgemm (e.g. from OpenBLAS) directly, passing on
+ * transposition flags and leading dimensions. This backend is only available
+ * if PICHI is built with the CMake option USE_BLAS, in which case it is also
+ * the default.
+ *
+ * Builtin: A simple implementation without any external dependencies.
+ *
+ * On processors with AVX2 or AVX-512, the Builtin backend uses SIMD
+ * microkernels, and so do the other backends for small matrices, where they
+ * are faster than the external libraries.
+ *
+ * The backend is a global setting, which defaults to BLAS if available and
+ * Armadillo otherwise. Selecting an unavailable backend throws an
+ * invalid_argument exception.
+ */
+enum class Backend {Armadillo, BLAS, Builtin};
+
+void setBackend(Backend);
+Backend getBackend();
+
+
+/*
+ * Number of threads used for contractions.
+ * The loops over free indices which are not sliced on the output tensor are
+ * split between the threads, each writing its own slices of the output. The
+ * threads are kept in a pool, which is rebuilt when the number changes, so
+ * this should not be called while contractions are running.
+ * When PICHI is built with OpenBLAS, the BLAS library is restricted to a
+ * single thread while a parallel loop runs, and allowed to use all the
+ * threads otherwise.
+ * The default is 1 (serial execution).
+ */
+void setThreads(int);
+int getThreads();
+
+
+/*
+ * Limit on the memory used for intermediate tensors, in number of elements
+ * (16 bytes each). When the best order of a diagram needs more, connections
+ * of the diagram are sliced: the diagram is evaluated for each fixed value
+ * of the sliced indices, using smaller intermediates, and the results are
+ * summed (see ContractionPlan in PLAN.H). The limit applies to diagrams
+ * planned after it is set. An invalid_argument exception is thrown if the
+ * diagram can not be evaluated within the limit.
+ * The default is 0 (no limit).
+ */
+void setMemoryLimit(long long);
+long long getMemoryLimit();
 
 
 /*
- * Compute a completely contracted, known diagram, represented by a graph.
+ * Compute a completely contracted diagram, represented by a graph.
  * The graph nodes and the position of the corresponding tensor in the input
  * tensor array must be equal.
  * EXAMPLE: Compute the diagram 0_ab 1_acd 2_cdb
  * The input tensor array must contain three tensors, the first of which is
  * rank two and the two next being rank 3. The graph must correspond to the
  * diagram (constructed for example by Graph("0ab1acd2cdb")).
- * If the diagram is not connected the result will be the sum of the
- * connected parts.
+ * The diagram is evaluated through a sequence of contractions of one or two
+ * tensors, chosen by a cost model (see estimateCost). The graph must be
+ * connected and have no open connections. An invalid_argument exception is
+ * thrown if it can not be contracted without creating rank 1 intermediates.
+ * The intermediates are taken from the global allocator (see ALLOCATOR.H);
+ * to evaluate the same diagram many times, a ContractionPlan (see PLAN.H)
+ * keeps them in an arena of its own.
+ */
+void contract(const Graph&, std::vector<Tensor>&, Tensor& out,
+              ContractionWorkspace* workspace = nullptr);
+
+
+/*
+ * The estimated cost of evaluating a diagram:
+ *
+ * flops: The number of complex multiply-add operations.
+ * memory: The number of elements in the intermediate tensors.
+ * moves: The number of elements moved when the storage of a tensor is
+ *        changed before a contraction. This is an upper estimate, since
+ *        tensors which already have the right storage are not moved.
+ *
+ * The order of the contractions is chosen to minimise the sum of the three.
+ * For diagrams of up to 14 tensors all possible orders are considered
+ * (through dynamic programming over the subsets of tensors). Larger diagrams
+ * are reduced greedily, one cheapest contraction at a time.
+ */
+struct ContractionCost {
+  double flops;
+  double memory;
+  double moves;
+};
+
+/*
+ * Estimates the cost of evaluating a diagram with tensors of a given size,
+ * without doing any contractions. Throws an invalid_argument exception for
+ * the same diagrams as contract.
  */
-void contract(const Graph&, std::vector<Tensor>&, Tensor& out);
+ContractionCost estimateCost(const Graph&, int size);
 
 
 }
@@ -6,8 +6,11 @@
  * Contains includes for all PICHI include-files
  */
 
+#include "allocator.h"
 #include "contraction.h"
 #include "graph.h"
+#include "plan.h"
 #include "tensor.h"
+#include "workspace.h"
 
 #endif //PICHI_PICHI_H
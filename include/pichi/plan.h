@@ -0,0 +1,284 @@
+#ifndef PICHI_PLAN_H
+#define PICHI_PLAN_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include "allocator.h"
+#include "contraction.h"
+#include "graph.h"
+#include "tensor.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file contains the definition of a ContractionPlan.
+ *
+ * Evaluating a diagram involves a number of decisions which only depend on
+ * the graph and on the rank, size and storage of the tensors: the order of
+ * the contractions, the engine used for each of them, the storage of the
+ * tensors and the setup of the slice iterators. A ContractionPlan makes all
+ * these decisions once, and can then evaluate the diagram for any number of
+ * sets of tensors with the same layout. This is typically the case when the
+ * same diagram is computed for many time slices or gauge configurations.
+ *
+ * EXAMPLE:
+ *    ContractionPlan plan(Graph("0abc1abd2cd"), {3,3,2}, 64);
+ *    for (...) {
+ *      std::vector<Tensor> tensors = ...;
+ *      Tensor res;
+ *      plan.execute(tensors, res);
+ *    }
+ *
+ * The engine and the method of the matrix products are chosen when the plan
+ * is made (see setEngine and setGemmMethod in CONTRACTION.H), so plans made
+ * with different methods can be used side by side. So is the format of the
+ * tensors: with the Auto engine, contractions of two planar tensors use TTGT
+ * and keep them planar (see TENSOR.H). The backend and the
+ * number of threads are the ones set when the plan is executed.
+ *
+ * A plan is immutable once made. It can be copied cheaply and executed from
+ * several threads at the same time (on different tensors).
+ *
+ * The data arrays of the intermediate tensors are taken from an arena (a
+ * PoolAllocator without limit) which belongs to the plan and is shared by
+ * its copies. After the first execution, the arrays of the intermediates are
+ * found in the arena. Only the value of the diagram is copied into an array
+ * from the global allocator (see ALLOCATOR.H). The plans made by contract
+ * for a single evaluation have no arena: their intermediates are taken from
+ * the global allocator and go back to it.
+ *
+ * If a memory limit is set (see setMemoryLimit in CONTRACTION.H) and the
+ * intermediates of the diagram would not fit in it, the plan slices some of
+ * the connections of the diagram. For every value of the sliced indices the
+ * tensors are cut down to the remaining indices (in the same format, which
+ * is read without converting the tensors), the smaller diagram without
+ * the sliced connections is evaluated, and the results are summed. This
+ * costs a factor N more operations per sliced connection compared to the
+ * smaller diagram, but keeps the order of the contractions efficient.
+ * Connections are only sliced if every tensor keeps at least two indices.
+ *
+ * Many diagrams, such as the entries of a correlator matrix, share some of
+ * their contractions. A ContractionBatch plans a number of diagrams (jobs)
+ * on a common set of tensors together. A contraction which appears in
+ * several jobs, with the same tensors and the same indices, is only
+ * computed once and its result is used by all of them.
+ *
+ * ***********************************************************************/
+
+/*
+ * A single contraction in a plan. One or two tensors are contracted into a
+ * new, temporary tensor. Tensors are identified by an integer id: the input
+ * tensors have the ids 0,...,N-1 (equal to the node names in the graph) and
+ * the result of step i has the id N+i. The result of the last step is the
+ * value of the diagram. The contracted indices are given in the same format
+ * as for the contract functions.
+ *
+ * Example: The diagram 0_ab 1_bc 2_ca could be evaluated through the steps
+ *    {inputs: (1,2), indices: ((1,0)), output: 3}
+ *    {inputs: (0,3), indices: ((0,1),(1,0)), output: 4}
+ */
+struct ContractionStep {
+  std::vector<int> inputs;
+  std::vector<std::pair<int,int>> indices;
+  int output;
+};
+
+// Internal, prepared contraction (see ENGINES.H) and memory plan (see
+// SCHEDULE.H)
+struct ContractionSetup;
+struct MemoryPlan;
+
+class ContractionPlan {
+
+public:
+
+  /*
+   * Makes a plan for a diagram with the layout and format of a set of
+   * tensors. The nodes of the graph correspond to the tensors at the same
+   * position.
+   * Throws an invalid_argument exception if the tensors do not match the
+   * graph, or if the diagram can not be evaluated (see contract in
+   * CONTRACTION.H).
+   */
+  ContractionPlan(const Graph& graph, const std::vector<Tensor>& tensors);
+
+  /*
+   * Makes a plan for a diagram where tensor i has rank ranks[i], the given
+   * size and default storage. The tensors are planar if planar is true.
+   */
+  ContractionPlan(const Graph& graph, const std::vector<int>& ranks,
+                  int size, bool planar = false);
+
+  /*
+   * Evaluates the diagram for a set of tensors. The tensors must have the
+   * ranks and size given when the plan was made. If their storage differs,
+   * it is changed as when the plan was made. If their format differs, the
+   * engines chosen for the planned format are used anyway. Scratch buffers are taken from
+   * the workspace, if one is given (see WORKSPACE.H).
+   */
+  void execute(std::vector<Tensor>& tensors, Tensor& out,
+               ContractionWorkspace* workspace = nullptr) const;
+
+  /*
+   * Gets the contractions of the plan, in the order they are made. If
+   * connections are sliced, these are the contractions of the diagram
+   * without them, made once for every value of the sliced indices.
+   */
+  const std::vector<ContractionStep>& getSteps() const { return steps; };
+
+  /*
+   * Gets the connections which are sliced, in the format of
+   * Graph::allConnections. The list is empty unless a memory limit is set.
+   */
+  const std::vector<std::pair<std::pair<int,int>,std::pair<int,int>>>&
+      getSlicedConnections() const { return sliced; };
+
+  /*
+   * Gets the estimated cost of evaluating the diagram, including all values
+   * of the sliced indices.
+   */
+  ContractionCost getCost() const { return cost; };
+
+  /*
+   * Gets the number of elements in all the intermediate tensors together,
+   * including the sliced tensors.
+   */
+  long long getWorkspaceSize() const { return workspace; };
+
+  /*
+   * Gets the largest number of elements held in intermediate tensors at any
+   * time during the evaluation. Intermediates are released right after their
+   * last use, and their data arrays may be reused by later intermediates of
+   * the same size. The number is for steps running one at a time; steps
+   * running in parallel on several threads may hold more.
+   */
+  long long getPeakMemory() const { return peak; };
+
+  /*
+   * Gets the statistics of the arena of the intermediates.
+   */
+  PoolAllocator::Stats getArenaStats() const { return arena->getStats(); };
+
+  /*
+   * Gives a description of the contractions of the plan for inspection, one
+   * line per step, with the engine used (followed by 3M for TTGT with the
+   * Gauss method) and, for the slice engine, the roles chosen for the
+   * indices. Example:
+   *    3 = contract(1, 2, {(1,0)}) Slices: SC (1,0) | SF 1:0 2:1
+   *    4 = contract(0, 3, {(0,1),(1,0)}) Inner
+   */
+  std::string toString() const;
+
+private:
+
+  friend void contract(const Graph&, std::vector<Tensor>&, Tensor&,
+                       ContractionWorkspace*);
+
+  // Makes the plan for tensors with the given storage vectors and formats
+  void init(const Graph& graph, const std::vector<std::vector<int>>& storage,
+            const std::vector<bool>& planar, int size);
+
+  // Orders and prepares the contractions of the diagram without the sliced
+  // connections
+  void prepareSliced(const Graph& graph,
+                     const std::vector<std::vector<int>>& storage,
+                     const std::vector<bool>& planar);
+
+  std::vector<ContractionStep> steps;
+  std::shared_ptr<const std::vector<ContractionSetup>> setups;
+  std::shared_ptr<const MemoryPlan> memory;
+  std::vector<std::pair<std::pair<int,int>,std::pair<int,int>>> sliced;
+  ContractionCost cost;
+  long long workspace;
+  long long peak;
+  std::shared_ptr<PoolAllocator> arena;
+
+  // Layout of the input tensors: the nodes of the graph with their ranks
+  std::vector<int> nodes;
+  std::vector<int> ranks;
+  int size;
+
+};
+
+/*
+ * A diagram in a batch. Node i of the graph corresponds to the tensor with
+ * index tensors[i] in the tensors of the batch.
+ */
+struct ContractionJob {
+  Graph graph;
+  std::vector<int> tensors;
+};
+
+class ContractionBatch {
+
+public:
+
+  /*
+   * Makes a plan for a batch of jobs, where tensor i of the batch has rank
+   * ranks[i], the given size and default storage. The tensors are planar if
+   * planar is true.
+   * Throws an invalid_argument exception if a job does not match the
+   * tensors, or if its diagram can not be evaluated.
+   */
+  ContractionBatch(const std::vector<ContractionJob>& jobs,
+                   const std::vector<int>& ranks, int size,
+                   bool planar = false);
+
+  /*
+   * Evaluates all jobs. The value of job j is stored in out[j]. Scratch
+   * buffers are taken from the workspace, if one is given.
+   */
+  void execute(std::vector<Tensor>& tensors, std::vector<Tensor>& out,
+               ContractionWorkspace* workspace = nullptr) const;
+
+  /*
+   * Gets the contractions of the batch, in the order they are made. The
+   * tensors of the batch have the ids 0,...,N-1.
+   */
+  const std::vector<ContractionStep>& getSteps() const { return steps; };
+
+  /*
+   * Gets the number of contractions which were found in more than one job,
+   * and are therefore computed once instead of several times.
+   */
+  int countShared() const { return shared; };
+
+  /*
+   * Gets the largest number of elements held in intermediate tensors at any
+   * time during the evaluation (see ContractionPlan).
+   */
+  long long getPeakMemory() const;
+
+  /*
+   * Gets the statistics of the arena of the intermediates (see
+   * ContractionPlan).
+   */
+  PoolAllocator::Stats getArenaStats() const { return arena->getStats(); };
+
+  /*
+   * Gives a description of the contractions of the batch (see
+   * ContractionPlan).
+   */
+  std::string toString() const;
+
+private:
+
+  std::vector<ContractionStep> steps;
+  std::shared_ptr<const std::vector<ContractionSetup>> setups;
+  std::shared_ptr<const MemoryPlan> memory;
+  std::shared_ptr<PoolAllocator> arena;
+
+  // The id of the value of each job
+  std::vector<int> results;
+
+  std::vector<int> ranks;
+  int size;
+  int shared;
+
+};
+
+}
+
+#endif //PICHI_PLAN_H
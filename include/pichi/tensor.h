@@ -8,6 +8,9 @@ typedef std::complex<double> cdouble;
 
 namespace pichi {
 
+// Allocator of the data arrays (see ALLOCATOR.H)
+class TensorAllocator;
+
 /* ************************************************************************
  *
  * This file declares the Tensor class.
@@ -45,6 +48,21 @@ namespace pichi {
  * already in the leading dimension of the underlying data array.
  * Default storage is (0,1,...,R-1), where R is the tensor rank.
  *
+ * Changing the storage is lazy. The new storage is recorded, but the data
+ * array keeps its current layout until the data array itself is accessed.
+ * Slices, elementwise operations and copies work directly on the array as
+ * it is laid out, so a storage change which is undone or only read through
+ * slices never moves the data.
+ *
+ * The data array is taken from the allocator which was set when the tensor
+ * was created (see ALLOCATOR.H).
+ *
+ * The data array is either interleaved (the default), holding each element
+ * as a std::complex<double>, or planar, holding the real parts of all
+ * elements followed by their imaginary parts. The planar format lets the
+ * contraction kernels work on real and imaginary parts with plain real
+ * arithmetic (see CONTRACTION.H). Slices are always interleaved, whatever
+ * the format of the tensor.
  *
  * ***********************************************************************/
 
@@ -72,6 +90,13 @@ public:
    */
   Tensor(int rank, int size, const std::vector<int>& store);
 
+  /*
+   * Creates a rank 0 tensor, which takes its data arrays from the given
+   * allocator when it is resized, or from the current one if it is null.
+   * The allocator must outlive the tensor.
+   */
+  explicit Tensor(TensorAllocator* allocator);
+
   /*
    * Copy constructor
    * Makes a deep copy of the input tensor. After the copying, the data of
@@ -190,6 +215,40 @@ public:
   bool getSlice(const std::vector<int>&, cdouble*) const;
   void setSlice(const std::vector<int>&, const cdouble*, bool trans = false);
 
+  /*
+   * Direct access to the underlying data array.
+   * The array holds size^rank elements, laid out according to the storage
+   * vector (see below). The element with index (i_0, i_1, ..., i_{R-1}) is
+   * found at the offset
+   *    i_{s_0} + i_{s_1}*size + ... + i_{s_{R-1}}*size^(R-1) ,
+   * where s is the storage vector. This is intended for the contraction
+   * kernels; in general, slices should be used to interact with the data.
+   * A pending storage change is applied first, and a planar tensor is
+   * converted to the interleaved format. The const version never changes
+   * the data array, so it can be called from several threads at once. It
+   * throws instead if the tensor is planar or has a pending storage change.
+   */
+  const cdouble* getData() const;
+  cdouble* getData() { convert(false); apply(); return data; };
+
+  /*
+   * Gets the data array as it is, without applying a pending storage change.
+   * The storage vector which describes its current layout is written to
+   * layout. Throws if the tensor is planar.
+   */
+  const cdouble* getData(std::vector<int>& layout) const;
+
+  /*
+   * The same as getData, for the planar format. The real part of an element
+   * is found at the offset given above, and its imaginary part size^rank
+   * elements further on. The non-const version converts a tensor in the
+   * interleaved format to the planar format first, while the const versions
+   * throw.
+   */
+  const double* getPlanarData() const;
+  double* getPlanarData();
+  const double* getPlanarData(std::vector<int>& layout) const;
+
 
   // --- Data storage ---------------------------------------------------
 
@@ -201,18 +260,45 @@ public:
    * the leading dimension of the underlying data structure is dimension 3 of
    * the actual tensor, then dimension 1 etc.
    * When setting the storage vector, the data will be reallocated if the
-   * storage is different from the current one.
+   * storage is different from the current one. This happens the next time
+   * the data array is accessed, or when applyStorage is called.
    */
   std::vector<int> getStorage() const;
   void setStorage(const std::vector<int>& store);
 
+  /*
+   * Checks whether the data array is still laid out according to an earlier
+   * storage vector, or applies the storage change to the data array.
+   */
+  bool hasPendingStorage() const { return layout != storage; };
+  void applyStorage() { apply(); };
+
   /*
    * Resize the tensor. This deletes all data in the tensor and resets the
    * internals of the tensor as if it was freshly created with a given rank,
    * size and optionally a storage vector for the new tensor.
+   * If the current data array has room for the elements of the new tensor,
+   * it is kept (and cleared) instead of being reallocated. It is only
+   * released by assigning a new tensor. If clear is false, the elements are
+   * left undefined instead of being set to 0, for callers which overwrite
+   * all of them. The tensor is interleaved, unless planar is true.
    */
   void resize(int rank, int size);
-  void resize(int rank, int size, const std::vector<int>& storage);
+  void resize(int rank, int size, const std::vector<int>& storage,
+              bool clear = true, bool planar = false);
+
+
+  // --- Data format -----------------------------------------------------
+
+  /*
+   * Checks whether the data array is in the planar format, or converts it
+   * to the planar (true) or interleaved (false) format. Slices and
+   * elementwise operations work with either format. The result of a
+   * contraction is planar if it is computed from planar tensors (see
+   * CONTRACTION.H).
+   */
+  bool isPlanar() const { return planar; };
+  void setPlanar(bool planar) { convert(planar); };
 
 
 
@@ -230,23 +316,50 @@ public:
 
 private: // --------------------------------------------------------------
 
-  /* Initialise the tensor with a given rank and size */
-  void init(int rank, int size);
+  /* Initialise the tensor with a given rank and size, allocating a new data
+   * array, which is set to 0 if clear is true */
+  void init(int rank, int size, bool clear = true);
+
+  /* Give the tensor a new rank and size, reusing the data array if possible
+   * (see resize) */
+  void reset(int rank, int size, bool clear);
+
+  /* Lay out the data array according to the storage vector */
+  void apply();
+
+  /* Convert the data array to the planar or interleaved format */
+  void convert(bool planar);
 
-  /* Set or get a single element in the tensor by index */
-  cdouble getElement(const std::vector<int>& index) const;
-  void setElement(const std::vector<int>& index, cdouble value);
+  /* Point data to a new array of n elements, and give the array back to the
+   * allocator */
+  void allocate(long long n);
+  void release();
 
   /* The dimensions of the tensor */
   int dim;
   int n;
   long long int total_size;
 
-  /* The actual data in the tensor */
+  /* The number of elements allocated in the data array (at least
+   * total_size) */
+  long long int capacity;
+
+  /* The actual data in the tensor. A rank 0 tensor keeps its element in
+   * scalar. */
   cdouble* data;
+  cdouble scalar;
+
+  /* Whether the data array is in the planar format. The real and imaginary
+   * parts are then found at the start of data and total_size elements
+   * further on, as doubles. */
+  bool planar;
+
+  /* The allocator of the data array */
+  TensorAllocator* allocator;
 
-  /* Storage information on data */
+  /* Storage information on data, and the current layout of the data array */
   std::vector<int> storage;
+  std::vector<int> layout;
 };
 
 }
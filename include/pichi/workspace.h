@@ -0,0 +1,72 @@
+#ifndef PICHI_WORKSPACE_H
+#define PICHI_WORKSPACE_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file contains the definition of a ContractionWorkspace.
+ *
+ * The contraction engines need scratch buffers for slices and products.
+ * Without a workspace, these are allocated at the start of every
+ * contraction and released at the end. A workspace keeps the buffers
+ * between contractions, such that a program doing many contractions of
+ * similar size only allocates them once. The workspace can be passed to all
+ * the contract functions (see CONTRACTION.H) and to the execute functions
+ * of plans and batches (see PLAN.H).
+ *
+ * EXAMPLE:
+ *    ContractionWorkspace ws;
+ *    for (...) {
+ *      contract(a, b, {{1,0}}, res, &ws);
+ *    }
+ *
+ * The buffers are aligned to 64 bytes (a cache line). The threads of a
+ * parallel contraction each take their own buffers from the workspace, which
+ * is safe to use from several threads at the same time. It holds at most as
+ * many buffers as were in use at the same time, each as large as the
+ * largest request it served.
+ *
+ * ***********************************************************************/
+
+class ContractionWorkspace {
+
+public:
+
+  ContractionWorkspace();
+  ~ContractionWorkspace();
+
+  ContractionWorkspace(const ContractionWorkspace&) = delete;
+  ContractionWorkspace& operator=(const ContractionWorkspace&) = delete;
+
+  /*
+   * Gets the number of buffers held by the workspace, and the total number
+   * of elements in them. Buffers which are in use are not counted.
+   */
+  int countBuffers() const;
+  long long countElements() const;
+
+  /*
+   * Releases all the buffers which are not in use.
+   */
+  void clear();
+
+private:
+
+  friend class WorkspaceBuffer;
+
+  // An aligned buffer (see BUFFER.H)
+  struct Block;
+
+  mutable std::mutex mtx;
+  std::vector<std::unique_ptr<Block>> blocks;
+
+};
+
+}
+
+#endif //PICHI_WORKSPACE_H
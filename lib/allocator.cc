@@ -0,0 +1,133 @@
+/* ****************************************************************************
+ *
+ * Implementation of the allocators defined in ALLOCATOR.H, and of the
+ * aligned arrays defined in BUFFER.H
+ *
+ * ***************************************************************************/
+
+#include <atomic>
+#include <cstdint>
+#include "pichi/allocator.h"
+#include "buffer.h"
+
+using namespace std;
+
+namespace pichi {
+
+cdouble* allocateAligned(long long n) {
+  // Allocate enough bytes to find an aligned start within them, after room
+  // for the pointer to the actual allocation
+  char* raw = new char[n*sizeof(cdouble) + buffer_alignment + sizeof(char*)];
+  uintptr_t start = reinterpret_cast<uintptr_t>(raw + sizeof(char*));
+  start = (start + buffer_alignment - 1) / buffer_alignment * buffer_alignment;
+  reinterpret_cast<char**>(start)[-1] = raw;
+  return reinterpret_cast<cdouble*>(start);
+}
+
+void freeAligned(cdouble* data) {
+  if (data)
+    delete[] reinterpret_cast<char**>(data)[-1];
+}
+
+
+// --- Pool --------------------------------------------------------------
+
+/*
+ * Gets the size class of an array of n elements, and the number of elements
+ * in the arrays of the class. The sizes of the classes are m*2^e, with m
+ * one of 4, 5, 6 and 7, and the class is the smallest of these which holds
+ * n elements.
+ */
+static int sizeClass(long long n, long long& size) {
+  int e = 0;
+  while ((8LL << e) < n)
+    ++e;
+  long long m = ((n - 1) >> e) + 1; // n/2^e, rounded up
+  if (m < 4)
+    m = 4;
+  if (m == 8) {
+    m = 4;
+    ++e;
+  }
+  size = m << e;
+  return 4*e + (m - 4);
+}
+
+PoolAllocator::PoolAllocator(long long limit) : limit(limit) {
+  stats.hits = stats.misses = stats.pooled = 0;
+}
+
+PoolAllocator::~PoolAllocator() {
+  clear();
+}
+
+cdouble* PoolAllocator::allocate(long long n) {
+  long long size;
+  int c = sizeClass(n, size);
+  {
+    lock_guard<mutex> lock(mtx);
+    if (c < pool.size() && !pool[c].empty()) {
+      cdouble* data = pool[c].back();
+      pool[c].pop_back();
+      stats.pooled -= size;
+      ++stats.hits;
+      return data;
+    }
+    ++stats.misses;
+  }
+  return allocateAligned(size);
+}
+
+void PoolAllocator::deallocate(cdouble* data, long long n) {
+  long long size;
+  int c = sizeClass(n, size);
+  {
+    lock_guard<mutex> lock(mtx);
+    if (limit == 0 || stats.pooled + size <= limit) {
+      if (c >= pool.size())
+        pool.resize(c + 1);
+      pool[c].push_back(data);
+      stats.pooled += size;
+      return;
+    }
+  }
+  freeAligned(data);
+}
+
+PoolAllocator::Stats PoolAllocator::getStats() const {
+  lock_guard<mutex> lock(mtx);
+  return stats;
+}
+
+void PoolAllocator::clear() {
+  lock_guard<mutex> lock(mtx);
+  for (vector<cdouble*>& arrays : pool) {
+    for (cdouble* data : arrays)
+      freeAligned(data);
+    arrays.clear();
+  }
+  stats.pooled = 0;
+}
+
+
+// --- Global allocator --------------------------------------------------
+
+PoolAllocator& defaultPool() {
+  // The pool is never destroyed, such that tensors with static storage
+  // duration can still give their arrays back at exit.
+  static PoolAllocator* pool = new PoolAllocator(1LL << 24);
+  return *pool;
+}
+
+static atomic<TensorAllocator*> allocator(nullptr);
+
+void setAllocator(TensorAllocator* a) {
+  allocator = a;
+}
+
+TensorAllocator* getAllocator() {
+  TensorAllocator* a = allocator;
+  return (a ? a : &defaultPool());
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef PICHI_BUFFER_H
+#define PICHI_BUFFER_H
+
+#include <memory>
+#include "pichi/tensor.h"
+#include "pichi/workspace.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the scratch buffers used by the contraction engines.
+ *
+ * A WorkspaceBuffer takes a buffer from a ContractionWorkspace (see
+ * WORKSPACE.H) for as long as it lives, and gives it back when it
+ * goes out of scope. Without a workspace, the buffer is allocated and
+ * released by the WorkspaceBuffer itself. The elements of a buffer are not
+ * initialised.
+ *
+ * ***********************************************************************/
+
+// The alignment of the buffers and of tensor data, in bytes
+const int buffer_alignment = 64;
+
+/*
+ * Allocates an array of n elements, aligned to buffer_alignment bytes, and
+ * frees it again. The elements are not initialised.
+ */
+cdouble* allocateAligned(long long n);
+void freeAligned(cdouble* data);
+
+struct ContractionWorkspace::Block {
+
+  /*
+   * Allocates a block of n elements.
+   */
+  explicit Block(long long n);
+  ~Block();
+
+  Block(const Block&) = delete;
+  Block& operator=(const Block&) = delete;
+
+  cdouble* data;
+  long long capacity;
+
+};
+
+class WorkspaceBuffer {
+
+public:
+
+  /*
+   * Takes a buffer of at least n elements from the workspace, or allocates
+   * one if ws is null.
+   */
+  WorkspaceBuffer(ContractionWorkspace* ws, long long n);
+
+  /*
+   * Gives the buffer back to the workspace.
+   */
+  ~WorkspaceBuffer();
+
+  WorkspaceBuffer(const WorkspaceBuffer&) = delete;
+  WorkspaceBuffer& operator=(const WorkspaceBuffer&) = delete;
+
+  cdouble* data() { return block->data; };
+  cdouble& operator[](long long i) { return block->data[i]; };
+
+private:
+
+  ContractionWorkspace* ws;
+  std::unique_ptr<ContractionWorkspace::Block> block;
+
+};
+
+}
+
+#endif //PICHI_BUFFER_H
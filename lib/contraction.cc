@@ -8,16 +8,53 @@
 #include "pichi/contraction.h"
 #include "slice_iterator.h"
 #include "pichi/graph.h"
-#include "diagrams.h"
-#include <armadillo>
+#include "kernels.h"
+#include "engines.h"
+#include "buffer.h"
+#include "gemm.h"
+#include "thread_pool.h"
+#include "pichi/plan.h"
 #include <unordered_set>
-//#include <cblas.h> If being used with blas
 
 using namespace std;
-using namespace arma;
 
 namespace pichi {
 
+// The currently selected engine for two-tensor contractions
+static Engine engine = Engine::Auto;
+
+void setEngine(Engine e) {
+  engine = e;
+}
+
+Engine getEngine() {
+  return engine;
+}
+
+// The currently selected method for the matrix products of TTGT
+static GemmMethod method = GemmMethod::Standard;
+
+void setGemmMethod(GemmMethod m) {
+  method = m;
+}
+
+GemmMethod getGemmMethod() {
+  return method;
+}
+
+static long long memory_limit = 0;
+
+void setMemoryLimit(long long elements) {
+  if (elements < 0)
+    throw invalid_argument("Error in setMemoryLimit: The limit can not be "
+                           "negative");
+  memory_limit = elements;
+}
+
+long long getMemoryLimit() {
+  return memory_limit;
+}
+
 pair<bool,bool> detectTranspose(const std::vector<int>& slice1,
                                 const std::vector<int>& slice2) {
 
@@ -84,9 +121,14 @@ pair<bool,bool> detectTranspose(const std::vector<int>& slice1,
   return res;
 }
 
-void setStorage(Tensor& tensor, const std::vector<int> slicing) {
+/*
+ * Gets the storage which puts the two sliced indices of a slice into the
+ * leading dimensions, changing the given storage as little as possible.
+ */
+vector<int> slicedStorage(const std::vector<int>& store,
+                          const std::vector<int>& slicing) {
 
-  vector<int> storage = tensor.getStorage(); // The current storage
+  vector<int> storage = store; // The current storage
   int count = 0; // The currently found number of sliced indices
   for (int i = 0; count < 2; ++i) { // Find the 2 sliced indices
     // The index is sliced if the slice value is negative.
@@ -107,19 +149,36 @@ void setStorage(Tensor& tensor, const std::vector<int> slicing) {
       ++count;
     }
   }
-  tensor.setStorage(storage);
+  return storage;
+
+}
 
+/*
+ * Gets the storage of an output tensor, which has the sliced indices of the
+ * output slice in the leading dimensions.
+ */
+vector<int> outputStorage(const std::vector<int>& slice_out) {
+  int rank = slice_out.size();
+  vector<int> storage_out(rank, 0);
+  int count1 = 0;
+  int count2 = 2;
+  for (int i = 0; i < rank; ++i) {
+    if (slice_out[i] < 0)
+      storage_out[count1++] = i;
+    else
+      storage_out[count2++] = i;
+  }
+  return storage_out;
 }
 
 void contract(Tensor& tensor, const std::vector<std::pair<int,int>>& idx,
-              Tensor& out) {
+              Tensor& out, ContractionWorkspace* workspace) {
   if (idx.empty()) { // No contractions: return input tensor unmodified.
     out = tensor;
     return;
   }
 
-  // Find the output rank and size;
-  int rank = tensor.getRank() - 2*idx.size();
+  // Find the size
   int size = tensor.getSize();
 
   // Check that no index appears twice and that they are valid indices
@@ -134,62 +193,57 @@ void contract(Tensor& tensor, const std::vector<std::pair<int,int>>& idx,
                              "contains an index twice");
   }
 
-  // Set up slice iterator
-  SingleSliceIterator it(tensor, idx);
-
-  // Set storage for input tensor
-  setStorage(tensor, it.getSlice1());
-
-  // Create output tensor with correct storage
-  vector<int> storage_out(rank, 0);
-  int count1 = 0;
-  int count2 = 2;
-  for (int i = 0; i < rank; ++i) {
-    if (it.getSliceOut()[i] < 0)
-      storage_out[count1++] = i;
-    else
-      storage_out[count2++] = i;
-  }
-  out.resize(rank,size, storage_out);
-
-  cdouble data[tensor.getSize()*tensor.getSize()];
-  cdouble data_out[out.getSize() * out.getSize()];
-
-
-  do { // Loop over non-sliced free indices on the output tensor
-
-    // x is the current index in data_out, which resets when we change
-    // slice on the output tensor.
-    int x = 0;
-
-    do { // Loop through free indices sliced on the output tensor
-      data_out[x] = 0;
-
-      do { // Loop through contracted, non-sliced indices on input tensors
+  ContractionSetup setup = prepareContraction(size, tensor.getStorage(), idx);
+  runContraction(setup, tensor, out, workspace);
+}
 
-        // Get the current slices in matrix form
-        tensor.getSlice(it.getSlice1(), data);
 
-        data_out[x] += trace(cx_mat(data, tensor.getSize(), tensor.getSize()));
+ContractionSetup prepareContraction(int size, const std::vector<int>& store,
+                                    const std::vector<std::pair<int,int>>& idx) {
 
-        // Increase the contracted non-sliced indices on input tensors
-      } while (it.nextContracted());
+  ContractionSetup setup;
+  setup.kind = ContractionSetup::Trace;
+  setup.size = size;
+  setup.idx = idx;
+  setup.method = GemmMethod::Standard;
+  setup.store1 = store;
+  setup.rank = store.size() - 2*idx.size();
 
-      ++x;
+  // Find the output index of every free index
+  vector<int> out(store.size(), 0);
+  for (pair<int,int> p : idx) {
+    out[p.first] = -1;
+    out[p.second] = -1;
+  }
+  int count = 0;
+  for (int i = 0; i < store.size(); ++i) {
+    if (out[i] == 0)
+      out[i] = count++;
+  }
 
-      // Increase free indices, sliced on the output tensor
-    } while (it.nextSlicedFree());
+  // The input keeps its storage, and the free indices are stored on the
+  // output in the same order as on the input. The output is then written
+  // along the input as far as possible.
+  for (int i : store) {
+    if (out[i] >= 0)
+      setup.store_out.push_back(out[i]);
+  }
+  return setup;
+}
 
-    // Set the current slice of the output tensor
-    out.setSlice(it.getSliceOut(), data_out);
 
-  } while (it.nextNonSlicedFree());
+void runContraction(const ContractionSetup& setup, Tensor& tensor,
+                    Tensor& out, ContractionWorkspace*) {
 
+  // Every element of the output is written, so it is not cleared first
+  out.resize(setup.rank, setup.size, setup.store_out, false);
+  partialTrace(tensor, setup.idx, out);
 }
 
 
 void contract(Tensor& t1, Tensor& t2,
-                const std::vector<std::pair<int, int>>& idx, Tensor& out) {
+                const std::vector<std::pair<int, int>>& idx, Tensor& out,
+                ContractionWorkspace* workspace) {
 
   // Check that there are contracted indices
   if (idx.empty())
@@ -208,15 +262,97 @@ void contract(Tensor& t1, Tensor& t2,
                              "contains an index twice");
   }
 
-  // Compute output tensor rank and size
-  int rank1 = t1.getRank();
-  int rank2 = t2.getRank();
+  ContractionSetup setup = prepareContraction(t1.getSize(), t1.getStorage(),
+                                              t2.getStorage(), idx, engine,
+                                              method, t1.isPlanar() &&
+                                                      t2.isPlanar());
+  runContraction(setup, t1, t2, out, workspace);
+}
+
+
+ContractionSetup prepareContraction(int size, const std::vector<int>& store1,
+                                    const std::vector<int>& store2,
+                                    const std::vector<std::pair<int,int>>& idx,
+                                    Engine e, GemmMethod m, bool planar) {
+
+  ContractionSetup setup;
+  setup.size = size;
+  setup.idx = idx;
+  setup.method = m;
+  setup.store1 = store1;
+  setup.store2 = store2;
+
   int nc = idx.size();
-  int rank = rank1 + rank2 - 2*nc;
-  int size = t1.getSize();
+  setup.rank = store1.size() + store2.size() - 2*nc;
+
+  // Full contractions are computed directly as a dot product between the two
+  // tensors. This avoids forming a matrix product for every NC index
+  // combination only to take its trace.
+  if (setup.rank == 0) {
+    setup.kind = ContractionSetup::Inner;
+    return setup;
+  }
+
+  // Choose the engine. Planar tensors are kept planar by TTGT.
+  if (e == Engine::Auto)
+    e = (nc >= 2 || planar ? Engine::TTGT : Engine::Slice);
+
+  switch (e) {
+    case Engine::TTGT: {
+      setup.kind = ContractionSetup::TTGT;
+      prepareTTGT(setup);
+      break;
+    }
+    case Engine::Strided: {
+      setup.kind = ContractionSetup::Strided;
+      prepareStrided(setup);
+      break;
+    }
+    default: {
+      setup.kind = ContractionSetup::Slices;
+      prepareSlices(setup);
+      break;
+    }
+  }
+  return setup;
+}
+
+
+void runContraction(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                    Tensor& out, ContractionWorkspace* workspace) {
+
+  switch (setup.kind) {
+    case ContractionSetup::Inner: {
+      cdouble res = innerProduct(t1, t2, setup.idx);
+      out.resize(0, setup.size);
+      out.setSlice({}, &res);
+      break;
+    }
+    case ContractionSetup::TTGT: {
+      contractTTGT(setup, t1, t2, out, workspace);
+      break;
+    }
+    case ContractionSetup::Strided: {
+      contractStrided(setup, t1, t2, out, workspace);
+      break;
+    }
+    default: {
+      contractSlices(setup, t1, t2, out, workspace);
+      break;
+    }
+  }
+}
+
+
+void prepareSlices(ContractionSetup& setup) {
+
+  int rank1 = setup.store1.size();
+  int rank2 = setup.store2.size();
+  int nc = setup.idx.size();
 
   // Set up the iterator
-  DoubleSliceIterator it(t1, t2, idx);
+  auto it = make_shared<DoubleSliceIterator>(setup.size, setup.store1,
+                                             setup.store2, setup.idx);
 
   // We change the input data storage if it is beneficial based on a heuristic:
   // Let:
@@ -230,226 +366,300 @@ void contract(Tensor& t1, Tensor& t2,
   int rm = (rank1 > rank2 ? rank1 : rank2);
   int m = (nc == 1 ? rank1+rank2-4 : rank1+rank2-4-(nc-2));
   if (rm - m < 2) {
-    setStorage(t1, it.getSlice1());
-    setStorage(t2, it.getSlice2());
+    setup.store1 = slicedStorage(setup.store1, it->getSlice1());
+    setup.store2 = slicedStorage(setup.store2, it->getSlice2());
   }
 
-  // Create output tensor and set storage
-  vector<int> storage_out(rank, 0);
-  int count1 = 0;
-  int count2 = 2;
-  for (int i = 0; i < rank; ++i) {
-    if (it.getSliceOut()[i] < 0)
-      storage_out[count1++] = i;
-    else
-      storage_out[count2++] = i;
-  }
-  out.resize(rank, size, storage_out);
+  // Storage of the output tensor
+  setup.store_out = outputStorage(it->getSliceOut());
 
   // Detect whether transposition is needed (sliced indices will not change
   // during iteration)
-  auto trans = detectTranspose(it.getSlice1(),it.getSlice2());
-
-  // Containers for the data for matrix multiplication
-  cdouble data1[t1.getSize()*t1.getSize()];
-  cdouble data2[t2.getSize()*t2.getSize()];
-  cdouble data_out[out.getSize() * out.getSize()];
-
-  do { // Loop through free indices, not sliced on the output tensor
-
-    if (idx.size() >= 2) {
-      // Mult->Trace branch
-
-      // x is the current index in data_out, which resets when we change
-      // slice on the output tensor.
-      int x = 0;
-
-      do { // Loop through free indices sliced on the output tensor
-        data_out[x] = 0;
-
-        do { // Loop through contracted, non-sliced indices on input tensors
-
-          // Get the current slices in matrix form
-          bool s1 = t1.getSlice(it.getSlice1(), data1);
-          bool s2 = t2.getSlice(it.getSlice2(), data2);
-
-          // Check whether matrices should be transposed or not before
-          // multiplication
-          bool trans1 = ((trans.first && !s1) || (!trans.first && s1));
-          bool trans2 = ((trans.second && !s2) || (!trans.second && s2));
-
-          cx_mat m1(data1, t1.getSize(), t1.getSize());
-          cx_mat m2(data2, t2.getSize(), t2.getSize());
-
-          if ((trans1 && trans2) || (!trans1 && !trans2))
-            data_out[x] += trace(m1 * m2);
-          else
-            data_out[x] += trace(m1.st() * m2);
-
-          /* --------- DIRECT BLAS -------
-          int sz = t1.getSize();
-          double alpha = 1.0; double beta = 0.0;
-          cdouble res_data[sz*sz];
-
-          if (transpose_type == 0 || transpose_type == 3) {
-            cblas_zgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, sz, sz,
-                        sz, &alpha,
-                        reinterpret_cast<double *>(data1), sz,
-                        reinterpret_cast<double *>(data2), sz, &beta,
-                        reinterpret_cast<double *>(res_data), sz);
-          }
-          else {
-            cblas_zgemm(CblasColMajor, CblasTrans, CblasNoTrans, sz, sz,
-                        sz, &alpha,
-                        reinterpret_cast<double *>(data1), sz,
-                        reinterpret_cast<double *>(data2), sz, &beta,
-                        reinterpret_cast<double *>(res_data), sz);
-          }
-          for (int i = 0; i < sz; ++i)
-            data_out[x] += res_data[i+i*sz];*/
-
-          // Increase the contracted non-sliced indices on input tensors
-        } while (it.nextContracted());
-
-        ++x;
-
-        // Increase free indices, sliced on the output tensor
-      } while (it.nextSlicedFree());
-
-      // Set the current slice of the output tensor
-      out.setSlice(it.getSliceOut(), data_out);
-
-    } else {
-
-      // Mult branch
-
-      // Get the current slices in matrix form
-      bool s1 = t1.getSlice(it.getSlice1(), data1);
-      bool s2 = t2.getSlice(it.getSlice2(), data2);
-
-      // Check whether matrices should be transposed or not before
-      // multiplication
-      bool trans1 = ((trans.first && !s1) || (!trans.first && s1));
-      bool trans2 = ((trans.second && !s2) || (!trans.second && s2));
-
-      cx_mat m1(data1, t1.getSize(), t1.getSize());
-      cx_mat m2(data2, t2.getSize(), t2.getSize());
-
-      cx_mat mout; // The output slice in matrix form.
-      // Do the multiplication based on transpose type
-      if (!trans1 && !trans2)
-        mout = m1 * m2;
-      else if (trans1 && !trans2)
-        mout = m1.st() * m2;
-      else if (!trans1 && trans2)
-        mout = m1 * m2.st();
-      else
-        mout = strans(m2 * m1);
-
-      // Set the slice on the output tensor
-      out.setSlice(it.getSliceOut(), mout.memptr());
-
-
-      /* --------- DIRECT BLAS -------
-      int sz = t1.getSize();
-      double alpha = 1.0; double beta = 0.0;
-      cdouble res_data[sz*sz];
-      CBLAS_TRANSPOSE trans1;
-      if (transpose_type == 1)
-        trans1 = CblasTrans;
-      else
-        trans1 = CblasNoTrans;
-      CBLAS_TRANSPOSE trans2;
-      if (transpose_type == 2)
-        trans2 = CblasTrans;
-      else
-        trans2 = CblasNoTrans;
-
-      if (transpose_type == 3) {
-        cblas_zgemm(CblasRowMajor, CblasTrans, CblasTrans, sz, sz, sz, &alpha,
-                    reinterpret_cast<double *>(data2), sz,
-                    reinterpret_cast<double *>(data1), sz, &beta,
-                    reinterpret_cast<double *>(res_data), sz);
-      }
-      else {
-        cblas_zgemm(CblasColMajor, trans1, trans2, sz, sz, sz, &alpha,
-                    reinterpret_cast<double *>(data1), sz,
-                    reinterpret_cast<double *>(data2), sz, &beta,
-                    reinterpret_cast<double *>(res_data), sz);
-      }
-
-      // Set the slice on the output tensor
-      tout.setSlice(it.getSliceOut(), res_data);*/
-
-    }
-
-    // Increase the free indices not sliced on the output tensor
-  } while (it.nextNonSlicedFree());
+  setup.trans = detectTranspose(it->getSlice1(), it->getSlice2());
+  setup.slices = it;
 }
 
 
-void contract(const Graph& graph, std::vector<Tensor>& tensors, Tensor& out) {
-
-  Graph red(graph); // Working copy of the graph
+// Gets a slice with running strides run as a matrix with leading dimension
+// ld, in the orientation in which the columns are closest together in
+// memory. If these columns are contiguous, the matrix is the slice itself
+// in the data array. Otherwise the slice is gathered into buffer, with
+// ld = size. Returns true if the matrix is the transpose of the slice.
+static bool readSlice(int size, const cdouble* in,
+                      pair<long long,long long> run, cdouble* buffer,
+                      const cdouble*& out, long long& ld) {
+  bool trans = (run.first > run.second);
+  long long inc1 = (trans ? run.second : run.first);
+  long long inc2 = (trans ? run.first : run.second);
+  if (inc1 == 1) {
+    out = in;
+    ld = inc2;
+  } else {
+    gather(size, in, inc1, inc2, buffer);
+    out = buffer;
+    ld = size;
+  }
+  return trans;
+}
 
-  vector<Tensor> temps; // Storage of temporary tensors
-  int idx = tensors.size(); // Keeps track of how many tensors we have.
+// The largest number of elements in a panel of slices in the Mult branch
+static const long long panel = 1 << 12;
 
-  // We are done when the reduced graph has one node with no connections
-  while (!( (red.getNodes().size()==1) &&
-            (red.connections(*red.getNodes().begin()).empty()) )) {
+/*
+ * Mult branch of contractSlices, for the NF combinations [begin,end). The
+ * iterator starts at combination begin.
+ *
+ * While the NF indices of one tensor run (see fastestNonSlicedFree), the
+ * slice of the other tensor does not change. This slice is read once, and
+ * the changing slices are collected side by side in a panel, such that all
+ * of them are multiplied by the fixed slice in a single, wider GEMM:
+ *    op(A) [op(B_1) ... op(B_m)] = [C_1 ... C_m]
+ * or, if the slices of tensor 1 change,
+ *    op(B)^T [op(A_1)^T ... op(A_m)^T] = [C_1^T ... C_m^T] .
+ * Slices and panels which already have this form in memory, with contiguous
+ * columns spaced evenly, are used in place, and the product is written
+ * directly into the output tensor when its slices lie that way.
+ */
+static void multiplySlices(const ContractionSetup& setup,
+                           DoubleSliceIterator& its, const cdouble* a1,
+                           const cdouble* a2, cdouble* result,
+                           long long begin, long long end,
+                           ContractionWorkspace* workspace) {
+
+  int size = setup.size;
+  long long n2 = (long long)size*size;
+  pair<bool,bool> trans = setup.trans;
+  pair<long long,long long> run1 = its.getStrides1();
+  pair<long long,long long> run2 = its.getStrides2();
+  pair<long long,long long> run_out = its.getStridesOut();
+  bool vary1 = (its.fastestNonSlicedFree() != 2);
+
+  // The changing slices are gathered in the form they take in the product.
+  // The element (i,j) of op(X) is X(j,i) if X is transposed.
+  pair<long long,long long> run = (vary1 ? run1 : run2);
+  bool flip = (vary1 ? !trans.first : trans.second);
+  long long inc1 = (flip ? run.second : run.first);
+  long long inc2 = (flip ? run.first : run.second);
+  const cdouble* varying = (vary1 ? a1 : a2);
+
+  // Containers for the fixed slice, the panel and the products
+  long long m = (panel / n2 > 1 ? panel / n2 : 1);
+  if (m > end - begin)
+    m = end - begin;
+  WorkspaceBuffer fixed(workspace, n2);
+  WorkspaceBuffer data(workspace, m*n2);
+  WorkspaceBuffer data_out(workspace, m*n2);
+
+  // The offsets of the output slices of the panel, kept in a buffer of half
+  // as many complex numbers
+  WorkspaceBuffer offsets(workspace, (m + 1) / 2);
+  long long* os = reinterpret_cast<long long*>(offsets.data());
+
+  // The products are the output slices, transposed if the slices of tensor 1
+  // change
+  long long out1 = (vary1 ? run_out.second : run_out.first);
+  long long out2 = (vary1 ? run_out.first : run_out.second);
+
+  const cdouble* fixed_data = nullptr;
+  long long fixed_ld = size;
+  long long fixed_os = -1;
+  bool fixed_trans = false;
+  long long k = begin;
+  while (k < end) {
+
+    // Read the fixed slice, unless it is the one of the previous panel
+    long long f = (vary1 ? its.getOffset2() : its.getOffset1());
+    if (f != fixed_os) {
+      fixed_trans = (vary1 ? readSlice(size, a2 + f, run2, fixed.data(),
+                                       fixed_data, fixed_ld)
+                           : readSlice(size, a1 + f, run1, fixed.data(),
+                                       fixed_data, fixed_ld));
+      fixed_os = f;
+    }
 
-    // Extract an optimal subdiagram
-    int diag = identifyDiagram(red);
-    if (diag == -1) { // Unknown diagram
-      throw invalid_argument("Unknown diagram: " + red.toString());
+    // Collect the changing slices until the fixed slice changes. The
+    // iterator is advanced before a slice is gathered, such that the next
+    // slice is loaded into the cache in the meantime. The output slices are
+    // loaded while the panel is collected, to be written after the GEMM.
+    // The panel is used in place as long as the slices follow each other in
+    // memory.
+    const cdouble* first =
+        varying + (vary1 ? its.getOffset1() : its.getOffset2());
+    bool in_place = (inc1 == 1);
+    long long count = 0;
+    do {
+      const cdouble* slice =
+          varying + (vary1 ? its.getOffset1() : its.getOffset2());
+      os[count] = its.getOffsetOut();
+      prefetch(size, size, result + os[count], run_out.first, run_out.second,
+               true);
+      its.nextNonSlicedFree();
+      prefetch(size, size,
+               varying + (vary1 ? its.getOffset1() : its.getOffset2()),
+               inc1, inc2);
+      if (in_place && slice != first + count*size*inc2) {
+        for (long long c = 0; c < count; ++c)
+          gather(size, first + c*size*inc2, inc1, inc2, data.data() + c*n2);
+        in_place = false;
+      }
+      if (!in_place)
+        gather(size, slice, inc1, inc2, data.data() + count*n2);
+      ++count;
+      ++k;
+    } while (k < end && count < m &&
+             (vary1 ? its.getOffset2() : its.getOffset1()) == fixed_os);
+
+    // The products are written in place if the output slices have
+    // contiguous columns and follow each other in memory
+    bool direct = (out1 == 1);
+    for (long long c = 1; c < count && direct; ++c)
+      direct = (os[c] == os[0] + c*size*out2);
+    cdouble* product = (direct ? result + os[0] : data_out.data());
+
+    // Multiply the whole panel
+    bool op = (vary1 ? trans.second == fixed_trans
+                     : trans.first != fixed_trans);
+    gemm(op, false, size, count*size, size, fixed_data, fixed_ld,
+         (in_place ? first : data.data()), (in_place ? inc2 : size), 0.0,
+         product, (direct ? out2 : size));
+
+    // Set the slices of the output tensor
+    if (!direct) {
+      for (long long c = 0; c < count; ++c)
+        scatter(size, data_out.data() + c*n2, result + os[c], out1, out2);
     }
-    Graph ext = extract(red, identifyDiagram(red));
+  }
+}
 
-    // Do the contractions based on the extracted diagram
-    Tensor tout;
-    vector<pair<int,int>> contractions;
-    if (ext.getNodes().size() == 1) {
-      // Extracted diagram has one node
+/*
+ * Mult->Trace branch of contractSlices, for the NF combinations [begin,end).
+ * The iterator starts at combination begin. The elements of the output
+ * slices are the traces of the products of the input slices, summed over
+ * the non-sliced contracted indices.
+ */
+static void traceSlices(const ContractionSetup& setup,
+                        DoubleSliceIterator& its, const cdouble* a1,
+                        const cdouble* a2, cdouble* result, long long begin,
+                        long long end, ContractionWorkspace* workspace) {
+
+  int size = setup.size;
+  pair<bool,bool> trans = setup.trans;
+  pair<long long,long long> run1 = its.getStrides1();
+  pair<long long,long long> run2 = its.getStrides2();
+  pair<long long,long long> run_out = its.getStridesOut();
+
+  // Containers for slices which can not be used in place
+  WorkspaceBuffer data1(workspace, size*size);
+  WorkspaceBuffer data2(workspace, size*size);
+
+  for (long long k = begin; k < end; ++k) {
+    // Loop through free indices, not sliced on the output tensor
+
+    // The elements of the output slice are written in place. (i,j) is the
+    // current element, which resets when we change slice on the output
+    // tensor.
+    cdouble* slice_out = result + its.getOffsetOut();
+    int i = 0, j = 0;
+
+    // The indices are advanced right after the current slices are read,
+    // such that the next slices are loaded into the cache while the
+    // current ones are multiplied.
+    bool sliced = true;
+    while (sliced) { // Loop through free indices sliced on the output tensor
+      cdouble sum = 0.0;
+
+      bool contracted = true;
+      while (contracted) { // Loop through contracted, non-sliced indices
 
-      int tidx = *ext.getNodes().begin();
-      for (auto c : ext.allConnections()) {
-        contractions.push_back(make_pair(c.first.second,c.second.second));
+        // Get the current slices in matrix form
+        const cdouble *m1, *m2;
+        long long ld1, ld2;
+        bool s1 = readSlice(size, a1 + its.getOffset1(), run1,
+                            data1.data(), m1, ld1);
+        bool s2 = readSlice(size, a2 + its.getOffset2(), run2,
+                            data2.data(), m2, ld2);
+
+        // Increase the contracted non-sliced indices on input tensors, or
+        // the sliced free indices once they have all been through
+        contracted = its.nextContracted();
+        if (!contracted)
+          sliced = its.nextSlicedFree();
+        prefetch(size, size, a1 + its.getOffset1(), run1.first,
+                 run1.second);
+        prefetch(size, size, a2 + its.getOffset2(), run2.first,
+                 run2.second);
+
+        // Check whether matrices should be transposed or not before
+        // multiplication
+        bool trans1 = (trans.first != s1);
+        bool trans2 = (trans.second != s2);
+
+        sum += gemmTrace(trans1, trans2, size, m1, ld1, m2, ld2);
       }
-      contract(tensors[tidx], contractions,tout); // Tetraquark ERROR
 
-    }
-    else {
-      // Extracted diagram has two nodes
-
-      auto it = ext.getNodes().begin();
-      Tensor* t1;
-      if (*it < tensors.size())
-        t1 = &tensors[*it];
-      else
-        t1 = &temps[*it - tensors.size()];
-
-      it++;
-      Tensor* t2;
-      if (*it < tensors.size())
-        t2 = &tensors[*it];
-      else
-        t2 = &temps[*it - tensors.size()];
-
-      for (auto c : ext.allConnections()) {
-        contractions.push_back(make_pair(c.first.second,c.second.second));
+      slice_out[i*run_out.first + j*run_out.second] = sum;
+      if (++i == size) {
+        i = 0;
+        ++j;
       }
-      contract(*t1,*t2, contractions, tout);
-
     }
 
-    // Put the newly calculated tensor into the temporary array
-    temps.push_back(tout);
-    // Reduce the graph
-    red.reduce(ext, idx++);
-
+    // Increase the free indices not sliced on the output tensor
+    its.nextNonSlicedFree();
   }
-  out = temps[idx-tensors.size()-1];
+}
+
+void contractSliceRange(const ContractionSetup& setup,
+                        DoubleSliceIterator& its, const cdouble* a1,
+                        const cdouble* a2, cdouble* result, long long begin,
+                        long long end, ContractionWorkspace* workspace) {
+  if (setup.idx.size() == 1)
+    multiplySlices(setup, its, a1, a2, result, begin, end, workspace);
+  else
+    traceSlices(setup, its, a1, a2, result, begin, end, workspace);
+}
+
+void contractSlices(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                    Tensor& out, ContractionWorkspace* workspace) {
+
+  int size = setup.size;
+  const DoubleSliceIterator& it = *setup.slices;
+
+  // Set the storage of the inputs and create the output tensor. The slices
+  // of the inputs are read many times, so the storage is applied right away.
+  // Every element of the output is written, so it is not cleared first.
+  t1.setStorage(setup.store1);
+  t2.setStorage(setup.store2);
+  t1.applyStorage();
+  t2.applyStorage();
+  out.resize(setup.rank, size, setup.store_out, false);
+
+  // The slices are read and written directly in the data arrays
+  const cdouble* a1 = t1.getData();
+  const cdouble* a2 = t2.getData();
+  cdouble* result = out.getData();
+
+  // The non-sliced free indices are split between the threads. Each thread
+  // works on its own copy of the iterator and its own buffers, and writes
+  // its own slices of the output tensor. The buffers are taken from the
+  // workspace once, before the loop over the slices.
+  parallelFor(it.countNonSlicedFree(), [&](long long begin, long long end) {
+    DoubleSliceIterator its(it);
+    its.setLayout(setup.store1, setup.store2, setup.store_out);
+    its.setNonSlicedFree(begin);
+    contractSliceRange(setup, its, a1, a2, result, begin, end, workspace);
+  });
+}
+
+
+void contract(const Graph& graph, std::vector<Tensor>& tensors, Tensor& out,
+              ContractionWorkspace* workspace) {
+  // The plan is used once: an arena of its own would be freed with it, so
+  // the intermediates are taken from the global allocator instead, where
+  // their arrays are found again by the next evaluation
+  ContractionPlan plan(graph, tensors);
+  plan.arena.reset();
+  plan.execute(tensors, out, workspace);
 }
 
 
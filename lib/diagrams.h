@@ -29,6 +29,9 @@ namespace pichi {
  * |    8           |  A_abc B_abd C_def D_cef     | Baryon box             |
  * |    9           |     A_ab B_cd C_abcd         | Tetraquark - MM        |
  *  ------------------------------------------------------------------------
+ *
+ * Complete diagrams are no longer evaluated through these functions, but
+ * through the cost based schedule in SCHEDULE.H, which handles any diagram.
  */
 
 
@@ -1,21 +1,55 @@
 #include <stdexcept>
 #include <unordered_set>
-#include <queue>
-#include <iostream>
+#include <algorithm>
+#include <sstream>
 #include "slice_iterator.h"
 
 using namespace std;
 
 namespace pichi {
 
+// --- Cost model --------------------------------------------------------
+
+/*
+ * The roles of the indices are chosen by a simple model of the memory
+ * traffic in the inner loops. Reading an (n x n) slice of a tensor costs,
+ * per element (see gather in KERNELS.H)
+ *    4   if the slice is one contiguous block of memory,
+ *    5   if its columns are contiguous, i.e. one of the running indices is
+ *        the leading dimension of the tensor,
+ *    16  otherwise, since every element is then read from a cache line of
+ *        its own, which would have held four elements.
+ * Among slices of the same cost, the ones whose running indices are closest
+ * to the leading dimensions are preferred. The second number of a cost is
+ * the sum of the positions of the running indices in the storage.
+ */
+typedef pair<int,int> Cost;
+
+static Cost readCost(int p, int q) {
+  int lo = (p < q ? p : q);
+  int hi = (p < q ? q : p);
+  return make_pair(lo != 0 ? 16 : (hi == 1 ? 4 : 5), p + q);
+}
+
+static Cost operator+(const Cost& a, const Cost& b) {
+  return make_pair(a.first + b.first, a.second + b.second);
+}
+
+// -----------------------------------------------------------------------
 
 DoubleSliceIterator::DoubleSliceIterator(
     const Tensor& t1, const Tensor& t2,
+    const std::vector<std::pair<int, int>>& contr)
+    : DoubleSliceIterator(t1.getSize(), t1.getStorage(), t2.getStorage(),
+                          contr) {}
+
+DoubleSliceIterator::DoubleSliceIterator(
+    int n, const std::vector<int>& store1, const std::vector<int>& store2,
     const std::vector<std::pair<int, int>>& contr) {
 
-  int rank1 = t1.getRank();
-  int rank2 = t2.getRank();
-  size = t1.getSize();
+  int rank1 = store1.size();
+  int rank2 = store2.size();
+  size = n;
 
   // Check rank and size
   if (rank1 < 2 || rank2 < 2) {
@@ -38,248 +72,306 @@ DoubleSliceIterator::DoubleSliceIterator(
       throw invalid_argument("Repeated index in contraction list");
   }
 
-  vector<int> store1 = t1.getStorage();
-  vector<int> store2 = t2.getStorage();
-
   // Set up data structures
 
   slice1 = vector<int>(rank1, 0);
   slice2 = vector<int>(rank2, 0);
   slice_out = vector<int>(rank1+rank2-2*contr.size(), 0);
+  stride1 = vector<long long>(rank1, 0);
+  stride2 = vector<long long>(rank2, 0);
+  stride_out = vector<long long>(slice_out.size(), 0);
+  os1 = os2 = os_out = 0;
+  run1 = run2 = run_out = make_pair(0LL, 0LL);
+
+  // Position of each index in the storage of the tensors, and the stride
+  // which goes with it
+  vector<int> pos1(rank1), pos2(rank2);
+  for (int i = 0; i < rank1; ++i)
+    pos1[store1[i]] = i;
+  for (int i = 0; i < rank2; ++i)
+    pos2[store2[i]] = i;
+  auto stride = [n](int p) {
+    long long res = 1;
+    for (int i = 0; i < p; ++i)
+      res *= n;
+    return res;
+  };
+
+  // Orders the NF indices of a tensor such that the one with the shortest
+  // strides on the input and output tensors runs fastest. The output tensor
+  // is assumed to have its sliced indices leading, followed by the other
+  // indices in order (see outputStorage in CONTRACTION.CC).
+  auto orderFree = [&](vector<pair<int,int>>& nf, const vector<int>& pos) {
+    vector<long long> key(slice_out.size(), 0);
+    int p = 2;
+    for (int i = 0; i < slice_out.size(); ++i)
+      if (slice_out[i] >= 0)
+        key[i] = stride(p++);
+    stable_sort(nf.begin(), nf.end(),
+                [&](const pair<int,int>& a, const pair<int,int>& b) {
+      return (stride(pos[a.first]) + key[a.second] <
+              stride(pos[b.first]) + key[b.second]);
+    });
+  };
 
   if (contr.size() == 1) {
 
     // There is one contracted index:
-
-    // Two cases:
-    // 1) The contracted index is in a leading dimension.
     //    SC: the contracted index
     //    NC: none
-    //    SF: the index in the remaining leading dimension
-    //    NF: the rest
-    // 2) The contracted index is not in a leading dimension.
-    //    SC: the contracted index
-    //    NC: none
-    //    SF: the index in the leading dimension
+    //    SF: on each tensor, the free index which gives the cheapest slice
+    //        together with the contracted index (see readCost)
     //    NF: the rest
 
     pair<int,int> c = contr[0];
 
+    int f1 = -1;
+    for (int i = 0; i < rank1; ++i) {
+      if (i != c.first && (f1 < 0 || readCost(pos1[c.first], pos1[i]) <
+                                     readCost(pos1[c.first], pos1[f1])))
+        f1 = i;
+    }
+    int f2 = -1;
+    for (int i = 0; i < rank2; ++i) {
+      if (i != c.second && (f2 < 0 || readCost(pos2[c.second], pos2[i]) <
+                                      readCost(pos2[c.second], pos2[f2])))
+        f2 = i;
+    }
+
     int out_index = 0;
     // Start with tensor 1
     for (int i = 0; i < rank1; ++i) {
       if (i == c.first) {
-        // This is the contracted index: SC
         slice1[i] = -1;
       }
-      else if (i == store1[0]) {
-        // Not contracted, but leading: SF
+      else if (i == f1) {
         slice1[i] = -2;
         slice_out[out_index++] = -1;
       }
-      else if (i == store1[1]) {
-        // Not contracted, but sub-leading: SF or NF
-        if (c.first == store1[0]) {
-          // SF
-          slice1[i] = -2;
-          slice_out[out_index++] = -1;
-        }
-        else {
-          // NF
-          nf1.push_back(make_pair(i,out_index++));
-        }
-      }
       else {
-        // Not contracted, not a leading dimension: NF
         nf1.push_back(make_pair(i,out_index++));
       }
     }
     // ... then tensor 2
     for (int i = 0; i < rank2; ++i) {
       if (i == c.second) {
-        // This is the contracted index: SC
         slice2[i] = -1;
       }
-      else if (i == store2[0]) {
-        // Not contracted, but leading: SF
+      else if (i == f2) {
         slice2[i] = -2;
         slice_out[out_index++] = -1;
       }
-      else if (i == store2[1]) {
-        // Not contracted, but sub-leading: SF or NF
-        if (c.second == store2[0]) {
-          // SF
-          slice2[i] = -2;
-          slice_out[out_index++] = -1;
-        }
-        else {
-          // NF
-          nf2.push_back(make_pair(i,out_index++));
-        }
-      }
       else {
-        // Not contracted, not a leading dimension: NF
         nf2.push_back(make_pair(i,out_index++));
       }
     }
 
+    orderFree(nf1, pos1);
+    orderFree(nf2, pos2);
 
   }
   else {
 
     // There are two or more contracted indices:
 
-    // We slice along two of the contracted indices. We go through the list
-    // of contracted indices repeatedly until we have two indices to slice.
-    // First pass: take any index in a leading dimension on both tensors
-    // Second pass: take any index in a leading dimension on one tensor.
-    // Last pass: take any contracted index until we have two.
+    // We slice along the two contracted indices which give the cheapest
+    // slices on the two tensors together (see readCost). The rest of the
+    // contracted indices are NC indices, where the one with the shortest
+    // strides runs fastest.
 
-    // After having selected the SC indices, all the rest of the contracted
-    // indices are NC indices
-
-    // We now choose the SF indices. If the result is not a scalar, then we
-    // need two SF indices. Otherwise we need none.
-    // We start adding any index which is a leading dimension index but is
-    // not contracted. If we are still missing one or two SF indices, we
-    // simply pick the first two free indices available.
+    // We then choose the SF indices. If the result is not a scalar, then we
+    // need two SF indices. Otherwise we need none. The SF indices are not
+    // running on the input slices, so we take the free indices closest to
+    // the leading dimensions, to keep consecutive slices close in memory.
 
     // The rest of the free indices are NF indices.
 
-    // We keep a list of whether the indices are free or contracted
     vector<bool> free1(rank1, true);
     vector<bool> free2(rank2, true);
-
-    // First we insert all the contractions into a queue
-    queue<pair<int,int>> contr_cp;
     for (pair<int,int> c : contr) {
       free1[c.first] = false;
       free2[c.second] = false;
-      contr_cp.push(c);
     }
 
-    // Pass through list of contracted indices until we have two SC
-    int pass = 0; int found = 0;
-    while (found < 2) {
-      int pass_length = contr_cp.size();
-      for (int i = 0; (i < pass_length && found < 2); ++i) {
-        pair<int,int> c = contr_cp.front();
-        contr_cp.pop();
-        if (pass == 0 &&
-            ((c.first  == store1[0] || c.first  == store1[1]) &&
-             (c.second == store2[0] || c.second == store2[1]))) {
-          // First pass and index is leading on both tensors
-          slice1[c.first]  = -(++found);
-          slice2[c.second] = -found;
-        }
-        else if (pass == 1 &&
-                 (c.first  == store1[0] || c.first  == store1[1] ||
-                  c.second == store2[0] || c.second == store2[1])) {
-          // Second pass and index is leading on one tensor
-          slice1[c.first]  = -(++found);
-          slice2[c.second] = -found;
-        }
-        else if (pass == 2) {
-          // Third pass: take the index no matter what
-          slice1[c.first]  = -(++found);
-          slice2[c.second] = -found;
-        }
-        else {
-          // The contracted index is not a good slicing index. Back in line.
-          contr_cp.push(c);
+    int a = 0, b = 1;
+    Cost best = readCost(pos1[contr[0].first], pos1[contr[1].first]) +
+                readCost(pos2[contr[0].second], pos2[contr[1].second]);
+    for (int i = 0; i < contr.size(); ++i) {
+      for (int j = i+1; j < contr.size(); ++j) {
+        Cost cost = readCost(pos1[contr[i].first], pos1[contr[j].first]) +
+                    readCost(pos2[contr[i].second], pos2[contr[j].second]);
+        if (cost < best) {
+          best = cost;
+          a = i;
+          b = j;
         }
       }
-      ++pass;
-    }
-
-    // All indices still in the queue go in the NC category
-    while (!contr_cp.empty()) {
-      nc.push_back(contr_cp.front());
-      contr_cp.pop();
     }
+    slice1[contr[a].first] = -1;
+    slice2[contr[a].second] = -1;
+    slice1[contr[b].first] = -2;
+    slice2[contr[b].second] = -2;
+
+    for (int i = 0; i < contr.size(); ++i)
+      if (i != a && i != b)
+        nc.push_back(contr[i]);
+    stable_sort(nc.begin(), nc.end(),
+                [&](const pair<int,int>& x, const pair<int,int>& y) {
+      return (stride(pos1[x.first]) + stride(pos2[x.second]) <
+              stride(pos1[y.first]) + stride(pos2[y.second]));
+    });
 
     // If the two tensors are completely contracted, we stop here
     if (slice_out.size() == 0)
       return;
 
-    // There are free indices. Put them into a queue
-    queue<pair<int,int>> free1q;
-    queue<pair<int,int>> free2q;
+    // The SF indices of a tensor: the two free indices closest to the
+    // leading dimension
+    auto closest = [](const vector<bool>& free, const vector<int>& pos,
+                      vector<bool>& sliced) {
+      int count = 0;
+      int sum = 0;
+      for (int p = 0; p < pos.size() && count < 2; ++p) {
+        for (int i = 0; i < pos.size(); ++i) {
+          if (pos[i] == p && free[i]) {
+            sliced[i] = true;
+            sum += p;
+            ++count;
+          }
+        }
+      }
+      return (count == 2 ? sum : -1);
+    };
+
+    // If the SF indices are all on one tensor, the slice of the other tensor
+    // is the same for all of them, and stays in cache when there are no NC
+    // indices. We therefore take both SF indices from the tensor where they
+    // are closest to the leading dimension, or one from each tensor if
+    // neither tensor has two free indices.
+    vector<bool> sliced1(rank1, false);
+    vector<bool> sliced2(rank2, false);
+    int sum1 = closest(free1, pos1, sliced1);
+    int sum2 = closest(free2, pos2, sliced2);
+    if (sum1 >= 0 && (sum2 < 0 || sum1 <= sum2))
+      sliced2 = vector<bool>(rank2, false);
+    else if (sum2 >= 0)
+      sliced1 = vector<bool>(rank1, false);
 
     int out_index = 0;
     for (int i = 0; i < rank1; ++i) {
-      if (free1[i])
-        free1q.push(make_pair(i,out_index++));
+      if (!free1[i])
+        continue;
+      if (sliced1[i]) {
+        sf1.push_back(i);
+        slice_out[out_index] = -1;
+      }
+      else
+        nf1.push_back(make_pair(i,out_index));
+      ++out_index;
     }
     for (int i = 0; i < rank2; ++i) {
-      if (free2[i])
-        free2q.push(make_pair(i,out_index++));
-    }
-
-    // Pass through the free indices until we have two SF
-    pass = 0; found = 0;
-    while (found < 2) {
-      int pass_length = free1q.size();
-      for (int i = 0; (i < pass_length && found < 2); ++i) {
-        pair<int,int> f = free1q.front();
-        free1q.pop();
-        if (pass == 0 &&
-            (f.first == store1[0] || f.first == store1[1])) {
-          // First pass and index is leading on tensor 1
-          sf1.push_back(f.first);
-          slice_out[f.second] = -1;
-          ++found;
-        }
-        else if (pass == 1) {
-          // Second pass: take the index no matter what
-          sf1.push_back(f.first);
-          slice_out[f.second] = -1;
-          ++found;
-        }
-        else {
-          // The index is not a good slicing index. Back in line.
-          free1q.push(f);
-        }
+      if (!free2[i])
+        continue;
+      if (sliced2[i]) {
+        sf2.push_back(i);
+        slice_out[out_index] = -1;
       }
-      pass_length = free2q.size();
-      for (int i = 0; (i < pass_length && found < 2); ++i) {
-        pair<int,int> f = free2q.front();
-        free2q.pop();
-        if (pass == 0 &&
-            (f.first == store2[0] || f.first == store2[1])) {
-          // First pass and index is leading on tensor 1
-          sf2.push_back(f.first);
-          slice_out[f.second] = -1;
-          ++found;
-        }
-        else if (pass == 1) {
-          // Second pass: take the index no matter what
-          sf2.push_back(f.first);
-          slice_out[f.second] = -1;
-          ++found;
-        }
-        else {
-          // The index is not a good slicing index. Back in line.
-          free2q.push(f);
-        }
-      }
-      ++pass;
+      else
+        nf2.push_back(make_pair(i,out_index));
+      ++out_index;
     }
 
-    // All the rest of the free indices go in the NF category
-    while (!free1q.empty()) {
-      nf1.push_back(free1q.front());
-      free1q.pop();
+    orderFree(nf1, pos1);
+    orderFree(nf2, pos2);
+
+  }
+
+}
+
+vector<long long> sliceStrides(int size, const std::vector<int>& store,
+                               const std::vector<int>& slice,
+                               std::pair<long long,long long>& run,
+                               long long& offset) {
+  vector<long long> res(store.size(), 0);
+  vector<long long> all(store.size());
+  long long mult = 1;
+  for (int i : store) {
+    all[i] = mult;
+    mult *= size;
+  }
+  offset = 0;
+  bool first = true;
+  for (int i = 0; i < slice.size(); ++i) {
+    if (slice[i] >= 0) {
+      res[i] = all[i];
+      offset += slice[i]*all[i];
     }
-    while (!free2q.empty()) {
-      nf2.push_back(free2q.front());
-      free2q.pop();
+    else if (first) {
+      run.first = all[i];
+      first = false;
     }
+    else
+      run.second = all[i];
+  }
+  return res;
+}
 
+void DoubleSliceIterator::setLayout(const std::vector<int>& store1,
+                                    const std::vector<int>& store2,
+                                    const std::vector<int>& store_out) {
+  stride1 = sliceStrides(size, store1, slice1, run1, os1);
+  stride2 = sliceStrides(size, store2, slice2, run2, os2);
+  if (!slice_out.empty())
+    stride_out = sliceStrides(size, store_out, slice_out, run_out, os_out);
+}
 
-
+std::string DoubleSliceIterator::toString() const {
+  ostringstream res;
+
+  // With a single contracted index, the SF indices are running on the input
+  // slices (marked by -2) instead of being advanced by nextSlicedFree
+  bool mult = (sf1.empty() && sf2.empty() && !slice_out.empty());
+
+  res << "SC";
+  for (int k = -1; k >= (mult ? -1 : -2); --k) {
+    int i = 0, j = 0;
+    while (slice1[i] != k)
+      ++i;
+    while (slice2[j] != k)
+      ++j;
+    res << " (" << i << "," << j << ")";
+  }
+  if (!nc.empty()) {
+    res << " | NC";
+    for (pair<int,int> p : nc)
+      res << " (" << p.first << "," << p.second << ")";
   }
 
+  if (slice_out.empty())
+    return res.str();
+
+  res << " | SF";
+  if (mult) {
+    for (int i = 0; i < slice1.size(); ++i)
+      if (slice1[i] == -2)
+        res << " 1:" << i;
+    for (int i = 0; i < slice2.size(); ++i)
+      if (slice2[i] == -2)
+        res << " 2:" << i;
+  } else {
+    for (int i : sf1)
+      res << " 1:" << i;
+    for (int i : sf2)
+      res << " 2:" << i;
+  }
+  if (!nf1.empty() || !nf2.empty()) {
+    res << " | NF";
+    for (pair<int,int> p : nf1)
+      res << " 1:" << p.first;
+    for (pair<int,int> p : nf2)
+      res << " 2:" << p.first;
+  }
+  return res.str();
 }
 
 std::vector<int> DoubleSliceIterator::getSlice1() const {
@@ -308,10 +400,14 @@ bool DoubleSliceIterator::nextContracted() {
       // This NC index needs to roll over
       slice1[nc[i].first] = 0;
       slice2[nc[i].second] = 0;
+      os1 -= (size-1)*stride1[nc[i].first];
+      os2 -= (size-1)*stride2[nc[i].second];
       // Now continue with i+1'th NC index
     } else {
       // No roll over, so increase the corresponding NC index on slice 2...
       ++slice2[nc[i].second];
+      os1 += stride1[nc[i].first];
+      os2 += stride2[nc[i].second];
       // ... and escape the loop
       flag = false;
     }
@@ -334,10 +430,14 @@ bool DoubleSliceIterator::nextNonSlicedFree() {
       // This NF index needs to roll over
       slice1[nf1[i].first] = 0;
       slice_out[nf1[i].second] = 0;
+      os1 -= (size-1)*stride1[nf1[i].first];
+      os_out -= (size-1)*stride_out[nf1[i].second];
     } else {
       // No roll over, so increase the corresponding index on the output
       // slice...
       ++slice_out[nf1[i].second];
+      os1 += stride1[nf1[i].first];
+      os_out += stride_out[nf1[i].second];
       // .. and escape the loop
       flag = false;
     }
@@ -353,8 +453,12 @@ bool DoubleSliceIterator::nextNonSlicedFree() {
     if (z == size) {
       slice2[nf2[i].first] = 0;
       slice_out[nf2[i].second] = 0;
+      os2 -= (size-1)*stride2[nf2[i].first];
+      os_out -= (size-1)*stride_out[nf2[i].second];
     } else {
       ++slice_out[nf2[i].second];
+      os2 += stride2[nf2[i].first];
+      os_out += stride_out[nf2[i].second];
       flag = false;
     }
   }
@@ -363,6 +467,42 @@ bool DoubleSliceIterator::nextNonSlicedFree() {
   return !flag;
 }
 
+long long DoubleSliceIterator::countNonSlicedFree() const {
+  long long count = 1;
+  for (int i = 0; i < nf1.size() + nf2.size(); ++i)
+    count *= size;
+  return count;
+}
+
+int DoubleSliceIterator::fastestNonSlicedFree() const {
+  if (!nf1.empty())
+    return 1;
+  return (nf2.empty() ? 0 : 2);
+}
+
+void DoubleSliceIterator::setNonSlicedFree(long long k) {
+  // The NF indices on tensor 1 run fastest, then the ones on tensor 2
+  for (pair<int,int> p : nf1) {
+    slice1[p.first] = k % size;
+    slice_out[p.second] = k % size;
+    k /= size;
+  }
+  for (pair<int,int> p : nf2) {
+    slice2[p.first] = k % size;
+    slice_out[p.second] = k % size;
+    k /= size;
+  }
+
+  // Recompute the offsets
+  os1 = os2 = os_out = 0;
+  for (int i = 0; i < slice1.size(); ++i)
+    os1 += (slice1[i] > 0 ? slice1[i]*stride1[i] : 0);
+  for (int i = 0; i < slice2.size(); ++i)
+    os2 += (slice2[i] > 0 ? slice2[i]*stride2[i] : 0);
+  for (int i = 0; i < slice_out.size(); ++i)
+    os_out += (slice_out[i] > 0 ? slice_out[i]*stride_out[i] : 0);
+}
+
 bool DoubleSliceIterator::nextSlicedFree() {
 
   bool flag = true;
@@ -371,15 +511,21 @@ bool DoubleSliceIterator::nextSlicedFree() {
     int z = ++slice1[sf1[i]];
     if (size == z) {
       slice1[sf1[i]] = 0;
-    } else
+      os1 -= (size-1)*stride1[sf1[i]];
+    } else {
+      os1 += stride1[sf1[i]];
       flag = false;
+    }
   }
   for (int i = 0; i < sf2.size() && flag; ++i) {
     int z = ++slice2[sf2[i]];
     if (size == z) {
       slice2[sf2[i]] = 0;
-    } else
+      os2 -= (size-1)*stride2[sf2[i]];
+    } else {
+      os2 += stride2[sf2[i]];
       flag = false;
+    }
   }
 
   return !flag;
@@ -0,0 +1,137 @@
+#ifndef PICHI_ENGINES_H
+#define PICHI_ENGINES_H
+
+#include <vector>
+#include <memory>
+#include "pichi/tensor.h"
+#include "pichi/contraction.h"
+#include "slice_iterator.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the engines used for contracting two tensors.
+ *
+ * Each engine is a complete implementation of a two-tensor contraction with
+ * at least one free index. The public contract function validates the input
+ * and dispatches the work to one of the engines (see CONTRACTION.H for a
+ * description of each). The engines assume that the input is valid.
+ *
+ * A contraction is done in two parts. The first part (prepare) makes all the
+ * decisions which only depend on the layout of the tensors, the second part
+ * (run) does the actual work. Contractions which are repeated for new data,
+ * as in a ContractionPlan (see PLAN.H), only need the second part.
+ *
+ * ***********************************************************************/
+
+/*
+ * A contraction prepared for tensors of a given layout. It holds everything
+ * which only depends on the rank, size and storage of the input tensors and
+ * not on their data: the engine, the storage the inputs are given before the
+ * contraction, the rank and storage of the output tensor and the initial
+ * state of the slice iterator. A setup can be used for any number of
+ * contractions of tensors with the same layout.
+ */
+struct ContractionSetup {
+
+  // Trace: single tensor contraction (partialTrace).
+  // Inner: complete contraction of two tensors (innerProduct).
+  // Slices, TTGT, Strided: the two-tensor engines.
+  enum Kind {Trace, Inner, Slices, TTGT, Strided};
+
+  Kind kind;
+  int size;
+  std::vector<std::pair<int,int>> idx;
+
+  // Storage of the input tensors during the contraction
+  std::vector<int> store1;
+  std::vector<int> store2;
+
+  // Rank and storage of the output tensor
+  int rank;
+  std::vector<int> store_out;
+
+  // TTGT: the method of the matrix product
+  GemmMethod method;
+
+  // Slices: the initial iterator and the transposition of the slices
+  std::shared_ptr<const DoubleSliceIterator> slices;
+  std::pair<bool,bool> trans;
+
+};
+
+/*
+ * Prepares the contraction of a single tensor, or of two tensors with a given
+ * engine and method for the matrix products, from the size and storage of
+ * the tensors. If both tensors are planar (planar), the Auto engine chooses
+ * TTGT, which keeps them planar. The input is assumed to be valid.
+ */
+ContractionSetup prepareContraction(int size, const std::vector<int>& store,
+                                    const std::vector<std::pair<int,int>>& idx);
+ContractionSetup prepareContraction(int size, const std::vector<int>& store1,
+                                    const std::vector<int>& store2,
+                                    const std::vector<std::pair<int,int>>& idx,
+                                    Engine engine,
+                                    GemmMethod method = GemmMethod::Standard,
+                                    bool planar = false);
+
+/*
+ * Carries out a prepared contraction. The tensors must have the rank and size
+ * of the setup. Their storage is changed to the one in the setup, which is
+ * the storage they already have for traces and the Strided engine. Scratch
+ * buffers are taken from the workspace, if one is given.
+ */
+void runContraction(const ContractionSetup& setup, Tensor& tensor,
+                    Tensor& out, ContractionWorkspace* workspace = nullptr);
+void runContraction(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                    Tensor& out, ContractionWorkspace* workspace = nullptr);
+
+/*
+ * Slice by slice contraction using the DoubleSliceIterator.
+ */
+void prepareSlices(ContractionSetup& setup);
+void contractSlices(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                    Tensor& out, ContractionWorkspace* workspace = nullptr);
+
+/*
+ * The part of contractSlices done by one thread: the loop over the NF
+ * combinations [begin,end) of the slice iterator. The iterator must have the
+ * layout of the data arrays, which are laid out according to the setup, and
+ * be at combination begin. The slices are read from a1 and a2 and written
+ * into result. The scratch buffers are taken from the workspace, if one is
+ * given, and nothing else is allocated.
+ */
+void contractSliceRange(const ContractionSetup& setup,
+                        DoubleSliceIterator& its, const cdouble* a1,
+                        const cdouble* a2, cdouble* result, long long begin,
+                        long long end, ContractionWorkspace* workspace);
+
+/*
+ * Transpose-Transpose-GEMM contraction. The storage of the input tensors is
+ * changed such that tensor 1 is a (free x contracted) matrix and tensor 2 is a
+ * (contracted x free) matrix. The output tensor is given default storage.
+ * With the Gauss method, or for planar tensors, the real and imaginary
+ * planes of interleaved tensors are split into buffers from the workspace.
+ */
+void prepareTTGT(ContractionSetup& setup);
+void contractTTGT(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                  Tensor& out, ContractionWorkspace* workspace = nullptr);
+
+/*
+ * Strided contraction. The storage of the input tensors is left as it is.
+ * The contracted indices and the free indices of each tensor are fused into
+ * the dimensions of a matrix product, whose blocks are packed straight from
+ * the data arrays as they are laid out, using the strides of the indices.
+ * Operands which already are matrices in memory are used in place. The
+ * output tensor stores the free indices of each input in the order in
+ * which they are stored on the input. Planar tensors are interleaved into a
+ * buffer taken from the workspace, and are left as they are.
+ */
+void prepareStrided(ContractionSetup& setup);
+void contractStrided(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                     Tensor& out, ContractionWorkspace* workspace = nullptr);
+
+}
+
+#endif //PICHI_ENGINES_H
@@ -0,0 +1,406 @@
+/* ****************************************************************************
+ *
+ * Implementation of the matrix multiplication layer defined in GEMM.H
+ *
+ * ***************************************************************************/
+
+#include <stdexcept>
+#include <algorithm>
+#include <armadillo>
+#ifdef PICHI_USE_BLAS
+#include <cblas.h>
+#endif
+#include "pichi/contraction.h"
+#include "gemm.h"
+#include "kernels.h"
+#include "simd.h"
+
+using namespace std;
+using namespace arma;
+
+namespace pichi {
+
+// The currently selected backend. Use BLAS directly if it is available.
+#ifdef PICHI_USE_BLAS
+static Backend backend = Backend::BLAS;
+#else
+static Backend backend = Backend::Armadillo;
+#endif
+
+void setBackend(Backend b) {
+#ifndef PICHI_USE_BLAS
+  if (b == Backend::BLAS)
+    throw invalid_argument("Error in setBackend: PICHI was built without "
+                           "BLAS support");
+#endif
+  backend = b;
+}
+
+Backend getBackend() {
+  return backend;
+}
+
+
+// --- Armadillo ---------------------------------------------------------
+
+/*
+ * Updates C with the product X, taking beta into account:
+ *    C = X + beta C
+ */
+template<typename T1, typename T2, typename S>
+void update(T1& c, const T2& x, S beta) {
+  if (beta == 0.0)
+    c = x;
+  else {
+    c *= beta;
+    c += x;
+  }
+}
+
+/*
+ * Updates C with the product of A and B, each transposed as requested:
+ *    C = op(A) op(B) + beta C
+ */
+template<typename TC, typename TA, typename TB, typename S>
+void multiply(TC& c, const TA& a, const TB& b, bool transa, bool transb,
+              S beta) {
+  if (!transa && !transb)
+    update(c, a * b, beta);
+  else if (transa && !transb)
+    update(c, a.st() * b, beta);
+  else if (!transa && transb)
+    update(c, a * b.st(), beta);
+  else
+    update(c, a.st() * b.st(), beta);
+}
+
+void gemmArmadillo(bool transa, bool transb, long long m, long long n,
+                   long long k, const cdouble* a, long long lda,
+                   const cdouble* b, long long ldb, cdouble beta, cdouble* c,
+                   long long ldc) {
+
+  // Wrap the memory (including the padding given by the leading dimensions)
+  // in matrices without copying the data.
+  long long rowsa = (transa ? k : m);
+  long long rowsb = (transb ? n : k);
+  cx_mat ma(const_cast<cdouble*>(a), lda, transa ? m : k, false, true);
+  cx_mat mb(const_cast<cdouble*>(b), ldb, transb ? k : n, false, true);
+  cx_mat mc(c, ldc, n, false, true);
+
+  // Without padding, Armadillo passes the transpositions on to its own gemm,
+  // which writes straight into the memory of C.
+  if (lda == rowsa && ldb == rowsb && ldc == m) {
+    multiply(mc, ma, mb, transa, transb, beta);
+    return;
+  }
+
+  // Otherwise select the rows which are actually part of the matrices. A
+  // product assigned to rows of C is evaluated into a temporary first.
+  auto sa = ma.rows(0, rowsa - 1);
+  auto sb = mb.rows(0, rowsb - 1);
+  auto sc = mc.rows(0, m - 1);
+  multiply(sc, sa, sb, transa, transb, beta);
+}
+
+void gemmRealArmadillo(bool transa, bool transb, long long m, long long n,
+                       long long k, double alpha, const double* a,
+                       long long lda, const double* b, long long ldb,
+                       double beta, double* c, long long ldc) {
+
+  mat ma(const_cast<double*>(a), lda, transa ? m : k, false, true);
+  mat mb(const_cast<double*>(b), ldb, transb ? k : n, false, true);
+  mat mc(c, ldc, n, false, true);
+
+  auto sa = ma.rows(0, (transa ? k : m) - 1);
+  auto sb = mb.rows(0, (transb ? n : k) - 1);
+  auto sc = mc.rows(0, m - 1);
+
+  if (!transa && !transb)
+    update(sc, alpha * (sa * sb), beta);
+  else if (transa && !transb)
+    update(sc, alpha * (sa.st() * sb), beta);
+  else if (!transa && transb)
+    update(sc, alpha * (sa * sb.st()), beta);
+  else
+    update(sc, alpha * (sa.st() * sb.st()), beta);
+}
+
+
+// --- CBLAS -------------------------------------------------------------
+
+#ifdef PICHI_USE_BLAS
+void gemmBLAS(bool transa, bool transb, long long m, long long n,
+              long long k, const cdouble* a, long long lda,
+              const cdouble* b, long long ldb, cdouble beta, cdouble* c,
+              long long ldc) {
+  cdouble alpha = 1.0;
+  cblas_zgemm(CblasColMajor,
+              transa ? CblasTrans : CblasNoTrans,
+              transb ? CblasTrans : CblasNoTrans,
+              m, n, k, &alpha, a, lda, b, ldb, &beta, c, ldc);
+}
+
+void gemmRealBLAS(bool transa, bool transb, long long m, long long n,
+                  long long k, double alpha, const double* a, long long lda,
+                  const double* b, long long ldb, double beta, double* c,
+                  long long ldc) {
+  cblas_dgemm(CblasColMajor,
+              transa ? CblasTrans : CblasNoTrans,
+              transb ? CblasTrans : CblasNoTrans,
+              m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+}
+#endif
+
+
+// --- Builtin -----------------------------------------------------------
+
+void gemmBuiltin(bool transa, bool transb, long long m, long long n,
+                 long long k, const cdouble* a, long long lda,
+                 const cdouble* b, long long ldb, cdouble beta, cdouble* c,
+                 long long ldc) {
+
+  // Use the SIMD microkernels if the processor supports them
+  if (getSimdLevel() != SimdLevel::None) {
+    gemmSimd(transa, transb, m, n, k, a, lda, b, ldb, beta, c, ldc);
+    return;
+  }
+
+  // The element (l,j) of op(B) is at b[l*incb + j*jumpb]
+  long long incb = (transb ? ldb : 1);
+  long long jumpb = (transb ? 1 : ldb);
+
+  for (long long j = 0; j < n; ++j) {
+    cdouble* cj = c + j*ldc;
+
+    // Scale the column of C
+    if (beta == 0.0) {
+      for (long long i = 0; i < m; ++i)
+        cj[i] = 0.0;
+    }
+    else if (beta != 1.0) {
+      for (long long i = 0; i < m; ++i)
+        cj[i] *= beta;
+    }
+
+    if (!transa) {
+      // Add the columns of A, weighted by column j of op(B)
+      for (long long l = 0; l < k; ++l) {
+        cdouble blj = b[l*incb + j*jumpb];
+        const cdouble* al = a + l*lda;
+        for (long long i = 0; i < m; ++i)
+          cj[i] += al[i] * blj;
+      }
+    }
+    else {
+      // The rows of op(A) are contiguous: use dot products
+      for (long long i = 0; i < m; ++i)
+        cj[i] += dot(k, a + i*lda, b + j*jumpb, incb);
+    }
+  }
+}
+
+void gemmRealBuiltin(bool transa, bool transb, long long m, long long n,
+                     long long k, double alpha, const double* a,
+                     long long lda, const double* b, long long ldb,
+                     double beta, double* c, long long ldc) {
+
+  // Use the SIMD microkernels if the processor supports them
+  if (getSimdLevel() != SimdLevel::None) {
+    gemmRealSimd(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c,
+                 ldc);
+    return;
+  }
+
+  long long incb = (transb ? ldb : 1);
+  long long jumpb = (transb ? 1 : ldb);
+
+  for (long long j = 0; j < n; ++j) {
+    double* cj = c + j*ldc;
+
+    if (beta == 0.0) {
+      for (long long i = 0; i < m; ++i)
+        cj[i] = 0.0;
+    }
+    else if (beta != 1.0) {
+      for (long long i = 0; i < m; ++i)
+        cj[i] *= beta;
+    }
+
+    if (!transa) {
+      for (long long l = 0; l < k; ++l) {
+        double blj = alpha * b[l*incb + j*jumpb];
+        const double* al = a + l*lda;
+        for (long long i = 0; i < m; ++i)
+          cj[i] += al[i] * blj;
+      }
+    }
+    else {
+      for (long long i = 0; i < m; ++i) {
+        const double* ai = a + i*lda;
+        double sum = 0.0;
+        for (long long l = 0; l < k; ++l)
+          sum += ai[l] * b[l*incb + j*jumpb];
+        cj[i] += alpha * sum;
+      }
+    }
+  }
+}
+
+
+// --- Dispatch ----------------------------------------------------------
+
+// Products with at most this many multiplications (m*n*k) use the SIMD
+// microkernels with every backend. Against OpenBLAS on an AVX-512 machine,
+// the crossover is around n = 48 for the AVX-512 kernels and n = 16 for the
+// AVX2 kernels (see bench_gemm).
+static long long smallGemm(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::AVX512: return 48*48*48;
+    case SimdLevel::AVX2: return 16*16*16;
+    default: return 0;
+  }
+}
+
+void gemm(bool transa, bool transb, long long m, long long n, long long k,
+          const cdouble* a, long long lda, const cdouble* b, long long ldb,
+          cdouble beta, cdouble* c, long long ldc) {
+
+  // Small products are faster with the SIMD microkernels than with any
+  // external library
+  SimdLevel level = getSimdLevel();
+  if (level != SimdLevel::None && m*n*k <= smallGemm(level)) {
+    gemmSimd(transa, transb, m, n, k, a, lda, b, ldb, beta, c, ldc);
+    return;
+  }
+
+  switch (backend) {
+#ifdef PICHI_USE_BLAS
+    case Backend::BLAS: {
+      gemmBLAS(transa, transb, m, n, k, a, lda, b, ldb, beta, c, ldc);
+      break;
+    }
+#endif
+    case Backend::Builtin: {
+      gemmBuiltin(transa, transb, m, n, k, a, lda, b, ldb, beta, c, ldc);
+      break;
+    }
+    default: {
+      gemmArmadillo(transa, transb, m, n, k, a, lda, b, ldb, beta, c, ldc);
+      break;
+    }
+  }
+}
+
+// The real matrix product C = alpha op(A) op(B) + beta C with the current
+// backend
+static void gemmReal(bool transa, bool transb, long long m, long long n,
+                     long long k, double alpha, const double* a,
+                     long long lda, const double* b, long long ldb,
+                     double beta, double* c, long long ldc) {
+  switch (backend) {
+#ifdef PICHI_USE_BLAS
+    case Backend::BLAS: {
+      gemmRealBLAS(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c,
+                   ldc);
+      break;
+    }
+#endif
+    case Backend::Builtin: {
+      gemmRealBuiltin(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta,
+                      c, ldc);
+      break;
+    }
+    default: {
+      gemmRealArmadillo(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta,
+                        c, ldc);
+      break;
+    }
+  }
+}
+
+void gemmPlanar(bool transa, bool transb, long long m, long long n,
+                long long k, const double* ar, const double* ai,
+                long long lda, const double* br, const double* bi,
+                long long ldb, double* cr, double* ci, long long ldc) {
+  gemmReal(transa, transb, m, n, k, 1.0, ar, lda, br, ldb, 0.0, cr, ldc);
+  gemmReal(transa, transb, m, n, k, -1.0, ai, lda, bi, ldb, 1.0, cr, ldc);
+  gemmReal(transa, transb, m, n, k, 1.0, ar, lda, bi, ldb, 0.0, ci, ldc);
+  gemmReal(transa, transb, m, n, k, 1.0, ai, lda, br, ldb, 1.0, ci, ldc);
+}
+
+// Stores the sum of two real (rows x cols) matrices, with leading dimension
+// ld, in the contiguous array sum
+static void addMatrices(long long rows, long long cols, const double* x,
+                        const double* y, long long ld, double* sum) {
+  for (long long j = 0; j < cols; ++j) {
+    for (long long i = 0; i < rows; ++i)
+      sum[i + j*rows] = x[i + j*ld] + y[i + j*ld];
+  }
+}
+
+void gemm3M(bool transa, bool transb, long long m, long long n, long long k,
+            const double* ar, const double* ai, long long lda,
+            const double* br, const double* bi, long long ldb, double* cr,
+            double* ci, long long ldc, double* sa, double* sb) {
+
+  // The sums of the real and imaginary parts, laid out as the operands
+  // without padding
+  long long rowsa = max(transa ? k : m, 1LL);
+  long long rowsb = max(transb ? n : k, 1LL);
+  addMatrices(transa ? k : m, transa ? m : k, ar, ai, lda, sa);
+  addMatrices(transb ? n : k, transb ? k : n, br, bi, ldb, sb);
+
+  // Re C = T, Im C = (Re A + Im A)(Re B + Im B) - 2T, and then
+  // Re C = T - Im A Im B, Im C = Im C + Re C
+  gemmReal(transa, transb, m, n, k, 1.0, ar, lda, br, ldb, 0.0, cr, ldc);
+  gemmReal(transa, transb, m, n, k, 1.0, sa, rowsa, sb, rowsb, 0.0, ci,
+           ldc);
+  for (long long j = 0; j < n; ++j) {
+    for (long long i = 0; i < m; ++i)
+      ci[i + j*ldc] -= 2.0*cr[i + j*ldc];
+  }
+  gemmReal(transa, transb, m, n, k, -1.0, ai, lda, bi, ldb, 1.0, cr, ldc);
+  for (long long j = 0; j < n; ++j) {
+    for (long long i = 0; i < m; ++i)
+      ci[i + j*ldc] += cr[i + j*ldc];
+  }
+}
+
+int setBlasThreads(int threads) {
+#ifdef PICHI_OPENBLAS_THREADS
+  int prev = openblas_get_num_threads();
+  if (prev != threads)
+    openblas_set_num_threads(threads);
+  return prev;
+#else
+  (void)threads;
+  return 1;
+#endif
+}
+
+cdouble gemmTrace(bool transa, bool transb, long long n,
+                  const cdouble* a, long long lda,
+                  const cdouble* b, long long ldb) {
+
+  // tr(op(A) op(B)) = sum_il op(A)_il op(B)_li. Depending on the
+  // transposition, one or both of the factors are read contiguously.
+  cdouble res = 0.0;
+  if (!transa && !transb) {
+    // Column l of A with row l of B
+    for (long long l = 0; l < n; ++l)
+      res += dot(n, a + l*lda, b + l, ldb);
+  }
+  else if (transa && transb) {
+    // Column l of B with row l of A
+    for (long long l = 0; l < n; ++l)
+      res += dot(n, b + l*ldb, a + l, lda);
+  }
+  else {
+    // Column i of A with column i of B
+    for (long long i = 0; i < n; ++i)
+      res += dot(n, a + i*lda, b + i*ldb, 1);
+  }
+  return res;
+}
+
+}
@@ -0,0 +1,83 @@
+#ifndef PICHI_GEMM_H
+#define PICHI_GEMM_H
+
+#include "pichi/tensor.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the matrix-matrix multiplication (GEMM) layer used by
+ * the contraction engines.
+ *
+ * All matrices are column major and are described by a pointer and a leading
+ * dimension, exactly as in BLAS. Transposition is passed on as a flag to the
+ * backend, so no transposed copies of the operands are ever made.
+ *
+ * The actual multiplication is carried out by one of the backends listed in
+ * CONTRACTION.H. The CBLAS backend is only available if PICHI was built with
+ * BLAS support (the CMake option USE_BLAS, which defines PICHI_USE_BLAS).
+ *
+ * ***********************************************************************/
+
+/*
+ * Computes
+ *    C = op(A) op(B) + beta C ,
+ * where op(X) is either X or the (non-conjugated) transpose of X, depending
+ * on the flags transa and transb. op(A) is an (m x k) matrix, op(B) is
+ * (k x n) and C is (m x n).
+ * If beta is zero, C is not read before being written.
+ */
+void gemm(bool transa, bool transb, long long m, long long n, long long k,
+          const cdouble* a, long long lda, const cdouble* b, long long ldb,
+          cdouble beta, cdouble* c, long long ldc);
+
+/*
+ * Computes the product of two complex matrices in the planar format (see
+ * TENSOR.H),
+ *    C = op(A) op(B) ,
+ * where each matrix is given by two real matrices with the same leading
+ * dimension: ar, br and cr hold the real parts, and ai, bi and ci the
+ * imaginary parts. This is four real matrix multiplications
+ *    Re C = Re A Re B - Im A Im B ,   Im C = Re A Im B + Im A Re B ,
+ * which the backend does without any shuffling of real and imaginary parts.
+ */
+void gemmPlanar(bool transa, bool transb, long long m, long long n,
+                long long k, const double* ar, const double* ai,
+                long long lda, const double* br, const double* bi,
+                long long ldb, double* cr, double* ci, long long ldc);
+
+/*
+ * The same product with the 3M (Gauss) method, which needs three real
+ * matrix multiplications instead of four:
+ *    T = Re A Re B ,   Re C = T - Im A Im B ,
+ *    Im C = (Re A + Im A)(Re B + Im B) - T - Im A Im B .
+ * This is 25% fewer operations, at the cost of forming the two sums and
+ * of a somewhat larger rounding error in the imaginary part. The sums are
+ * formed in the scratch arrays sa and sb, of at least m*k and k*n elements.
+ */
+void gemm3M(bool transa, bool transb, long long m, long long n, long long k,
+            const double* ar, const double* ai, long long lda,
+            const double* br, const double* bi, long long ldb, double* cr,
+            double* ci, long long ldc, double* sa, double* sb);
+
+/*
+ * Computes the trace of the (n x n) matrix product op(A) op(B) without
+ * forming the product. Only the diagonal of the product is needed, so this
+ * is a sum of n^2 products instead of a full matrix multiplication.
+ */
+cdouble gemmTrace(bool transa, bool transb, long long n,
+                  const cdouble* a, long long lda,
+                  const cdouble* b, long long ldb);
+
+/*
+ * Sets the number of threads used internally by the BLAS library and returns
+ * the previous setting. This only has an effect if the library allows it
+ * (OpenBLAS, detected at build time, which defines PICHI_OPENBLAS_THREADS).
+ * Otherwise the call does nothing and returns 1.
+ */
+int setBlasThreads(int threads);
+
+}
+
+#endif //PICHI_GEMM_H
@@ -0,0 +1,569 @@
+/* ****************************************************************************
+ *
+ * Implementation of the computational kernels defined in KERNELS.H
+ *
+ * ***************************************************************************/
+
+#include <algorithm>
+#include "kernels.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+namespace pichi {
+
+// Side of the square tiles used by permute. Two tiles of 32x32 complex
+// numbers take up 32 kB.
+static const int tile = 32;
+
+// Tensors smaller than this are permuted on a single thread
+static const long long parallel_permute = 1 << 16;
+
+// Number of output elements partialTrace sums at a time
+static const int trace_block = 256;
+
+vector<long long> strides(const Tensor& tensor) {
+  vector<int> store;
+  if (tensor.isPlanar())
+    tensor.getPlanarData(store);
+  else
+    tensor.getData(store);
+  vector<long long> res(store.size());
+  long long mult = 1;
+  for (int i = 0; i < store.size(); ++i) {
+    // Index store[i] is the i'th dimension of the data array
+    res[store[i]] = mult;
+    mult *= tensor.getSize();
+  }
+  return res;
+}
+
+// The permutation of arrays of complex numbers, or of the planes of planar
+// tensors
+template<typename T>
+static void permuteArray(int rank, int n, const std::vector<int>& from,
+                         const T* in, const std::vector<int>& to, T* out) {
+
+  // Position of each index in the input array
+  vector<int> pos(rank);
+  for (int i = 0; i < rank; ++i)
+    pos[from[i]] = i;
+
+  // Dimensions of the output array, with their extent and their stride in
+  // the input array. Dimensions which are consecutive in both arrays are
+  // merged into one.
+  vector<long long> extent, stride;
+  for (int d = 0; d < rank; ++d) {
+    if (d > 0 && pos[to[d]] == pos[to[d-1]] + 1) {
+      extent.back() *= n;
+      continue;
+    }
+    long long s = 1;
+    for (int i = 0; i < pos[to[d]]; ++i)
+      s *= n;
+    extent.push_back(n);
+    stride.push_back(s);
+  }
+  int dims = extent.size();
+  long long total = 1;
+  for (long long e : extent)
+    total *= e;
+
+  if (dims <= 1) {
+    copy(in, in + total, out);
+    return;
+  }
+
+  // Stride of each dimension in the output array
+  vector<long long> ostride(dims);
+  ostride[0] = 1;
+  for (int d = 1; d < dims; ++d)
+    ostride[d] = ostride[d-1] * extent[d-1];
+
+  // The dimension which is leading in the input array. If it is also leading
+  // in the output, the data is copied in runs along it. Otherwise tiles are
+  // copied between the two leading dimensions.
+  int lead = 0;
+  while (stride[lead] != 1)
+    ++lead;
+
+  // The remaining dimensions are looped over. Each unit of work is one value
+  // of these, and (for tiles) one column of tiles along the input's leading
+  // dimension.
+  vector<int> outer;
+  long long count = 1;
+  for (int d = 1; d < dims; ++d) {
+    if (d != lead) {
+      outer.push_back(d);
+      count *= extent[d];
+    }
+  }
+  long long columns = (lead == 0 ? 1 : (extent[lead] + tile - 1) / tile);
+
+  auto work = [&](long long begin, long long end) {
+    for (long long u = begin; u < end; ++u) {
+      // Find the offsets of the unit in both arrays
+      long long k = u / columns;
+      long long io = 0;
+      long long oo = 0;
+      for (int d : outer) {
+        long long c = k % extent[d];
+        k /= extent[d];
+        io += c * stride[d];
+        oo += c * ostride[d];
+      }
+
+      if (lead == 0) {
+        copy(in + io, in + io + extent[0], out + oo);
+        continue;
+      }
+
+      long long j0 = (u % columns) * tile;
+      long long j1 = min(j0 + tile, extent[lead]);
+      for (long long i0 = 0; i0 < extent[0]; i0 += tile) {
+        long long i1 = min(i0 + tile, extent[0]);
+        for (long long j = j0; j < j1; ++j) {
+          const T* src = in + io + j;
+          T* dst = out + oo + j * ostride[lead];
+          for (long long i = i0; i < i1; ++i)
+            dst[i] = src[i * stride[0]];
+        }
+      }
+    }
+  };
+
+  if (total < parallel_permute)
+    work(0, count * columns);
+  else
+    parallelFor(count * columns, work);
+}
+
+void permute(int rank, int n, const std::vector<int>& from,
+             const cdouble* in, const std::vector<int>& to, cdouble* out) {
+  permuteArray(rank, n, from, in, to, out);
+}
+
+void permute(int rank, int n, const std::vector<int>& from,
+             const double* in, const std::vector<int>& to, double* out) {
+  permuteArray(rank, n, from, in, to, out);
+}
+
+void split(long long n, const cdouble* in, double* re, double* im) {
+  const double* d = reinterpret_cast<const double*>(in);
+  for (long long i = 0; i < n; ++i) {
+    re[i] = d[2*i];
+    im[i] = d[2*i+1];
+  }
+}
+
+void interleave(long long n, const double* re, const double* im,
+                cdouble* out) {
+  double* d = reinterpret_cast<double*>(out);
+  for (long long i = 0; i < n; ++i) {
+    d[2*i] = re[i];
+    d[2*i+1] = im[i];
+  }
+}
+
+void gather(int n, const cdouble* in, long long inc1, long long inc2,
+            cdouble* out) {
+  if (inc1 == 1) {
+    // The columns are contiguous
+    for (int j = 0; j < n; ++j)
+      copy(in + j*inc2, in + j*inc2 + n, out + (long long)j*n);
+    return;
+  }
+  if (inc1 <= inc2) {
+    // Whole columns are read with the shorter stride
+    for (int j = 0; j < n; ++j) {
+      const cdouble* src = in + j*inc2;
+      cdouble* dst = out + (long long)j*n;
+      for (int i = 0; i < n; ++i)
+        dst[i] = src[i*inc1];
+    }
+    return;
+  }
+  for (int i0 = 0; i0 < n; i0 += tile) {
+    int i1 = min(i0 + tile, n);
+    for (int j0 = 0; j0 < n; j0 += tile) {
+      int j1 = min(j0 + tile, n);
+      for (int j = j0; j < j1; ++j) {
+        const cdouble* src = in + j*inc2;
+        cdouble* dst = out + (long long)j*n;
+        for (int i = i0; i < i1; ++i)
+          dst[i] = src[i*inc1];
+      }
+    }
+  }
+}
+
+void scatter(int n, const cdouble* in, cdouble* out, long long inc1,
+             long long inc2) {
+  if (inc1 == 1) {
+    for (int j = 0; j < n; ++j)
+      copy(in + (long long)j*n, in + (long long)(j+1)*n, out + j*inc2);
+    return;
+  }
+  if (inc1 <= inc2) {
+    for (int j = 0; j < n; ++j) {
+      const cdouble* src = in + (long long)j*n;
+      cdouble* dst = out + j*inc2;
+      for (int i = 0; i < n; ++i)
+        dst[i*inc1] = src[i];
+    }
+    return;
+  }
+  for (int i0 = 0; i0 < n; i0 += tile) {
+    int i1 = min(i0 + tile, n);
+    for (int j0 = 0; j0 < n; j0 += tile) {
+      int j1 = min(j0 + tile, n);
+      for (int j = j0; j < j1; ++j) {
+        const cdouble* src = in + (long long)j*n;
+        cdouble* dst = out + j*inc2;
+        for (int i = i0; i < i1; ++i)
+          dst[i*inc1] = src[i];
+      }
+    }
+  }
+}
+
+void gather(int n, const double* re, const double* im, long long inc1,
+            long long inc2, cdouble* out) {
+  if (inc1 <= inc2) {
+    for (int j = 0; j < n; ++j) {
+      long long os = j*inc2;
+      cdouble* dst = out + (long long)j*n;
+      for (int i = 0; i < n; ++i)
+        dst[i] = cdouble(re[os + i*inc1], im[os + i*inc1]);
+    }
+    return;
+  }
+  for (int i0 = 0; i0 < n; i0 += tile) {
+    int i1 = min(i0 + tile, n);
+    for (int j0 = 0; j0 < n; j0 += tile) {
+      int j1 = min(j0 + tile, n);
+      for (int j = j0; j < j1; ++j) {
+        long long os = j*inc2;
+        cdouble* dst = out + (long long)j*n;
+        for (int i = i0; i < i1; ++i)
+          dst[i] = cdouble(re[os + i*inc1], im[os + i*inc1]);
+      }
+    }
+  }
+}
+
+void scatter(int n, const cdouble* in, double* re, double* im,
+             long long inc1, long long inc2) {
+  if (inc1 <= inc2) {
+    for (int j = 0; j < n; ++j) {
+      long long os = j*inc2;
+      const cdouble* src = in + (long long)j*n;
+      for (int i = 0; i < n; ++i) {
+        re[os + i*inc1] = src[i].real();
+        im[os + i*inc1] = src[i].imag();
+      }
+    }
+    return;
+  }
+  for (int i0 = 0; i0 < n; i0 += tile) {
+    int i1 = min(i0 + tile, n);
+    for (int j0 = 0; j0 < n; j0 += tile) {
+      int j1 = min(j0 + tile, n);
+      for (int j = j0; j < j1; ++j) {
+        long long os = j*inc2;
+        const cdouble* src = in + (long long)j*n;
+        for (int i = i0; i < i1; ++i) {
+          re[os + i*inc1] = src[i].real();
+          im[os + i*inc1] = src[i].imag();
+        }
+      }
+    }
+  }
+}
+
+void prefetch(int rows, int cols, const cdouble* in, long long inc1,
+              long long inc2, bool write) {
+#if defined(__GNUC__)
+  // The hardware prefetcher follows a contiguous column once it has been
+  // started, so only the first line of those is hinted.
+  int n = (inc1 == 1 ? 1 : rows);
+  for (int j = 0; j < cols; ++j) {
+    const cdouble* col = in + j*inc2;
+    for (int i = 0; i < n; ++i) {
+      if (write)
+        __builtin_prefetch(col + i*inc1, 1);
+      else
+        __builtin_prefetch(col + i*inc1, 0);
+    }
+  }
+#endif
+}
+
+cdouble dot(long long n, const cdouble* x, const cdouble* y, long long incy) {
+
+  if (getSimdLevel() != SimdLevel::None)
+    return dotSimd(n, x, y, incy);
+
+  // We work on the real and imaginary parts separately and keep several
+  // independent accumulators, such that the compiler is free to vectorise
+  // and pipeline the loop.
+  const double* a = reinterpret_cast<const double*>(x);
+  const double* b = reinterpret_cast<const double*>(y);
+
+  double re[4] = {0.0, 0.0, 0.0, 0.0};
+  double im[4] = {0.0, 0.0, 0.0, 0.0};
+
+  long long i = 0;
+  if (incy == 1) {
+    for (; i + 4 <= n; i += 4) {
+      for (int j = 0; j < 4; ++j) {
+        double ar = a[2*(i+j)], ai = a[2*(i+j)+1];
+        double br = b[2*(i+j)], bi = b[2*(i+j)+1];
+        re[j] += ar*br - ai*bi;
+        im[j] += ar*bi + ai*br;
+      }
+    }
+  }
+  else {
+    for (; i + 4 <= n; i += 4) {
+      for (int j = 0; j < 4; ++j) {
+        double ar = a[2*(i+j)], ai = a[2*(i+j)+1];
+        double br = b[2*(i+j)*incy], bi = b[2*(i+j)*incy+1];
+        re[j] += ar*br - ai*bi;
+        im[j] += ar*bi + ai*br;
+      }
+    }
+  }
+  // Remainder
+  for (; i < n; ++i) {
+    double ar = a[2*i], ai = a[2*i+1];
+    double br = b[2*i*incy], bi = b[2*i*incy+1];
+    re[0] += ar*br - ai*bi;
+    im[0] += ar*bi + ai*br;
+  }
+
+  return cdouble(re[0] + re[1] + re[2] + re[3], im[0] + im[1] + im[2] + im[3]);
+}
+
+// The dot product of two arrays in the planar format, with the real parts
+// in xr and yr and the imaginary parts in xi and yi
+static cdouble dot(long long n, const double* xr, const double* xi,
+                   const double* yr, const double* yi, long long incy) {
+  double re[2] = {0.0, 0.0};
+  double im[2] = {0.0, 0.0};
+  for (long long i = 0; i < n; ++i) {
+    re[0] += xr[i]*yr[i*incy];
+    re[1] += xi[i]*yi[i*incy];
+    im[0] += xr[i]*yi[i*incy];
+    im[1] += xi[i]*yr[i*incy];
+  }
+  return cdouble(re[0] - re[1], im[0] + im[1]);
+}
+
+cdouble innerProduct(const Tensor& t1, const Tensor& t2,
+                     const std::vector<std::pair<int,int>>& idx) {
+
+  int rank = t1.getRank();
+  int n = t1.getSize();
+  vector<long long> strides2 = strides(t2);
+
+  // Two planar tensors are multiplied plane by plane, and two interleaved
+  // tensors directly. Tensors in different formats are each read in their
+  // own format.
+  long long total = 1;
+  for (int i = 0; i < rank; ++i)
+    total *= n;
+  vector<int> store1;
+  const cdouble* data1 = nullptr;
+  const double* plane1 = nullptr;
+  if (t1.isPlanar())
+    plane1 = t1.getPlanarData(store1);
+  else
+    data1 = t1.getData(store1);
+
+  // Find the index on tensor 2 which each index on tensor 1 is contracted with
+  vector<int> partner(rank);
+  for (pair<int,int> p : idx)
+    partner[p.first] = p.second;
+
+  // The data of tensor 1 is read consecutively. Find the stride on tensor 2
+  // for each dimension of the data array of tensor 1.
+  vector<long long> inc(rank);
+  for (int i = 0; i < rank; ++i)
+    inc[i] = strides2[partner[store1[i]]];
+
+  // Leading dimensions of tensor 1 can be merged into one long dot product
+  // as long as tensor 2 runs along in the same order. If the storage is
+  // compatible, this means the whole contraction is a single dot product.
+  long long len = n;
+  int lead = 1;
+  while (lead < rank && inc[lead] == len*inc[0]) {
+    len *= n;
+    ++lead;
+  }
+
+  // Loop over the remaining dimensions and accumulate the dot products
+  vector<int> counter(rank, 0);
+  vector<int> store2;
+  const cdouble* data2 = nullptr;
+  const double* plane2 = nullptr;
+  if (t2.isPlanar())
+    plane2 = t2.getPlanarData(store2);
+  else
+    data2 = t2.getData(store2);
+  long long os1 = 0;
+  long long os2 = 0;
+  cdouble res = 0.0;
+  bool flag = true;
+  while (flag) {
+    if (plane1 && plane2)
+      res += dot(len, plane1 + os1, plane1 + total + os1, plane2 + os2,
+                 plane2 + total + os2, inc[0]);
+    else if (data1 && data2)
+      res += dot(len, data1 + os1, data2 + os2, inc[0]);
+    else {
+      for (long long j = 0; j < len; ++j) {
+        long long x1 = os1 + j;
+        long long x2 = os2 + j*inc[0];
+        res += (plane1 ? cdouble(plane1[x1], plane1[total + x1]) : data1[x1]) *
+               (plane2 ? cdouble(plane2[x2], plane2[total + x2]) : data2[x2]);
+      }
+    }
+    os1 += len;
+
+    // Increase the outer counters
+    flag = false;
+    for (int i = lead; i < rank && !flag; ++i) {
+      if (++counter[i] == n) {
+        // Roll over
+        counter[i] = 0;
+        os2 -= (n-1)*inc[i];
+      }
+      else {
+        os2 += inc[i];
+        flag = true;
+      }
+    }
+  }
+
+  return res;
+}
+
+
+void partialTrace(const Tensor& tensor,
+                  const std::vector<std::pair<int,int>>& idx, Tensor& out) {
+
+  int rank = tensor.getRank();
+  int n = tensor.getSize();
+  vector<long long> inc = strides(tensor);
+
+  // The data array is read as it is laid out. The planes of a planar tensor
+  // are read directly.
+  long long total = 1;
+  for (int i = 0; i < rank; ++i)
+    total *= n;
+  vector<int> layout;
+  const cdouble* data = nullptr;
+  const double* plane = nullptr;
+  if (tensor.isPlanar())
+    plane = tensor.getPlanarData(layout);
+  else
+    data = tensor.getData(layout);
+
+  // The offsets of the elements on the diagonal of the traced indices, with
+  // the two indices of a pair running together. The pair with the smallest
+  // stride runs fastest.
+  vector<bool> traced(rank, false);
+  vector<long long> inc_diag;
+  for (pair<int,int> p : idx) {
+    traced[p.first] = true;
+    traced[p.second] = true;
+    inc_diag.push_back(inc[p.first] + inc[p.second]);
+  }
+  sort(inc_diag.begin(), inc_diag.end());
+  vector<long long> diag(1, 0);
+  for (long long s : inc_diag) {
+    long long count = diag.size();
+    diag.resize(count*n);
+    for (int j = 1; j < n; ++j) {
+      for (long long i = 0; i < count; ++i)
+        diag[i + j*count] = diag[i] + j*s;
+    }
+  }
+
+  // The stride on the input of every dimension of the output data array
+  vector<int> free;
+  for (int i = 0; i < rank; ++i) {
+    if (!traced[i])
+      free.push_back(i);
+  }
+  vector<int> store_out = out.getStorage();
+  int rank_out = store_out.size();
+  vector<long long> inc_out(rank_out);
+  long long count = 1;
+  for (int d = 0; d < rank_out; ++d) {
+    inc_out[d] = inc[free[store_out[d]]];
+    count *= n;
+  }
+  cdouble* res = out.getData();
+
+  // Gets the element at a given offset in the data array
+  auto at = [&](long long x) {
+    return (plane ? cdouble(plane[x], plane[total + x]) : data[x]);
+  };
+
+  // The inner loop runs along the diagonal if it is closer together in
+  // memory than the consecutive output elements, and along the output
+  // otherwise
+  bool along = (n > 1 && (rank_out == 0 || inc_diag[0] < inc_out[0]));
+
+  // The output elements are split between the threads. Each thread sums
+  // blocks of consecutive output elements.
+  parallelFor(count, [&](long long begin, long long end) {
+
+    // The index of the first element on each dimension of the output, and
+    // its offset on the input
+    vector<int> index(rank_out);
+    long long base = 0;
+    long long x = begin;
+    for (int d = 0; d < rank_out; ++d) {
+      index[d] = x % n;
+      x /= n;
+      base += index[d]*inc_out[d];
+    }
+
+    long long os[trace_block];
+    cdouble sum[trace_block];
+    for (long long o = begin; o < end; o += trace_block) {
+      int m = (end - o < trace_block ? end - o : trace_block);
+      for (int i = 0; i < m; ++i) {
+        os[i] = base;
+        sum[i] = 0.0;
+        for (int d = 0; d < rank_out; ++d) {
+          base += inc_out[d];
+          if (++index[d] < n)
+            break;
+          base -= n*inc_out[d];
+          index[d] = 0;
+        }
+      }
+
+      if (along) {
+        for (int i = 0; i < m; ++i) {
+          for (long long k : diag)
+            sum[i] += at(os[i] + k);
+        }
+      } else {
+        for (long long k : diag) {
+          for (int i = 0; i < m; ++i)
+            sum[i] += at(os[i] + k);
+        }
+      }
+
+      copy(sum, sum + m, res + o);
+    }
+  });
+}
+
+}
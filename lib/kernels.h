@@ -0,0 +1,133 @@
+#ifndef PICHI_KERNELS_H
+#define PICHI_KERNELS_H
+
+#include <vector>
+#include "pichi/tensor.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the low level computational kernels used by the
+ * contraction engines.
+ *
+ * Contrary to the slice based contraction code, the kernels work directly on
+ * the underlying data arrays of the tensors, as they are laid out. Pending
+ * storage changes (see TENSOR.H) are not applied. Each index of a tensor is
+ * described by its stride, i.e. the distance in the data array between two
+ * elements whose index differ by one. For a rank 3 tensor of size n with
+ * storage (2,0,1), the strides are
+ *    (n, n^2, 1)
+ * since index 2 is the leading dimension, then index 0 and finally index 1.
+ *
+ * ***********************************************************************/
+
+/*
+ * Gets the stride of every index of a tensor, based on its size and the
+ * layout of its data array.
+ */
+std::vector<long long> strides(const Tensor&);
+
+/*
+ * Copies the data array of a tensor with a given rank and size from one
+ * storage to another. The input array in is laid out according to the
+ * storage vector from, and the output array out (which must not overlap the
+ * input) according to to.
+ * Dimensions which follow each other in both arrays are merged and copied in
+ * long runs. Otherwise the data is copied in square tiles, which are small
+ * enough to stay in cache, between the leading dimension of the output and
+ * the leading dimension of the input, such that both arrays are accessed
+ * with stride 1 in the inner loops. Large tensors are split between the
+ * threads along the remaining dimensions.
+ */
+void permute(int rank, int size, const std::vector<int>& from,
+             const cdouble* in, const std::vector<int>& to, cdouble* out);
+
+/*
+ * Copies one plane (the real or the imaginary parts) of a planar tensor (see
+ * TENSOR.H) from one storage to another, in the same way.
+ */
+void permute(int rank, int size, const std::vector<int>& from,
+             const double* in, const std::vector<int>& to, double* out);
+
+/*
+ * Converts n complex numbers from the interleaved format to the planar
+ * format (split), where the real and imaginary parts are held in the two
+ * arrays re and im, or back (interleave).
+ */
+void split(long long n, const cdouble* in, double* re, double* im);
+void interleave(long long n, const double* re, const double* im,
+                cdouble* out);
+
+/*
+ * Copies an (n x n) matrix whose element (i,j) is found at in[i*inc1 +
+ * j*inc2] into the column major array out (gather), or the column major
+ * array in into such a matrix (scatter). These are used for slices which do
+ * not lie along the leading dimensions of a tensor. If the rows are closer
+ * together than the columns, the matrix is copied in square tiles, such that
+ * the strided accesses stay in cache.
+ */
+void gather(int n, const cdouble* in, long long inc1, long long inc2,
+            cdouble* out);
+void scatter(int n, const cdouble* in, cdouble* out, long long inc1,
+             long long inc2);
+
+/*
+ * The same for the planes re and im of a planar tensor. The column major
+ * array is interleaved, so these convert between the two formats.
+ */
+void gather(int n, const double* re, const double* im, long long inc1,
+            long long inc2, cdouble* out);
+void scatter(int n, const cdouble* in, double* re, double* im,
+             long long inc1, long long inc2);
+
+/*
+ * Asks the processor to start loading an (rows x cols) matrix, whose element
+ * (i,j) is found at in[i*inc1 + j*inc2], into the cache (for writing if
+ * write is true). This returns right away, so the loads overlap with
+ * whatever is computed next, and a later gather or scatter of the matrix
+ * finds it in the cache. Contiguous columns only get a hint for their first
+ * element, strided columns one for every element. Does nothing on compilers
+ * without prefetch support.
+ */
+void prefetch(int rows, int cols, const cdouble* in, long long inc1,
+              long long inc2, bool write = false);
+
+/*
+ * Complex (unconjugated) dot product of two arrays of length n:
+ *    sum_i x[i] * y[i*incy]
+ * The first array is contiguous, while the second is read with stride incy.
+ */
+cdouble dot(long long n, const cdouble* x, const cdouble* y, long long incy);
+
+/*
+ * Computes the full contraction of two tensors, where every index of the
+ * first tensor is contracted with an index on the second. The contracted
+ * indices are given in the same format as in the contract functions.
+ * The first tensor is read in storage order, and the second tensor is read
+ * with the strides of its partnered indices, so the result is computed as a
+ * single (possibly strided) dot product without forming any intermediate
+ * matrix products and without changing the storage of either tensor.
+ * The planes of two planar tensors (see TENSOR.H) are multiplied directly.
+ * Tensors in different formats are each read in their own format, without
+ * converting either of them.
+ */
+cdouble innerProduct(const Tensor& t1, const Tensor& t2,
+                     const std::vector<std::pair<int,int>>& idx);
+
+/*
+ * Computes the partial trace of a tensor over the pairs of indices idx,
+ * given in the same format as in the contract functions, into the output
+ * tensor out, which must have the rank, size and storage of the result. Only
+ * the diagonal of each pair of indices is read, by running along both
+ * indices at once with the sum of their strides. The tensor is read as it is
+ * laid out, so its storage is not changed, and the planes of a planar
+ * tensor are read directly. The output elements are split between the
+ * threads.
+ */
+void partialTrace(const Tensor& tensor,
+                  const std::vector<std::pair<int,int>>& idx, Tensor& out);
+
+}
+
+#endif //PICHI_KERNELS_H
@@ -0,0 +1,505 @@
+/* ****************************************************************************
+ *
+ * Implementation of the ContractionPlan class defined in PLAN.H
+ *
+ * ***************************************************************************/
+
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <set>
+#include "pichi/plan.h"
+#include "schedule.h"
+#include "engines.h"
+
+using namespace std;
+
+namespace pichi {
+
+namespace {
+
+typedef pair<pair<int,int>,pair<int,int>> Connection;
+
+// For each index of each node, the position of its connection in a list of
+// sliced connections, or -1 if it is not sliced
+map<int, vector<int>> slicedIndices(const vector<int>& nodes,
+                                    const vector<int>& ranks,
+                                    const vector<Connection>& sliced) {
+  map<int, vector<int>> r;
+  for (int node : nodes)
+    r[node] = vector<int>(ranks[node], -1);
+  for (int c = 0; c < sliced.size(); ++c) {
+    r[sliced[c].first.first][sliced[c].first.second] = c;
+    r[sliced[c].second.first][sliced[c].second.second] = c;
+  }
+  return r;
+}
+
+// The storage of a tensor cut down to the indices which are not fixed. The
+// remaining indices keep their order in memory.
+vector<int> cutStorage(const vector<int>& store, const vector<int>& fixed) {
+  vector<int> id(store.size(), -1);
+  int k = 0;
+  for (int i = 0; i < store.size(); ++i) {
+    if (fixed[i] < 0)
+      id[i] = k++;
+  }
+  vector<int> r;
+  for (int i : store) {
+    if (id[i] >= 0)
+      r.push_back(id[i]);
+  }
+  return r;
+}
+
+// Copies total elements from the array in, starting at the offset of a part
+// of a tensor with the given strides of its remaining indices, into o. One
+// run of the leading remaining index is copied at a time, stepping through
+// the other remaining indices like an odometer.
+template<typename T>
+void cutArray(const T* in, const vector<long long>& strides, int n,
+              long long total, T* o) {
+  vector<int> i(strides.size(), 0);
+  long long pos = 0;
+  for (long long e = 0; e < total; e += n) {
+    for (int j = 0; j < n; ++j)
+      o[e+j] = in[pos + j*strides[0]];
+    for (int d = 1; d < strides.size(); ++d) {
+      pos += strides[d];
+      if (++i[d] < n)
+        break;
+      pos -= n*strides[d];
+      i[d] = 0;
+    }
+  }
+}
+
+// Copies the part of a tensor where the indices with value[i] >= 0 are fixed
+// to these values into out. The storage of out is given by cutStorage of the
+// layout of the data array, so the elements are read in the order they are
+// stored, and a pending storage change of the tensor is never applied. The
+// part is in the same format as the tensor, whose planes are copied one at
+// a time if it is planar.
+void cutTensor(const Tensor& t, const vector<int>& value, Tensor& out) {
+
+  int n = t.getSize();
+  vector<int> store;
+  bool planar = t.isPlanar();
+  const double* planes = (planar ? t.getPlanarData(store) : nullptr);
+  const cdouble* in = (planar ? nullptr : t.getData(store));
+  long long offset = 0;
+  long long stride = 1;
+  vector<long long> strides;
+  for (int i : store) {
+    if (value[i] >= 0)
+      offset += value[i]*stride;
+    else
+      strides.push_back(stride);
+    stride *= n;
+  }
+  out.resize(strides.size(), n, cutStorage(store, value), true, planar);
+
+  long long total = 1;
+  for (int i = 0; i < strides.size(); ++i)
+    total *= n;
+  if (planar) {
+    double* o = out.getPlanarData();
+    cutArray(planes + offset, strides, n, total, o);
+    cutArray(planes + stride + offset, strides, n, total, o + total);
+  }
+  else
+    cutArray(in + offset, strides, n, total, out.getData());
+}
+
+}
+
+ContractionPlan::ContractionPlan(const Graph& graph,
+                                 const std::vector<Tensor>& tensors) {
+
+  vector<vector<int>> storage(tensors.size());
+  vector<bool> planar(tensors.size(), false);
+  int n = 0;
+  for (int node : graph.getNodes()) {
+    if (node < 0 || node >= tensors.size())
+      throw invalid_argument("Error in ContractionPlan: Node " +
+                             to_string(node) + " does not correspond to a "
+                             "tensor");
+    storage[node] = tensors[node].getStorage();
+    planar[node] = tensors[node].isPlanar();
+    n = tensors[node].getSize();
+  }
+  init(graph, storage, planar, n);
+}
+
+ContractionPlan::ContractionPlan(const Graph& graph,
+                                 const std::vector<int>& ranks, int size,
+                                 bool planar) {
+
+  vector<vector<int>> storage(ranks.size());
+  for (int i = 0; i < ranks.size(); ++i) {
+    for (int j = 0; j < ranks[i]; ++j)
+      storage[i].push_back(j);
+  }
+  init(graph, storage, vector<bool>(ranks.size(), planar), size);
+}
+
+void ContractionPlan::init(const Graph& graph,
+                           const std::vector<std::vector<int>>& storage,
+                           const std::vector<bool>& planar, int n) {
+
+  size = n;
+  arena = make_shared<PoolAllocator>(0);
+  for (const vector<int>& s : storage)
+    ranks.push_back(s.size());
+
+  // Check that the tensors match the nodes of the graph
+  for (int node : graph.getNodes()) {
+    if (node < 0 || node >= ranks.size())
+      throw invalid_argument("Error in ContractionPlan: Node " +
+                             to_string(node) + " does not correspond to a "
+                             "tensor");
+    if (ranks[node] != graph.connections(node).size())
+      throw invalid_argument("Error in ContractionPlan: The rank of tensor " +
+                             to_string(node) + " does not match the graph");
+    nodes.push_back(node);
+  }
+
+  // Slice connections, one at a time, until the intermediates fit in the
+  // memory limit. The connection which gives the lowest peak is chosen
+  // (and the fewest operations among equals).
+  prepareSliced(graph, storage, planar);
+  long long limit = getMemoryLimit();
+  while (limit > 0 && peak > limit) {
+    auto legs = slicedIndices(nodes, ranks, sliced);
+    ContractionPlan best(*this);
+    best.peak = -1;
+    for (const Connection& c : graph.allConnections()) {
+      if (legs[c.first.first][c.first.second] != -1)
+        continue;
+
+      // Every tensor must keep at least two indices
+      int left1 = count(legs[c.first.first].begin(),
+                        legs[c.first.first].end(), -1) - 1;
+      int left2 = count(legs[c.second.first].begin(),
+                        legs[c.second.first].end(), -1) - 1;
+      if (c.first.first == c.second.first)
+        left1 = left2 = left1 - 1;
+      if (left1 < 2 || left2 < 2)
+        continue;
+
+      ContractionPlan trial(*this);
+      trial.sliced.push_back(c);
+      try {
+        trial.prepareSliced(graph, storage, planar);
+      } catch (invalid_argument&) {
+        continue; // The remaining diagram is not connected
+      }
+      if (best.peak == -1 || trial.peak < best.peak ||
+          (trial.peak == best.peak && trial.cost.flops < best.cost.flops))
+        best = trial;
+    }
+    if (best.peak == -1)
+      throw invalid_argument("Error in ContractionPlan: The diagram can not "
+                             "be evaluated within the memory limit");
+    *this = best;
+  }
+}
+
+void ContractionPlan::prepareSliced(const Graph& graph,
+                                    const vector<vector<int>>& storage,
+                                    const vector<bool>& planar) {
+
+  // The diagram without the sliced connections. The tensors keep their
+  // remaining indices in the same order, and their format.
+  auto legs = slicedIndices(nodes, ranks, sliced);
+  Graph cut;
+  map<int, vector<int>> index;
+  vector<vector<int>> store(storage);
+  long long copies = 0;
+  for (int node : graph.getNodes()) {
+    int k = 0;
+    for (int c : legs[node])
+      index[node].push_back(c == -1 ? k++ : -1);
+    cut.addNode(node, k);
+    if (k < legs[node].size()) {
+      store[node] = cutStorage(storage[node], legs[node]);
+      long long elements = 1;
+      for (int i = 0; i < k; ++i)
+        elements *= size;
+      copies += elements;
+    }
+  }
+  for (const Connection& c : graph.allConnections()) {
+    if (legs[c.first.first][c.first.second] == -1)
+      cut.connect(c.first.first, index[c.first.first][c.first.second],
+                  c.second.first, index[c.second.first][c.second.second]);
+  }
+
+  // Order the contractions and prepare each of them
+  steps = schedule(cut, ranks.size(), size, &cost);
+  setups = make_shared<const vector<ContractionSetup>>(
+      prepare(steps, store, size, getEngine(), getGemmMethod(), planar));
+
+  memory = make_shared<const MemoryPlan>(
+      planMemory(steps, *setups, {steps.back().output}));
+
+  workspace = copies;
+  for (const ContractionSetup& s : *setups) {
+    long long elements = 1;
+    for (int i = 0; i < s.rank; ++i)
+      elements *= size;
+    workspace += elements;
+  }
+  peak = memory->peak + copies;
+
+  // The smaller diagram is evaluated for every value of the sliced indices
+  double values = 1;
+  for (int i = 0; i < sliced.size(); ++i)
+    values *= size;
+  cost.flops *= values;
+  cost.moves = (cost.moves + copies) * values;
+}
+
+std::string ContractionPlan::toString() const {
+  return describe(steps, *setups);
+}
+
+void ContractionPlan::execute(std::vector<Tensor>& tensors, Tensor& out,
+                              ContractionWorkspace* workspace) const {
+
+  // Check the layout of the tensors
+  if (tensors.size() < ranks.size())
+    throw invalid_argument("Error in ContractionPlan::execute: Too few "
+                           "tensors");
+  for (int node : nodes) {
+    if (tensors[node].getRank() != ranks[node] ||
+        tensors[node].getSize() != size)
+      throw invalid_argument("Error in ContractionPlan::execute: Tensor " +
+                             to_string(node) + " does not have the rank and "
+                             "size of the plan");
+  }
+
+  if (sliced.empty()) {
+    pichi::execute(steps, *setups, *memory, tensors, out, workspace,
+                   arena.get());
+    return;
+  }
+
+  // The tensors which are not cut are moved into the inputs of the smaller
+  // diagram, and moved back when done
+  auto legs = slicedIndices(nodes, ranks, sliced);
+  vector<int> whole, cut;
+  for (int node : nodes) {
+    if (count(legs[node].begin(), legs[node].end(), -1) == ranks[node])
+      whole.push_back(node);
+    else
+      cut.push_back(node);
+  }
+  vector<Tensor> inputs(tensors.size());
+  for (int node : whole)
+    swap(inputs[node], tensors[node]);
+
+  // Sum the smaller diagram over all values of the sliced indices
+  cdouble sum = 0.0;
+  vector<int> value(sliced.size(), 0);
+  try {
+    Tensor part;
+    bool more = true;
+    while (more) {
+      for (int node : cut) {
+        vector<int> fixed(ranks[node], -1);
+        for (int i = 0; i < ranks[node]; ++i) {
+          if (legs[node][i] != -1)
+            fixed[i] = value[legs[node][i]];
+        }
+        cutTensor(tensors[node], fixed, inputs[node]);
+      }
+      pichi::execute(steps, *setups, *memory, inputs, part, workspace,
+                     arena.get());
+      sum += part.getData()[0];
+
+      more = false;
+      for (int c = 0; c < value.size() && !more; ++c) {
+        if (++value[c] == size)
+          value[c] = 0;
+        else
+          more = true;
+      }
+    }
+  } catch (...) {
+    for (int node : whole)
+      swap(inputs[node], tensors[node]);
+    throw;
+  }
+  for (int node : whole)
+    swap(inputs[node], tensors[node]);
+
+  out.resize(0, size);
+  out.getData()[0] = sum;
+}
+
+
+
+// --- Batches -----------------------------------------------------------
+
+ContractionBatch::ContractionBatch(const std::vector<ContractionJob>& jobs,
+                                   const std::vector<int>& r, int n,
+                                   bool planar)
+    : arena(make_shared<PoolAllocator>(0)), ranks(r), size(n), shared(0) {
+
+  int ntensors = ranks.size();
+  vector<vector<int>> storage(ntensors);
+  for (int i = 0; i < ntensors; ++i) {
+    for (int j = 0; j < ranks[i]; ++j)
+      storage[i].push_back(j);
+  }
+
+  // Contractions already in the batch, keyed on their inputs (ids in the
+  // batch) and contracted indices. Since equal intermediates get equal ids,
+  // equal keys mean equal tensors.
+  map<pair<vector<int>, vector<pair<int,int>>>, int> known;
+  set<int> reused;
+
+  // Sub-diagrams computed by the jobs so far (see schedule in SCHEDULE.H).
+  // Later jobs prefer contraction orders which reuse them.
+  set<string> available;
+
+  for (const ContractionJob& job : jobs) {
+
+    // Check that the job matches the tensors
+    for (int node : job.graph.getNodes()) {
+      if (node < 0 || node >= job.tensors.size() ||
+          job.tensors[node] < 0 || job.tensors[node] >= ntensors)
+        throw invalid_argument("Error in ContractionBatch: Node " +
+                               to_string(node) + " does not correspond to a "
+                               "tensor");
+      if (ranks[job.tensors[node]] != job.graph.connections(node).size())
+        throw invalid_argument("Error in ContractionBatch: The rank of tensor "
+                               + to_string(job.tensors[node]) + " does not "
+                               "match the graph");
+    }
+
+    // If the job uses each tensor once, its nodes are renamed to the ids of
+    // the tensors in the batch. Jobs then order their operands in the same
+    // way, and equal contractions are found in equal form.
+    Graph relabelled;
+    int nj = job.tensors.size();
+    vector<int> id(job.tensors);
+    set<int> used;
+    for (int node : job.graph.getNodes())
+      used.insert(job.tensors[node]);
+    bool renamed = (used.size() == job.graph.getNodes().size());
+    if (renamed) {
+      for (int node : job.graph.getNodes())
+        relabelled.addNode(job.tensors[node],
+                           job.graph.connections(node).size());
+      for (int node : job.graph.getNodes()) {
+        auto conn = job.graph.connections(node);
+        for (int i = 0; i < conn.size(); ++i) {
+          if (conn[i].first != -1)
+            relabelled.connect(job.tensors[node], i,
+                               job.tensors[conn[i].first], conn[i].second);
+        }
+      }
+      nj = ntensors;
+      id.resize(ntensors);
+      for (int i = 0; i < ntensors; ++i)
+        id[i] = i;
+    }
+
+    // Plan the job, then translate its ids to ids in the batch
+    const Graph& graph = (renamed ? relabelled : job.graph);
+    vector<ContractionStep> js = schedule(graph, nj, size, nullptr,
+                                          (renamed ? &available : nullptr));
+    id.resize(js.back().output + 1);
+    for (const ContractionStep& step : js) {
+      ContractionStep bs = step;
+      for (int& i : bs.inputs)
+        i = id[i];
+      auto key = make_pair(bs.inputs, bs.indices);
+      auto it = known.find(key);
+      if (it == known.end()) {
+        bs.output = ntensors + steps.size();
+        known[key] = bs.output;
+        steps.push_back(bs);
+      }
+      else if (reused.insert(it->second).second)
+        ++shared;
+      id[step.output] = known[key];
+    }
+    results.push_back(id[js.back().output]);
+  }
+
+  if (!steps.empty())
+    setups = make_shared<const vector<ContractionSetup>>(
+        prepare(steps, storage, size, getEngine(), getGemmMethod(),
+                vector<bool>(ntensors, planar)));
+  else
+    setups = make_shared<const vector<ContractionSetup>>();
+
+  // The values of the jobs are kept until the end
+  vector<int> keep;
+  for (int id : results) {
+    if (id >= ntensors)
+      keep.push_back(id);
+  }
+  memory = make_shared<const MemoryPlan>(planMemory(steps, *setups, keep));
+}
+
+long long ContractionBatch::getPeakMemory() const {
+  return memory->peak;
+}
+
+std::string ContractionBatch::toString() const {
+  return describe(steps, *setups);
+}
+
+void ContractionBatch::execute(std::vector<Tensor>& tensors,
+                               std::vector<Tensor>& out,
+                               ContractionWorkspace* workspace) const {
+
+  // Check the layout of the tensors
+  if (tensors.size() < ranks.size())
+    throw invalid_argument("Error in ContractionBatch::execute: Too few "
+                           "tensors");
+  for (int i = 0; i < ranks.size(); ++i) {
+    if (tensors[i].getRank() != ranks[i] ||
+        (ranks[i] > 0 && tensors[i].getSize() != size))
+      throw invalid_argument("Error in ContractionBatch::execute: Tensor " +
+                             to_string(i) + " does not have the rank and "
+                             "size of the batch");
+  }
+
+  // Tensors and intermediates may be used by several contractions, so the
+  // steps run one at a time (each using all threads). Intermediates are
+  // released or recycled after their last use.
+  int n = ranks.size();
+  vector<Tensor> temps;
+  temps.reserve(steps.size());
+  for (int s = 0; s < steps.size(); ++s)
+    temps.emplace_back(arena.get());
+  auto tensor = [&](int id) -> Tensor& {
+    return (id < n ? tensors[id] : temps[id - n]);
+  };
+  for (int s = 0; s < steps.size(); ++s) {
+    const ContractionStep& step = steps[s];
+    if (memory->recycle[s] != -1)
+      temps[s] = move(temps[memory->recycle[s] - n]);
+    if (step.inputs.size() == 1)
+      runContraction((*setups)[s], tensor(step.inputs[0]), temps[s],
+                     workspace);
+    else
+      runContraction((*setups)[s], tensor(step.inputs[0]),
+                     tensor(step.inputs[1]), temps[s], workspace);
+    for (int id : memory->release[s])
+      temps[id - n] = Tensor(arena.get());
+  }
+
+  // Copy the values out of the intermediates, such that their data arrays
+  // go back to the arena
+  out.resize(results.size());
+  for (int j = 0; j < results.size(); ++j)
+    out[j] = tensor(results[j]);
+}
+
+}
@@ -0,0 +1,643 @@
+/* ****************************************************************************
+ *
+ * Implementation of the scheduling functions defined in SCHEDULE.H
+ *
+ * ***************************************************************************/
+
+#include <stdexcept>
+#include <limits>
+#include <functional>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include "pichi/contraction.h"
+#include "schedule.h"
+#include "thread_pool.h"
+#include "gemm.h"
+
+using namespace std;
+
+namespace pichi {
+
+// Diagrams with at most this many tensors (after tracing) are ordered by
+// dynamic programming. Larger diagrams are reduced greedily.
+static const int max_optimal = 14;
+
+namespace {
+
+/*
+ * A tensor during planning. The legs are the graph connections (node,index)
+ * the tensor indices correspond to, in order.
+ */
+struct Operand {
+  int id;
+  std::vector<std::pair<int,int>> legs;
+};
+
+double power(int size, int exponent) {
+  double r = 1.0;
+  for (int i = 0; i < exponent; ++i)
+    r *= size;
+  return r;
+}
+
+/*
+ * Estimated cost of contracting a rank r1 and a rank r2 tensor over nc
+ * indices. The storage changes follow the choices of the Auto engine: TTGT
+ * (nc >= 2) reorders both tensors, Slice (nc = 1) reorders them according
+ * to its heuristic, and complete contractions never do.
+ */
+ContractionCost pairCost(int size, int r1, int r2, int nc) {
+  ContractionCost c;
+  int rank = r1 + r2 - 2*nc;
+  c.flops = power(size, r1 + r2 - nc);
+  c.memory = power(size, rank);
+  c.moves = 0.0;
+  if (rank > 0) {
+    int rm = (r1 > r2 ? r1 : r2);
+    if (nc >= 2 || rm - (r1 + r2 - 4) < 2)
+      c.moves = power(size, r1) + power(size, r2);
+  }
+  return c;
+}
+
+double total(const ContractionCost& c) {
+  return c.flops + c.memory + c.moves;
+}
+
+void add(ContractionCost& c, const ContractionCost& x) {
+  c.flops += x.flops;
+  c.memory += x.memory;
+  c.moves += x.moves;
+}
+
+/*
+ * Adds a step contracting two operands over all connections between them,
+ * and returns the resulting operand.
+ */
+Operand contractOperands(const Graph& graph, const Operand& a,
+                         const Operand& b, int id,
+                         std::vector<ContractionStep>& steps) {
+
+  ContractionStep step;
+  step.inputs = {a.id, b.id};
+  step.output = id;
+
+  Operand out;
+  out.id = id;
+  std::vector<bool> used(b.legs.size(), false);
+  for (int i = 0; i < a.legs.size(); ++i) {
+    auto p = graph.connections(a.legs[i].first)[a.legs[i].second];
+    int j = 0;
+    while (j < b.legs.size() && b.legs[j] != p)
+      ++j;
+    if (j < b.legs.size()) {
+      step.indices.push_back(std::make_pair(i, j));
+      used[j] = true;
+    }
+    else
+      out.legs.push_back(a.legs[i]);
+  }
+  for (int j = 0; j < b.legs.size(); ++j) {
+    if (!used[j])
+      out.legs.push_back(b.legs[j]);
+  }
+
+  steps.push_back(step);
+  return out;
+}
+
+/*
+ * Gets the key of the sub-diagram made of a set of nodes (in increasing
+ * order): the nodes with their connections, where connections leaving the
+ * set are only marked as open.
+ */
+std::string subdiagramKey(const Graph& graph, const std::vector<int>& nodes) {
+  string key;
+  for (int node : nodes) {
+    key += to_string(node) + "(";
+    for (auto p : graph.connections(node)) {
+      if (binary_search(nodes.begin(), nodes.end(), p.first))
+        key += to_string(p.first) + "." + to_string(p.second) + ",";
+      else
+        key += "-,";
+    }
+    key += ")";
+  }
+  return key;
+}
+
+}
+
+std::vector<ContractionStep> schedule(const Graph& graph, int n, int size,
+                                      ContractionCost* cost,
+                                      std::set<std::string>* available) {
+
+  // Check the graph
+  std::set<int> nodes = graph.getNodes();
+  if (nodes.empty())
+    throw invalid_argument("Error in schedule: The diagram is empty");
+  if (graph.splitToConnected().size() != 1)
+    throw invalid_argument("Error in schedule: The diagram is not connected");
+  for (int node : nodes) {
+    if (node < 0 || node >= n)
+      throw invalid_argument("Error in schedule: Node " + to_string(node) +
+                             " does not correspond to a tensor");
+    for (auto p : graph.connections(node)) {
+      if (p.first == -1)
+        throw invalid_argument("Error in schedule: The diagram has open "
+                               "connections");
+    }
+  }
+
+  vector<ContractionStep> steps;
+  ContractionCost c = {0.0, 0.0, 0.0};
+  int idx = n; // Id of the next temporary tensor
+  const string rank1 = "Error in schedule: The diagram can not be contracted "
+      "without rank 1 intermediate tensors";
+
+  // Trace out the connections from a node to itself. The operands keep the
+  // connections to other nodes.
+  vector<Operand> operands;
+  vector<int> names; // The node of each operand
+  for (int node : nodes) {
+    auto conn = graph.connections(node);
+    ContractionStep step;
+    Operand op;
+    for (int i = 0; i < conn.size(); ++i) {
+      if (conn[i].first != node)
+        op.legs.push_back(make_pair(node, i));
+      else if (conn[i].second > i)
+        step.indices.push_back(make_pair(i, conn[i].second));
+    }
+    op.id = node;
+    if (!step.indices.empty()) {
+      if (op.legs.size() == 1)
+        throw invalid_argument(rank1);
+      step.inputs = {node};
+      step.output = idx;
+      steps.push_back(step);
+      op.id = idx++;
+      c.flops += power(size, conn.size() - step.indices.size());
+      c.memory += power(size, op.legs.size());
+      c.moves += power(size, conn.size());
+    }
+    operands.push_back(op);
+    names.push_back(node);
+  }
+  int k = operands.size();
+
+  // The nodes of the operands in a subset
+  auto subset = [&](int s) {
+    vector<int> r;
+    for (int i = 0; i < k; ++i) {
+      if (s & (1 << i))
+        r.push_back(names[i]);
+    }
+    return r;
+  };
+
+  // Rank of an operand and number of connections between two operands
+  auto connected = [&](const Operand& a, const Operand& b) {
+    int count = 0;
+    for (auto l : a.legs) {
+      auto p = graph.connections(l.first)[l.second];
+      for (auto m : b.legs)
+        count += (m == p);
+    }
+    return count;
+  };
+
+  if (k <= max_optimal) {
+
+    // The rank of the tensor obtained by contracting a subset of the
+    // operands is the number of connections leaving the subset.
+    int full = (1 << k) - 1;
+    vector<vector<int>> shared(k, vector<int>(k, 0));
+    for (int i = 0; i < k; ++i)
+      for (int j = 0; j < k; ++j)
+        shared[i][j] = (i == j ? 0 : connected(operands[i], operands[j]));
+    vector<int> open(full + 1, 0);
+    for (int s = 1; s <= full; ++s) {
+      int v = 0;
+      while (!(s & (1 << v)))
+        ++v;
+      int rest = s & ~(1 << v);
+      int r = open[rest] + operands[v].legs.size();
+      for (int u = 0; u < k; ++u) {
+        if (rest & (1 << u))
+          r -= 2*shared[v][u];
+      }
+      open[s] = r;
+    }
+
+    // best[s] is the cheapest cost of contracting the subset s into a single
+    // tensor, and split[s] the first part of the last contraction.
+    const double inf = numeric_limits<double>::infinity();
+    vector<double> best(full + 1, inf);
+    vector<int> split(full + 1, 0);
+    for (int i = 0; i < k; ++i)
+      best[1 << i] = 0.0;
+    for (int s = 1; s <= full; ++s) {
+      if (!(s & (s - 1)) || (open[s] == 1))
+        continue;
+      int low = s & -s;
+      // Run through the parts containing the lowest operand
+      for (int a = (s - 1) & s; a > 0; a = (a - 1) & s) {
+        if (!(a & low))
+          continue;
+        int b = s ^ a;
+        if (best[a] == inf || best[b] == inf)
+          continue;
+        int nc = (open[a] + open[b] - open[s]) / 2;
+        if (nc == 0)
+          continue;
+        double x = best[a] + best[b] +
+            total(pairCost(size, open[a], open[b], nc));
+        if (x < best[s]) {
+          best[s] = x;
+          split[s] = a;
+        }
+      }
+      // Sub-diagrams which are already available cost nothing. The split is
+      // kept, so that the sub-diagram is contracted in the same way as
+      // where it was first found.
+      if (available && best[s] != inf &&
+          available->count(subdiagramKey(graph, subset(s))))
+        best[s] = 0.0;
+    }
+    if (best[full] == inf)
+      throw invalid_argument(rank1);
+
+    // Make the steps, contracting the parts before the whole
+    function<Operand(int)> build = [&](int s) -> Operand {
+      if (!(s & (s - 1))) {
+        int v = 0;
+        while (s != (1 << v))
+          ++v;
+        return operands[v];
+      }
+      int a = split[s];
+      int b = s ^ a;
+      Operand oa = build(a);
+      Operand ob = build(b);
+      if (available)
+        available->insert(subdiagramKey(graph, subset(s)));
+      add(c, pairCost(size, open[a], open[b],
+                      (open[a] + open[b] - open[s]) / 2));
+      return contractOperands(graph, oa, ob, idx++, steps);
+    };
+    build(full);
+
+  }
+  else {
+
+    // Greedy: contract the cheapest pair of connected operands until one is
+    // left
+    while (operands.size() > 1) {
+      int bi = -1, bj = -1;
+      ContractionCost bc;
+      for (int i = 0; i < operands.size(); ++i) {
+        for (int j = i + 1; j < operands.size(); ++j) {
+          int nc = connected(operands[i], operands[j]);
+          int r1 = operands[i].legs.size();
+          int r2 = operands[j].legs.size();
+          if (nc == 0 || r1 + r2 - 2*nc == 1)
+            continue;
+          ContractionCost x = pairCost(size, r1, r2, nc);
+          if (bi == -1 || total(x) < total(bc)) {
+            bi = i;
+            bj = j;
+            bc = x;
+          }
+        }
+      }
+      if (bi == -1)
+        throw invalid_argument(rank1);
+      add(c, bc);
+      Operand o = contractOperands(graph, operands[bi], operands[bj], idx++,
+                                   steps);
+      operands.erase(operands.begin() + bj);
+      operands[bi] = o;
+    }
+
+  }
+
+  if (steps.empty())
+    throw invalid_argument("Error in schedule: The diagram has no "
+                           "contractions");
+  if (cost)
+    *cost = c;
+  return steps;
+}
+
+ContractionCost estimateCost(const Graph& graph, int size) {
+  set<int> nodes = graph.getNodes();
+  int n = (nodes.empty() ? 0 : *nodes.rbegin() + 1);
+  ContractionCost cost;
+  schedule(graph, n, size, &cost);
+  return cost;
+}
+
+
+std::vector<ContractionSetup> prepare(
+    const std::vector<ContractionStep>& steps,
+    const std::vector<std::vector<int>>& storage, int size, Engine engine,
+    GemmMethod method, const std::vector<bool>& planar) {
+
+  // Storage vectors and formats of all tensors, following the outputs of
+  // the steps
+  vector<vector<int>> store(storage);
+  store.resize(steps.back().output + 1);
+  vector<bool> format(planar);
+  format.resize(steps.back().output + 1, false);
+
+  vector<ContractionSetup> setups;
+  for (const ContractionStep& step : steps) {
+    if (step.inputs.size() == 1) {
+      setups.push_back(prepareContraction(size, store[step.inputs[0]],
+                                          step.indices));
+    } else {
+      bool both = (format[step.inputs[0]] && format[step.inputs[1]]);
+      setups.push_back(prepareContraction(size, store[step.inputs[0]],
+                                          store[step.inputs[1]], step.indices,
+                                          engine, method, both));
+      format[step.output] = (both &&
+                             setups.back().kind == ContractionSetup::TTGT);
+    }
+    store[step.output] = setups.back().store_out;
+  }
+  return setups;
+}
+
+
+std::string describe(const std::vector<ContractionStep>& steps,
+                     const std::vector<ContractionSetup>& setups) {
+  static const char* kinds[] = {"Trace", "Inner", "Slices", "TTGT",
+                                "Strided"};
+  ostringstream res;
+  for (int s = 0; s < steps.size(); ++s) {
+    const ContractionStep& step = steps[s];
+    res << step.output << " = contract(";
+    for (int i : step.inputs)
+      res << i << ", ";
+    res << "{";
+    for (int i = 0; i < step.indices.size(); ++i)
+      res << (i > 0 ? "," : "") << "(" << step.indices[i].first << ","
+          << step.indices[i].second << ")";
+    res << "}) " << kinds[setups[s].kind];
+    if (setups[s].kind == ContractionSetup::TTGT &&
+        setups[s].method == GemmMethod::Gauss)
+      res << " 3M";
+    if (setups[s].kind == ContractionSetup::Slices)
+      res << ": " << setups[s].slices->toString();
+    res << "\n";
+  }
+  return res.str();
+}
+
+
+MemoryPlan planMemory(const std::vector<ContractionStep>& steps,
+                      const std::vector<ContractionSetup>& setups,
+                      const std::vector<int>& keep) {
+
+  int nsteps = steps.size();
+  MemoryPlan plan;
+  plan.recycle = vector<int>(nsteps, -1);
+  plan.release = vector<vector<int>>(nsteps);
+  plan.peak = 0;
+  if (nsteps == 0)
+    return plan;
+
+  // Intermediate i has the id N+i, is made by step i and is last used by
+  // step last[i] (nsteps if it is kept).
+  int n = steps[0].output;
+  vector<int> last(nsteps, -1);
+  vector<long long> elements(nsteps);
+  for (int s = 0; s < nsteps; ++s) {
+    for (int id : steps[s].inputs) {
+      if (id >= n)
+        last[id - n] = s;
+    }
+    elements[s] = 1;
+    for (int i = 0; i < setups[s].rank; ++i)
+      elements[s] *= setups[s].size;
+  }
+  for (int id : keep)
+    last[id - n] = nsteps;
+
+  // Elements held while each step runs, when intermediates are released
+  // right after their last use. Intermediates which are never used are
+  // released after the step making them.
+  vector<long long> live(nsteps, 0);
+  for (int i = 0; i < nsteps; ++i) {
+    int end = (last[i] == -1 ? i : last[i]);
+    for (int s = i; s <= end && s < nsteps; ++s)
+      live[s] += elements[i];
+  }
+  long long peak = *max_element(live.begin(), live.end());
+
+  // A dead intermediate is handed on to a later step with an output of the
+  // same number of elements, if keeping it until then does not increase the
+  // peak. The one released last is preferred, since it is held the shortest.
+  vector<bool> recycled(nsteps, false);
+  for (int t = 0; t < nsteps; ++t) {
+    int best = -1;
+    for (int i = 0; i < t; ++i) {
+      if (recycled[i] || last[i] < 0 || last[i] >= t ||
+          elements[i] != elements[t])
+        continue;
+      long long held = 0;
+      for (int s = last[i] + 1; s < t; ++s)
+        held = max(held, live[s]);
+      if (held + elements[i] > peak)
+        continue;
+      if (best == -1 || last[i] > last[best])
+        best = i;
+    }
+    if (best != -1) {
+      recycled[best] = true;
+      plan.recycle[t] = n + best;
+      for (int s = last[best] + 1; s < t; ++s)
+        live[s] += elements[best];
+    }
+  }
+
+  for (int i = 0; i < nsteps; ++i) {
+    if (!recycled[i] && last[i] < nsteps)
+      plan.release[last[i] == -1 ? i : last[i]].push_back(n + i);
+  }
+  plan.peak = peak;
+  return plan;
+}
+
+
+/*
+ * Stores the result of a schedule in the output tensor. It is copied if its
+ * data array was taken from the allocator of the intermediates.
+ */
+static void takeResult(Tensor& result, Tensor& out,
+                       TensorAllocator* intermediates) {
+  if (intermediates)
+    out = result;
+  else
+    out = move(result);
+}
+
+void execute(const std::vector<ContractionStep>& steps,
+             const std::vector<ContractionSetup>& setups,
+             const MemoryPlan& memory, std::vector<Tensor>& tensors,
+             Tensor& out, ContractionWorkspace* workspace,
+             TensorAllocator* intermediates) {
+
+  int nsteps = steps.size();
+  if (nsteps == 0)
+    throw invalid_argument("Error in execute: Empty schedule");
+  int n = steps[0].output;
+
+  // Temporary tensors, indexed by id-N. The vector is never resized while
+  // the steps run, so references to the tensors stay valid.
+  vector<Tensor> temps;
+  temps.reserve(nsteps);
+  for (int s = 0; s < nsteps; ++s)
+    temps.emplace_back(intermediates);
+  auto tensor = [&](int id) -> Tensor& {
+    return (id < n ? tensors[id] : temps[id - n]);
+  };
+
+  auto run = [&](int s) {
+    const ContractionStep& step = steps[s];
+    Tensor& t = temps[step.output - n];
+    // Take over the data array of a dead intermediate
+    if (memory.recycle[s] != -1)
+      t = move(temps[memory.recycle[s] - n]);
+    if (step.inputs.size() == 1)
+      runContraction(setups[s], tensor(step.inputs[0]), t, workspace);
+    else
+      runContraction(setups[s], tensor(step.inputs[0]),
+                     tensor(step.inputs[1]), t, workspace);
+    // Release intermediates which are no longer needed
+    for (int id : memory.release[s])
+      temps[id - n] = Tensor(intermediates);
+  };
+
+  // Find the dependencies between the steps: a step waits for the steps
+  // producing its temporary inputs, and for the step releasing the data
+  // array it takes over.
+  vector<int> waiting(nsteps, 0);
+  vector<vector<int>> dependents(nsteps);
+  vector<int> last(nsteps, -1);
+  for (int s = 0; s < nsteps; ++s) {
+    for (int id : steps[s].inputs) {
+      if (id >= n) {
+        ++waiting[s];
+        dependents[id - n].push_back(s);
+        last[id - n] = s;
+      }
+    }
+  }
+  for (int s = 0; s < nsteps; ++s) {
+    if (memory.recycle[s] != -1) {
+      ++waiting[s];
+      dependents[last[memory.recycle[s] - n]].push_back(s);
+    }
+  }
+  vector<int> ready;
+  for (int s = 0; s < nsteps; ++s) {
+    if (waiting[s] == 0)
+      ready.push_back(s);
+  }
+
+  // Every intermediate tensor is used exactly once, so the steps form a
+  // tree. It can only be evaluated in parallel if it has more than one leaf.
+  // Otherwise the steps run in order, each of them using all threads.
+  if (getThreads() == 1 || ThreadPool::inWorker() || ready.size() < 2) {
+    for (int s = 0; s < nsteps; ++s)
+      run(s);
+    takeResult(temps[nsteps - 1], out, intermediates);
+    return;
+  }
+
+  // Marks a step as done, and the steps waiting for it only as ready
+  auto finish = [&](int s) {
+    for (int d : dependents[s]) {
+      if (--waiting[d] == 0)
+        ready.push_back(d);
+    }
+  };
+
+  // While several steps are ready or running, they run in parallel, each of
+  // them on a single thread. The participating threads take ready steps from
+  // a shared list. They leave once at most one step is ready and none is
+  // running, such that the workers are free for parallel work within the
+  // next step.
+  mutex mtx;
+  condition_variable cv;
+  int active = 0;
+  int running = 0;
+  exception_ptr error;
+
+  auto work = [&]() {
+    SerialRegion serial; // Makes the caller run its steps serially
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+      cv.wait(lock, [&]{ return !ready.empty() || active == 0 || error; });
+      if (error || (active == 0 && ready.size() < 2))
+        break;
+      int s = ready.back();
+      ready.pop_back();
+      ++active;
+      lock.unlock();
+      try {
+        run(s);
+      } catch (...) {
+        lock.lock();
+        if (!error)
+          error = current_exception();
+        --active;
+        cv.notify_all();
+        break;
+      }
+      lock.lock();
+      --active;
+      finish(s);
+      cv.notify_all();
+    }
+    --running;
+    cv.notify_all();
+  };
+
+  while (!ready.empty()) {
+    // A step which can not run alongside any other step gets all threads
+    if (ready.size() == 1) {
+      int s = ready.back();
+      ready.pop_back();
+      run(s);
+      finish(s);
+      continue;
+    }
+
+    // Run BLAS on a single thread while the steps run in parallel
+    SerialBlasRegion serial_blas;
+
+    int helpers = threadPool().size();
+    if (helpers > nsteps - 1)
+      helpers = nsteps - 1;
+    running = helpers + 1;
+    for (int i = 0; i < helpers; ++i)
+      threadPool().submit(work);
+    work();
+
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait(lock, [&]{ return running == 0; });
+    }
+
+    if (error)
+      rethrow_exception(error);
+  }
+  takeResult(temps[nsteps - 1], out, intermediates);
+}
+
+}
@@ -0,0 +1,127 @@
+#ifndef PICHI_SCHEDULE_H
+#define PICHI_SCHEDULE_H
+
+#include <vector>
+#include <set>
+#include <string>
+#include "pichi/allocator.h"
+#include "pichi/contraction.h"
+#include "pichi/graph.h"
+#include "pichi/plan.h"
+#include "pichi/tensor.h"
+#include "engines.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the scheduling of contractions of complete diagrams.
+ *
+ * A diagram (represented by a graph) is evaluated through a number of steps
+ * (see ContractionStep in PLAN.H). In each step one or two tensors are
+ * contracted into a new, temporary tensor.
+ *
+ * Steps only depend on each other through their inputs. Steps whose inputs
+ * are all available are independent and can be executed in parallel.
+ *
+ * The order of the steps is found by minimising the estimated cost (see
+ * ContractionCost in CONTRACTION.H). Indices contracted on a single tensor
+ * are always traced out first. The remaining tensors are then contracted
+ * pairwise, choosing the order among all binary contraction trees (dynamic
+ * programming over subsets of tensors). A tree is only allowed if none of
+ * its intermediate tensors have rank 1.
+ *
+ * ***********************************************************************/
+
+/*
+ * Makes a schedule for the evaluation of a diagram with tensors of a given
+ * size. The number of input tensors N is needed to number the temporary
+ * tensors. If cost is given, the estimated cost of the schedule is stored.
+ * Throws an invalid_argument exception if the diagram is not connected, has
+ * open connections or nodes outside [0,N), or needs rank 1 intermediates.
+ *
+ * If available is given, it holds the keys of sub-diagrams which are computed
+ * anyway (for example by other diagrams in a batch). They are considered to
+ * cost nothing, and the keys of the sub-diagrams of the new schedule are
+ * added. A key is made from the node names, so this is only meaningful if
+ * equal node names refer to equal tensors. Only diagrams which are ordered by
+ * dynamic programming take the available sub-diagrams into account.
+ */
+std::vector<ContractionStep> schedule(const Graph& graph, int n, int size,
+                                      ContractionCost* cost = nullptr,
+                                      std::set<std::string>* available =
+                                          nullptr);
+
+/*
+ * Prepares the contractions of a schedule for input tensors of a given size
+ * and storage (only the storage of the tensors used in the schedule is read).
+ * Two-tensor contractions use the given engine and method. planar[i] tells
+ * whether input tensor i is planar (false if there is no entry), and the
+ * outputs of TTGT on two planar tensors are planar as well.
+ */
+std::vector<ContractionSetup> prepare(
+    const std::vector<ContractionStep>& steps,
+    const std::vector<std::vector<int>>& storage, int size, Engine engine,
+    GemmMethod method = GemmMethod::Standard,
+    const std::vector<bool>& planar = std::vector<bool>());
+
+/*
+ * Describes a prepared schedule for inspection, one line per step: the
+ * output, the inputs and the contracted indices, followed by the engine. For
+ * the slice engine, the roles of the indices are also given (see toString in
+ * SLICE_ITERATOR.H). Example:
+ *    3 = contract(1, 2, {(1,0)}) Slices: SC (1,0) | SF 1:0 2:1
+ *    4 = contract(0, 3, {(0,1),(1,0)}) Inner
+ */
+std::string describe(const std::vector<ContractionStep>& steps,
+                     const std::vector<ContractionSetup>& setups);
+
+/*
+ * The handling of the memory of the intermediate tensors of a schedule.
+ * Intermediates are released right after the step using them. If a later
+ * step makes an output with the same number of elements, it may instead take
+ * over the data array of the dead intermediate, as long as this does not
+ * increase the peak memory.
+ *
+ * recycle[s]: The id of the intermediate whose data array step s takes over,
+ *             or -1.
+ * release[s]: The ids of the intermediates released after step s.
+ * peak:       The largest number of elements held in intermediates at any
+ *             time when the steps run in order. Independent steps running in
+ *             parallel may hold more.
+ */
+struct MemoryPlan {
+  std::vector<int> recycle;
+  std::vector<std::vector<int>> release;
+  long long peak;
+};
+
+/*
+ * Makes the memory plan for a prepared schedule. The intermediates with the
+ * ids in keep are never released or recycled.
+ */
+MemoryPlan planMemory(const std::vector<ContractionStep>& steps,
+                      const std::vector<ContractionSetup>& setups,
+                      const std::vector<int>& keep);
+
+/*
+ * Executes a prepared schedule on a set of input tensors. Steps are executed
+ * as soon as their inputs are ready, and independent steps run in parallel on
+ * the thread pool, each of them on a single thread. A step which can not run
+ * alongside any other step, such as the last one, uses all threads.
+ * Intermediates are handled according to the memory plan.
+ * Scratch buffers are taken from the workspace, if one is given.
+ * If an allocator is given, the data arrays of the intermediates are taken
+ * from it, and the result of the last step is copied into the output tensor
+ * such that its array goes back to the allocator. Otherwise the result is
+ * moved into the output tensor.
+ */
+void execute(const std::vector<ContractionStep>& steps,
+             const std::vector<ContractionSetup>& setups,
+             const MemoryPlan& memory, std::vector<Tensor>& tensors,
+             Tensor& out, ContractionWorkspace* workspace = nullptr,
+             TensorAllocator* intermediates = nullptr);
+
+}
+
+#endif //PICHI_SCHEDULE_H
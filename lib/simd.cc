@@ -0,0 +1,119 @@
+/* ****************************************************************************
+ *
+ * Run time selection of the SIMD microkernels defined in SIMD.H
+ *
+ * ***************************************************************************/
+
+#include "simd.h"
+
+namespace pichi {
+
+// Finds the best level supported by the processor and the build
+static SimdLevel detect() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+#ifdef PICHI_HAVE_AVX512
+  if (__builtin_cpu_supports("avx512f"))
+    return SimdLevel::AVX512;
+#endif
+#ifdef PICHI_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return SimdLevel::AVX2;
+#endif
+#endif
+  return SimdLevel::None;
+}
+
+static SimdLevel supported() {
+  static SimdLevel best = detect();
+  return best;
+}
+
+// The current level
+static SimdLevel& level() {
+  static SimdLevel current = supported();
+  return current;
+}
+
+SimdLevel getSimdLevel() {
+  return level();
+}
+
+SimdLevel setSimdLevel(SimdLevel l) {
+  SimdLevel prev = level();
+  level() = (l > supported() ? supported() : l);
+  return prev;
+}
+
+void gemmSimd(bool transa, bool transb, long long m, long long n,
+              long long k, const cdouble* a, long long lda,
+              const cdouble* b, long long ldb, cdouble beta, cdouble* c,
+              long long ldc) {
+  const double* da = reinterpret_cast<const double*>(a);
+  const double* db = reinterpret_cast<const double*>(b);
+  const double* dbeta = reinterpret_cast<const double*>(&beta);
+  double* dc = reinterpret_cast<double*>(c);
+  switch (level()) {
+#ifdef PICHI_HAVE_AVX512
+    case SimdLevel::AVX512: {
+      gemmAVX512(transa, transb, m, n, k, da, lda, db, ldb, dbeta, dc, ldc);
+      break;
+    }
+#endif
+#ifdef PICHI_HAVE_AVX2
+    case SimdLevel::AVX2: {
+      gemmAVX2(transa, transb, m, n, k, da, lda, db, ldb, dbeta, dc, ldc);
+      break;
+    }
+#endif
+    default: break;
+  }
+}
+
+void gemmRealSimd(bool transa, bool transb, long long m, long long n,
+                  long long k, double alpha, const double* a, long long lda,
+                  const double* b, long long ldb, double beta, double* c,
+                  long long ldc) {
+  switch (level()) {
+#ifdef PICHI_HAVE_AVX512
+    case SimdLevel::AVX512: {
+      gemmRealAVX512(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c,
+                     ldc);
+      break;
+    }
+#endif
+#ifdef PICHI_HAVE_AVX2
+    case SimdLevel::AVX2: {
+      gemmRealAVX2(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c,
+                   ldc);
+      break;
+    }
+#endif
+    default: break;
+  }
+}
+
+cdouble dotSimd(long long n, const cdouble* x, const cdouble* y,
+                long long incy) {
+  const double* dx = reinterpret_cast<const double*>(x);
+  const double* dy = reinterpret_cast<const double*>(y);
+  double res[2] = {0.0, 0.0};
+  switch (level()) {
+#ifdef PICHI_HAVE_AVX512
+    case SimdLevel::AVX512: {
+      dotAVX512(n, dx, dy, incy, res);
+      break;
+    }
+#endif
+#ifdef PICHI_HAVE_AVX2
+    case SimdLevel::AVX2: {
+      dotAVX2(n, dx, dy, incy, res);
+      break;
+    }
+#endif
+    default: break;
+  }
+  return cdouble(res[0], res[1]);
+}
+
+}
@@ -0,0 +1,92 @@
+#ifndef PICHI_SIMD_H
+#define PICHI_SIMD_H
+
+#include "pichi/tensor.h"
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the SIMD microkernels for small complex matrices.
+ *
+ * Most slice products are small (n = 16-128), where the call overhead of an
+ * external BLAS library is a large part of the time. The microkernels are
+ * written with AVX2 (with FMA) and AVX-512 intrinsics and keep blocks of the
+ * result in registers. They do no packing or cache blocking, so BLAS is
+ * faster for large matrices. A real gemm kernel, written the same way,
+ * multiplies the planes of planar tensors (see TENSOR.H).
+ *
+ * Each instruction set has its own translation unit, compiled with the
+ * matching compiler flags, which are detected at build time (and define
+ * PICHI_HAVE_AVX2 and PICHI_HAVE_AVX512). The kernel to use is chosen at run
+ * time from what the processor supports (CPUID). Without support, the
+ * callers fall back to their plain C++ code.
+ *
+ * The kernels of a translation unit compiled for AVX must not emit inline
+ * functions shared with the rest of the library (the linker may keep the
+ * AVX version of such a function for everyone). They are therefore
+ * declared with plain double arrays, which hold the real and imaginary parts
+ * of each complex number in turn, and leading dimensions and strides in
+ * complex numbers.
+ *
+ * ***********************************************************************/
+
+enum class SimdLevel {None, AVX2, AVX512};
+
+/*
+ * Gets or sets the instruction set used by the microkernels. The default is
+ * the best one supported by the processor and the build. A level which is
+ * not supported is lowered to the best one which is. setSimdLevel returns
+ * the previous level.
+ */
+SimdLevel getSimdLevel();
+SimdLevel setSimdLevel(SimdLevel);
+
+/*
+ * The microkernels of the current level, with the same arguments as gemm
+ * (see GEMM.H) and dot (see KERNELS.H). They must only be called if the
+ * level is not None.
+ */
+void gemmSimd(bool transa, bool transb, long long m, long long n,
+              long long k, const cdouble* a, long long lda,
+              const cdouble* b, long long ldb, cdouble beta, cdouble* c,
+              long long ldc);
+cdouble dotSimd(long long n, const cdouble* x, const cdouble* y,
+                long long incy);
+
+/*
+ * The real matrix product
+ *    C = alpha op(A) op(B) + beta C ,
+ * with the same conventions as gemm, used for planar tensors (see
+ * TENSOR.H). It must only be called if the level is not None.
+ */
+void gemmRealSimd(bool transa, bool transb, long long m, long long n,
+                  long long k, double alpha, const double* a, long long lda,
+                  const double* b, long long ldb, double beta, double* c,
+                  long long ldc);
+
+// --- Kernels per instruction set -------------------------------------------
+
+void gemmAVX2(bool transa, bool transb, long long m, long long n,
+              long long k, const double* a, long long lda, const double* b,
+              long long ldb, const double* beta, double* c, long long ldc);
+void dotAVX2(long long n, const double* x, const double* y, long long incy,
+             double* res);
+void gemmRealAVX2(bool transa, bool transb, long long m, long long n,
+                  long long k, double alpha, const double* a, long long lda,
+                  const double* b, long long ldb, double beta, double* c,
+                  long long ldc);
+
+void gemmAVX512(bool transa, bool transb, long long m, long long n,
+                long long k, const double* a, long long lda, const double* b,
+                long long ldb, const double* beta, double* c, long long ldc);
+void dotAVX512(long long n, const double* x, const double* y,
+               long long incy, double* res);
+void gemmRealAVX512(bool transa, bool transb, long long m, long long n,
+                    long long k, double alpha, const double* a,
+                    long long lda, const double* b, long long ldb,
+                    double beta, double* c, long long ldc);
+
+}
+
+#endif //PICHI_SIMD_H
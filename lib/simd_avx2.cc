@@ -0,0 +1,81 @@
+/* ****************************************************************************
+ *
+ * The SIMD microkernels defined in SIMD.H for AVX2 (with FMA). This file is
+ * compiled with -mavx2 -mfma, if the compiler supports them.
+ *
+ * ***************************************************************************/
+
+#include "simd.h"
+
+#ifdef PICHI_HAVE_AVX2
+
+#include <immintrin.h>
+#include "simd_kernels.h"
+
+namespace pichi {
+
+namespace {
+
+// Two complex numbers per register
+struct AVX2 {
+
+  typedef __m256d T;
+  static const int W = 2;
+  static const int R = 2;
+  static const int C = 3;
+
+  static T zero() { return _mm256_setzero_pd(); }
+  static T set(double x) { return _mm256_set1_pd(x); }
+
+  static T load(const double* p) { return _mm256_loadu_pd(p); }
+  static void store(double* p, T x) { _mm256_storeu_pd(p, x); }
+
+  // Mask of the first cnt complex numbers (cnt < 2)
+  static __m256i mask(int cnt) {
+    return _mm256_set_epi64x(0, 0, -cnt, -cnt);
+  }
+  static T load(const double* p, int cnt) {
+    return _mm256_maskload_pd(p, mask(cnt));
+  }
+  static void store(double* p, T x, int cnt) {
+    _mm256_maskstore_pd(p, mask(cnt), x);
+  }
+
+  static T gather(const double* p, long long inc, int cnt) {
+    __m128d lo = _mm_loadu_pd(p);
+    __m128d hi = (cnt > 1 ? _mm_loadu_pd(p + 2*inc) : _mm_setzero_pd());
+    return _mm256_insertf128_pd(_mm256_castpd128_pd256(lo), hi, 1);
+  }
+
+  static T add(T x, T y) { return _mm256_add_pd(x, y); }
+  static T mul(T x, T y) { return _mm256_mul_pd(x, y); }
+  static T fmadd(T x, T y, T z) { return _mm256_fmadd_pd(x, y, z); }
+  static T fmaddsub(T x, T y, T z) { return _mm256_fmaddsub_pd(x, y, z); }
+  static T swap(T x) { return _mm256_permute_pd(x, 0x5); }
+
+};
+
+}
+
+void gemmAVX2(bool transa, bool transb, long long m, long long n,
+              long long k, const double* a, long long lda, const double* b,
+              long long ldb, const double* beta, double* c, long long ldc) {
+  gemmKernel<AVX2>(transa, transb, m, n, k, a, lda, b, ldb, beta, c, ldc);
+}
+
+void dotAVX2(long long n, const double* x, const double* y, long long incy,
+             double* res) {
+  dotKernel<AVX2>(n, x, y, incy, res);
+}
+
+void gemmRealAVX2(bool transa, bool transb, long long m, long long n,
+                  long long k, double alpha, const double* a, long long lda,
+                  const double* b, long long ldb, double beta, double* c,
+                  long long ldc) {
+  gemmRealKernel<AVX2>(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta,
+                       c, ldc);
+}
+
+}
+
+#endif
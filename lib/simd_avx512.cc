@@ -0,0 +1,90 @@
+/* ****************************************************************************
+ *
+ * The SIMD microkernels defined in SIMD.H for AVX-512. This file is compiled
+ * with -mavx512f, if the compiler supports it.
+ *
+ * ***************************************************************************/
+
+#include "simd.h"
+
+#ifdef PICHI_HAVE_AVX512
+
+#include <immintrin.h>
+#include "simd_kernels.h"
+
+namespace pichi {
+
+namespace {
+
+// Four complex numbers per register
+struct AVX512 {
+
+  typedef __m512d T;
+  static const int W = 4;
+  static const int R = 2;
+  static const int C = 4;
+
+  static T zero() { return _mm512_setzero_pd(); }
+  static T set(double x) { return _mm512_set1_pd(x); }
+
+  static T load(const double* p) { return _mm512_loadu_pd(p); }
+  static void store(double* p, T x) { _mm512_storeu_pd(p, x); }
+
+  // Mask of the first cnt complex numbers
+  static __mmask8 mask(int cnt) { return (1 << 2*cnt) - 1; }
+  static T load(const double* p, int cnt) {
+    return _mm512_maskz_loadu_pd(mask(cnt), p);
+  }
+  static void store(double* p, T x, int cnt) {
+    _mm512_mask_storeu_pd(p, mask(cnt), x);
+  }
+
+  static T gather(const double* p, long long inc, int cnt) {
+    if (cnt < W) {
+      double tmp[2*W] = {};
+      for (int q = 0; q < cnt; ++q) {
+        tmp[2*q] = p[2*q*inc];
+        tmp[2*q+1] = p[2*q*inc+1];
+      }
+      return load(tmp);
+    }
+    __m256d lo = _mm256_insertf128_pd(
+        _mm256_castpd128_pd256(_mm_loadu_pd(p)), _mm_loadu_pd(p + 2*inc), 1);
+    __m256d hi = _mm256_insertf128_pd(
+        _mm256_castpd128_pd256(_mm_loadu_pd(p + 4*inc)),
+        _mm_loadu_pd(p + 6*inc), 1);
+    return _mm512_insertf64x4(_mm512_castpd256_pd512(lo), hi, 1);
+  }
+
+  static T add(T x, T y) { return _mm512_add_pd(x, y); }
+  static T mul(T x, T y) { return _mm512_mul_pd(x, y); }
+  static T fmadd(T x, T y, T z) { return _mm512_fmadd_pd(x, y, z); }
+  static T fmaddsub(T x, T y, T z) { return _mm512_fmaddsub_pd(x, y, z); }
+  static T swap(T x) { return _mm512_permute_pd(x, 0x55); }
+
+};
+
+}
+
+void gemmAVX512(bool transa, bool transb, long long m, long long n,
+                long long k, const double* a, long long lda, const double* b,
+                long long ldb, const double* beta, double* c, long long ldc) {
+  gemmKernel<AVX512>(transa, transb, m, n, k, a, lda, b, ldb, beta, c, ldc);
+}
+
+void dotAVX512(long long n, const double* x, const double* y,
+               long long incy, double* res) {
+  dotKernel<AVX512>(n, x, y, incy, res);
+}
+
+void gemmRealAVX512(bool transa, bool transb, long long m, long long n,
+                    long long k, double alpha, const double* a, long long lda,
+                    const double* b, long long ldb, double beta, double* c,
+                    long long ldc) {
+  gemmRealKernel<AVX512>(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta,
+                         c, ldc);
+}
+
+}
+
+#endif
@@ -0,0 +1,365 @@
+#ifndef PICHI_SIMD_KERNELS_H
+#define PICHI_SIMD_KERNELS_H
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file contains the code of the SIMD microkernels declared in SIMD.H,
+ * written once for any instruction set. It is only included by the
+ * translation units of the instruction sets, which define a vector type V
+ * with:
+ *
+ *    T                      The vector register type
+ *    W                      The number of complex numbers in a register
+ *    R, C                   The block of the result kept in registers by
+ *                           gemm: R registers (R*W rows) times C columns
+ *    zero(), set(x)         All elements 0, or x
+ *    load(p), store(p,x)    Full registers
+ *    load(p,cnt),           The first cnt < W complex numbers, the rest of
+ *    store(p,x,cnt)         the register being 0 (load) or unused (store)
+ *    gather(p,inc,cnt)      The cnt <= W complex numbers p[0], p[inc], ...
+ *    add(x,y), mul(x,y)
+ *    fmadd(x,y,z)           x*y + z
+ *    fmaddsub(x,y,z)        x*y - z for the real parts, x*y + z for the
+ *                           imaginary parts
+ *    swap(x)                Swaps the real and imaginary parts
+ *
+ * Complex numbers are pairs of doubles, and all strides are in complex
+ * numbers. Everything is in an anonymous namespace, such that the code
+ * compiled for an instruction set is never shared with other code.
+ *
+ * A product of complex numbers x*y is computed from the two vectors
+ *    x*re(y) = (xr yr, xi yr)   and   x*im(y) = (xr yi, xi yi) ,
+ * since fmaddsub(x*re(y), 1, swap(x*im(y))) = (xr yr - xi yi, xi yr + xr yi).
+ * Sums of products are accumulated in the two vectors separately, and only
+ * combined at the end.
+ *
+ * ***********************************************************************/
+
+namespace {
+
+// Loads cnt complex numbers, using a full register if possible
+template<class V>
+inline typename V::T loadPart(const double* p, int cnt) {
+  return (cnt == V::W ? V::load(p) : V::load(p, cnt));
+}
+
+/*
+ * Computes an (R*W x C) block of
+ *    C = A B + beta C ,
+ * where the element (i,l) of A is at a[i + l*lda], (l,j) of B at
+ * b[l*incb + j*jumpb] and (i,j) of C at c[i + j*ldc]. Only the first
+ * rows rows of the block are computed. If Partial is false, these are all
+ * R*W rows, otherwise more than (R-1)*W of them. Partial is a template
+ * parameter, since a branch on the rows in the loop keeps the compiler from
+ * holding the sums in registers.
+ */
+template<class V, int R, int C, bool Partial>
+void gemmBlock(int rows, long long k, const double* a, long long lda,
+               const double* b, long long incb, long long jumpb,
+               const double* beta, double* c, long long ldc) {
+
+  typedef typename V::T T;
+  const int W = V::W;
+
+  int cnt[R];
+  for (int r = 0; r < R; ++r)
+    cnt[r] = (Partial && r == R-1 ? rows - r*W : W);
+
+  T re[R][C], im[R][C];
+  for (int r = 0; r < R; ++r) {
+    for (int j = 0; j < C; ++j)
+      re[r][j] = im[r][j] = V::zero();
+  }
+
+  for (long long l = 0; l < k; ++l) {
+    T x[R];
+    for (int r = 0; r < R; ++r) {
+      if (Partial && r == R-1)
+        x[r] = V::load(a + 2*(l*lda + r*W), cnt[r]);
+      else
+        x[r] = V::load(a + 2*(l*lda + r*W));
+    }
+    for (int j = 0; j < C; ++j) {
+      const double* y = b + 2*(l*incb + j*jumpb);
+      T yr = V::set(y[0]);
+      T yi = V::set(y[1]);
+      for (int r = 0; r < R; ++r) {
+        re[r][j] = V::fmadd(x[r], yr, re[r][j]);
+        im[r][j] = V::fmadd(x[r], yi, im[r][j]);
+      }
+    }
+  }
+
+  // Combine the sums and add beta C
+  bool scale = (beta[0] != 0.0 || beta[1] != 0.0);
+  T one = V::set(1.0);
+  T br = V::set(beta[0]);
+  T bi = V::set(beta[1]);
+  for (int j = 0; j < C; ++j) {
+    for (int r = 0; r < R; ++r) {
+      T p = V::fmaddsub(re[r][j], one, V::swap(im[r][j]));
+      double* out = c + 2*(r*W + j*ldc);
+      if (scale) {
+        T x = loadPart<V>(out, cnt[r]);
+        p = V::add(p, V::fmaddsub(x, br, V::mul(V::swap(x), bi)));
+      }
+      if (cnt[r] == W)
+        V::store(out, p);
+      else
+        V::store(out, p, cnt[r]);
+    }
+  }
+}
+
+/*
+ * Computes a block of C columns and up to R*W rows of C with gemmBlock,
+ * using as few registers as possible. R must be 1 or 2.
+ */
+template<class V, int C>
+void gemmBlocks(int rows, long long k, const double* a, long long lda,
+                const double* b, long long incb, long long jumpb,
+                const double* beta, double* c, long long ldc) {
+  const int W = V::W;
+  const int R = V::R;
+  bool partial = (rows % W != 0);
+  if (rows > (R-1)*W) {
+    if (partial)
+      gemmBlock<V,R,C,true>(rows, k, a, lda, b, incb, jumpb, beta, c, ldc);
+    else
+      gemmBlock<V,R,C,false>(rows, k, a, lda, b, incb, jumpb, beta, c, ldc);
+  }
+  else {
+    if (partial)
+      gemmBlock<V,1,C,true>(rows, k, a, lda, b, incb, jumpb, beta, c, ldc);
+    else
+      gemmBlock<V,1,C,false>(rows, k, a, lda, b, incb, jumpb, beta, c, ldc);
+  }
+}
+
+/*
+ * Computes the (m x n) matrix
+ *    C = A B + beta C ,
+ * where the element (i,l) of A is at a[i*inca + l*jumpa] and (l,j) of B at
+ * b[l*incb + j*jumpb], which covers all transpositions. Blocks of R*W rows
+ * of A are first copied (packed) into a buffer on the stack, in pieces of
+ * at most KC columns, such that gemmBlock reads them contiguously whatever
+ * the layout of A, and they are then multiplied with all columns of B.
+ */
+template<class V>
+void gemmPacked(long long m, long long n, long long k, const double* a,
+                long long inca, long long jumpa, const double* b,
+                long long incb, long long jumpb, const double* beta,
+                double* c, long long ldc) {
+
+  const int MR = V::R*V::W;
+  const int C = V::C;
+  const int KC = 256;
+  double buf[2*MR*KC];
+  const double one[2] = {1.0, 0.0};
+
+  for (long long i = 0; i < m; i += MR) {
+    int rows = (m - i < MR ? m - i : MR);
+    // The first piece adds beta C, the others add to C
+    for (long long l = 0; l < k || l == 0; l += KC) {
+      int kc = (k - l < KC ? k - l : KC);
+      // Copied one complex number at a time: a vectorised copy is slower,
+      // since gemmBlock then reads the buffer right after the stores
+      const double* al = a + 2*(i*inca + l*jumpa);
+      for (int r = 0; r < rows; ++r) {
+        for (int q = 0; q < kc; ++q) {
+          buf[2*(r + q*MR)] = al[2*(r*inca + q*jumpa)];
+          buf[2*(r + q*MR) + 1] = al[2*(r*inca + q*jumpa) + 1];
+        }
+      }
+
+      const double* scale = (l == 0 ? beta : one);
+      const double* bl = b + 2*l*incb;
+      double* ci = c + 2*i;
+      long long j = 0;
+      for (; j + C <= n; j += C)
+        gemmBlocks<V,C>(rows, kc, buf, MR, bl + 2*j*jumpb, incb, jumpb,
+                        scale, ci + 2*j*ldc, ldc);
+      for (; j < n; ++j)
+        gemmBlocks<V,1>(rows, kc, buf, MR, bl + 2*j*jumpb, incb, jumpb,
+                        scale, ci + 2*j*ldc, ldc);
+    }
+  }
+}
+
+/*
+ * The gemm microkernel (see SIMD.H). Transposed operands are read with
+ * swapped strides.
+ */
+template<class V>
+void gemmKernel(bool transa, bool transb, long long m, long long n,
+                long long k, const double* a, long long lda, const double* b,
+                long long ldb, const double* beta, double* c, long long ldc) {
+  gemmPacked<V>(m, n, k, a, transa ? lda : 1, transa ? 1 : lda, b,
+                transb ? ldb : 1, transb ? 1 : ldb, beta, c, ldc);
+}
+
+/*
+ * Computes an (R*2W x C) block of the real matrix product
+ *    C = alpha A B + beta C ,
+ * where A is packed: the element (i,l) is at a[i + l*R*2W], for all R*2W
+ * rows. (l,j) of B is at b[l*incb + j*jumpb] and (i,j) of C at
+ * c[i + j*ldc], and only the first rows rows of C are written.
+ */
+template<class V, int R, int C>
+void gemmRealBlock(int rows, long long k, const double* a, const double* b,
+                   long long incb, long long jumpb, double alpha,
+                   double beta, double* c, long long ldc) {
+
+  typedef typename V::T T;
+  const int D = 2*V::W;
+
+  T acc[R][C];
+  for (int r = 0; r < R; ++r) {
+    for (int j = 0; j < C; ++j)
+      acc[r][j] = V::zero();
+  }
+
+  for (long long l = 0; l < k; ++l) {
+    T x[R];
+    for (int r = 0; r < R; ++r)
+      x[r] = V::load(a + l*R*D + r*D);
+    for (int j = 0; j < C; ++j) {
+      T y = V::set(b[l*incb + j*jumpb]);
+      for (int r = 0; r < R; ++r)
+        acc[r][j] = V::fmadd(x[r], y, acc[r][j]);
+    }
+  }
+
+  T va = V::set(alpha);
+  T vb = V::set(beta);
+  for (int j = 0; j < C; ++j) {
+    for (int r = 0; r < R && r*D < rows; ++r) {
+      T p = V::mul(acc[r][j], va);
+      double* out = c + r*D + j*ldc;
+      if (rows >= (r+1)*D) {
+        if (beta != 0.0)
+          p = V::fmadd(V::load(out), vb, p);
+        V::store(out, p);
+      }
+      else {
+        double tmp[D];
+        V::store(tmp, p);
+        for (int q = 0; q < rows - r*D; ++q)
+          out[q] = (beta != 0.0 ? tmp[q] + beta*out[q] : tmp[q]);
+      }
+    }
+  }
+}
+
+/*
+ * The real gemm microkernel (see SIMD.H). As in gemmPacked, blocks of rows
+ * of op(A) are packed on the stack, padded with zeros to a whole number of
+ * registers. A real number takes half the space of a complex one, so twice
+ * as many columns of C are kept in registers.
+ */
+template<class V>
+void gemmRealKernel(bool transa, bool transb, long long m, long long n,
+                    long long k, double alpha, const double* a,
+                    long long lda, const double* b, long long ldb,
+                    double beta, double* c, long long ldc) {
+
+  const int MR = V::R*2*V::W;
+  const int C = 2*V::C;
+  const int KC = 256;
+  double buf[MR*KC];
+  long long inca = (transa ? lda : 1);
+  long long jumpa = (transa ? 1 : lda);
+  long long incb = (transb ? ldb : 1);
+  long long jumpb = (transb ? 1 : ldb);
+
+  for (long long i = 0; i < m; i += MR) {
+    int rows = (m - i < MR ? m - i : MR);
+    for (long long l = 0; l < k || l == 0; l += KC) {
+      int kc = (k - l < KC ? k - l : KC);
+      const double* al = a + i*inca + l*jumpa;
+      for (int q = 0; q < kc; ++q) {
+        for (int r = 0; r < MR; ++r)
+          buf[r + q*MR] = (r < rows ? al[r*inca + q*jumpa] : 0.0);
+      }
+
+      double scale = (l == 0 ? beta : 1.0);
+      const double* bl = b + l*incb;
+      double* ci = c + i;
+      long long j = 0;
+      for (; j + C <= n; j += C)
+        gemmRealBlock<V,V::R,C>(rows, kc, buf, bl + j*jumpb, incb, jumpb,
+                                alpha, scale, ci + j*ldc, ldc);
+      for (; j < n; ++j)
+        gemmRealBlock<V,V::R,1>(rows, kc, buf, bl + j*jumpb, incb, jumpb,
+                                alpha, scale, ci + j*ldc, ldc);
+    }
+  }
+}
+
+/*
+ * The dot microkernel (see SIMD.H). The real and imaginary parts of the
+ * result are stored in res.
+ */
+template<class V>
+void dotKernel(long long n, const double* x, const double* y, long long incy,
+               double* res) {
+
+  typedef typename V::T T;
+  const int W = V::W;
+
+  // Two sets of sums, to keep more multiplications in flight
+  T re0 = V::zero(), im0 = V::zero(), re1 = V::zero(), im1 = V::zero();
+  long long i = 0;
+  if (incy == 1) {
+    for (; i + 2*W <= n; i += 2*W) {
+      T x0 = V::load(x + 2*i), x1 = V::load(x + 2*(i + W));
+      T y0 = V::load(y + 2*i), y1 = V::load(y + 2*(i + W));
+      re0 = V::fmadd(x0, y0, re0);
+      im0 = V::fmadd(x0, V::swap(y0), im0);
+      re1 = V::fmadd(x1, y1, re1);
+      im1 = V::fmadd(x1, V::swap(y1), im1);
+    }
+    for (; i < n; i += W) {
+      int cnt = (n - i < W ? n - i : W);
+      T x0 = loadPart<V>(x + 2*i, cnt);
+      T y0 = loadPart<V>(y + 2*i, cnt);
+      re0 = V::fmadd(x0, y0, re0);
+      im0 = V::fmadd(x0, V::swap(y0), im0);
+    }
+  }
+  else {
+    for (; i + 2*W <= n; i += 2*W) {
+      T x0 = V::load(x + 2*i), x1 = V::load(x + 2*(i + W));
+      T y0 = V::gather(y + 2*i*incy, incy, W);
+      T y1 = V::gather(y + 2*(i + W)*incy, incy, W);
+      re0 = V::fmadd(x0, y0, re0);
+      im0 = V::fmadd(x0, V::swap(y0), im0);
+      re1 = V::fmadd(x1, y1, re1);
+      im1 = V::fmadd(x1, V::swap(y1), im1);
+    }
+    for (; i < n; i += W) {
+      int cnt = (n - i < W ? n - i : W);
+      T x0 = loadPart<V>(x + 2*i, cnt);
+      T y0 = V::gather(y + 2*i*incy, incy, cnt);
+      re0 = V::fmadd(x0, y0, re0);
+      im0 = V::fmadd(x0, V::swap(y0), im0);
+    }
+  }
+
+  double r[2*W], m[2*W];
+  V::store(r, V::add(re0, re1));
+  V::store(m, V::add(im0, im1));
+  res[0] = res[1] = 0.0;
+  for (int w = 0; w < W; ++w) {
+    res[0] += r[2*w] - r[2*w+1];
+    res[1] += m[2*w] + m[2*w+1];
+  }
+}
+
+}
+
+}
+
+#endif //PICHI_SIMD_KERNELS_H
@@ -2,6 +2,7 @@
 #define PICHI_SLICE_ITERATOR_H
 
 #include <vector>
+#include <string>
 #include "pichi/tensor.h"
 
 namespace pichi {
@@ -11,9 +12,9 @@ namespace pichi {
  * This file declares a way to iterate through slices of a tensor when doing
  * contractions.
  *
- * Depending on the type of contractions, there are 1, 2 or 3 slices we need
- * to keep track of. There can be 1 or 2 input tensors and there may or may
- * not be an output tensor. On the input slices there are 4 types of indices:
+ * Depending on the type of contractions, there are 2 or 3 slices we need
+ * to keep track of. There are 2 input tensors and there may or may not be
+ * an output tensor. On the input slices there are 4 types of indices:
  *
  *   - Sliced and contracted indices on input tensors (SC)
  *   - Non-sliced and contracted indices on input tensors (NC)
@@ -35,8 +36,7 @@ namespace pichi {
  *    (S,F,F,S)
  * where the two S-indices correspond to the SF indices on the input tensors
  * and the F indices correspond to the NF indices.
- * The structure is similar for contractions involving only one input tensor
- * and for contractions without any output tensor.
+ * The structure is similar for contractions without any output tensor.
  *
  * The sliced indices are recognised by being negative numbers. In the
  * example above, the actual initial slices would look like this
@@ -66,10 +66,20 @@ namespace pichi {
  *
  *  Whenever there is a choice as to which index to assign which role, we
  *  always try to make the optimal choice based on the storage in the tensors.
- *  If possible we slice on the leading dimensions of the tensors to be able
- *  to quickly grab the data in one go. When this is not possible, a
- *  sub-optimal choice will have to be made.
- *  For now this optimisation is only present in the DoubleSliceItarator
+ *  The DoubleSliceIterator estimates the cost of reading the slices from the
+ *  strides of their indices, and picks the cheapest SC and SF indices. If
+ *  possible we slice on the leading dimensions of the tensors to be able to
+ *  quickly grab the data in one go. The NC and NF loops are nested such
+ *  that the index with the shortest strides runs fastest.
+ *  For now this optimisation is only present in the DoubleSliceIterator
+ *
+ *  In the inner loops of the contractions, the slice vectors are not needed.
+ *  Once the layout of the data arrays is set (setLayout), the iterators also
+ *  keep track of the offset of the current slices in the data arrays, and
+ *  give the strides of the two running indices of each slice. The offsets
+ *  are advanced together with the indices, so the slices can be read and
+ *  written directly (see gather and scatter in KERNELS.H) without copying
+ *  the slice vectors or checking them.
  *
  * ***********************************************************************/
 
@@ -97,6 +107,15 @@ public:
   DoubleSliceIterator(const Tensor& t1, const Tensor& t2,
                       const std::vector<std::pair<int,int>>& contractions);
 
+  /*
+   * Initiates an iterator from the layout of the two tensors only: their
+   * size and their storage vectors (which also give their ranks). This
+   * allows iterators to be set up before the tensors exist.
+   */
+  DoubleSliceIterator(int size, const std::vector<int>& store1,
+                      const std::vector<int>& store2,
+                      const std::vector<std::pair<int,int>>& contractions);
+
   /*
    * Gets the current slices
    */
@@ -104,6 +123,27 @@ public:
   std::vector<int> getSlice2() const;
   std::vector<int> getSliceOut() const;
 
+  /*
+   * Sets the layout of the data arrays of the two input tensors and the
+   * output tensor, given by their storage vectors. The layout of the output
+   * is ignored if there is no output tensor.
+   */
+  void setLayout(const std::vector<int>& store1,
+                 const std::vector<int>& store2,
+                 const std::vector<int>& store_out);
+
+  /*
+   * Gets the offset of the current slices in the data arrays, and the
+   * strides of the first and second running index of the slices (in the
+   * order they appear in the slice). Only valid after setLayout.
+   */
+  long long getOffset1() const { return os1; };
+  long long getOffset2() const { return os2; };
+  long long getOffsetOut() const { return os_out; };
+  std::pair<long long,long long> getStrides1() const { return run1; };
+  std::pair<long long,long long> getStrides2() const { return run2; };
+  std::pair<long long,long long> getStridesOut() const { return run_out; };
+
   /*
    * Advances the non-sliced contracted indices (NC) on the two input tensors.
    * Returns false if this returns the NC indices to their initial state.
@@ -125,96 +165,81 @@ public:
    */
   bool nextNonSlicedFree();
 
-private:
-
-  // Size of the tensors
-  int size;
-
-  // List of SF indices on input# tensors
-  std::vector<int> sf1;
-  std::vector<int> sf2;
-
-  // List of NF indices on {input#, output} tensors
-  std::vector<std::pair<int,int>> nf1;
-  std::vector<std::pair<int,int>> nf2;
-
-  // List of NC indices on the {input1,input2} tensors
-  std::vector<std::pair<int,int>> nc;
-
-  // Current state of the slices
-  std::vector<int> slice1;
-  std::vector<int> slice2;
-  std::vector<int> slice_out;
-
-};
-
-
-
-class SingleSliceIterator {
-
-public:
-
   /*
-   * Initiates an iterator for one tensor of a given rank and size as well
-   * as a list of contracted indices.
-   * The contractions is a list of pairs of integers. Each pair corresponds
-   * to a contraction of indices. For example, the contraction
-   *
-   *    A_aabbcd
-   *
-   * Would look like
-   *    {{0,1},{2,3}}
+   * Gets the number of combinations of the NF indices, i.e. the number of
+   * times nextNonSlicedFree can be called before the NF indices return to
+   * their initial state.
    */
-  SingleSliceIterator(const Tensor&,
-                      const std::vector<std::pair<int,int>>& contractions);
+  long long countNonSlicedFree() const;
 
   /*
-   * Gets the current slices
+   * Sets the NF indices to the k'th combination, counted in the order in
+   * which nextNonSlicedFree runs through them. The other indices are not
+   * changed. This allows the NF combinations to be split between several
+   * copies of the iterator.
    */
-  std::vector<int> getSlice1() const;
-  std::vector<int> getSliceOut() const;
+  void setNonSlicedFree(long long k);
 
   /*
-   * Advances the non-sliced contracted indices (NC) on the input tensor.
-   * Returns false if this returns the NC indices to their initial state.
-   * Otherwise returns true.
+   * Gets the input tensor (1 or 2) whose NF indices run fastest in
+   * nextNonSlicedFree, or 0 if there are no NF indices. While these run, the
+   * slice of the other input tensor does not change.
    */
-  bool nextContracted();
+  int fastestNonSlicedFree() const;
 
   /*
-   * Advances the free indices which are sliced on the output tensor (SF).
-   * Returns false if this returns the SF indices to their initial state.
-   * Otherwise returns true.
+   * Gives a description of the roles of the indices, for inspection. The SC
+   * and NC indices are given as pairs of indices on the two tensors, the SF
+   * and NF indices as tensor:index. The NC and NF indices are listed from
+   * the one running fastest to the one running slowest. Example:
+   *    SC (5,1) (6,0) | NC (3,3) (4,2) | SF 1:0 1:1 | NF 1:2 2:4 2:5 2:6
    */
-  bool nextSlicedFree();
-
-  /*
-   * Advances the free indices which are not sliced on the output tensor (NF).
-   * Returns false if this returns the NF indices to their initial state.
-   * Otherwise returns true.
-   */
-  bool nextNonSlicedFree();
+  std::string toString() const;
 
 private:
 
   // Size of the tensors
   int size;
 
-  // List of SF indices on the input tensor
-  std::vector<int> sf;
+  // List of SF indices on input# tensors
+  std::vector<int> sf1;
+  std::vector<int> sf2;
 
-  // List of NF indices on {input, output} tensors
-  std::vector<std::pair<int,int>> nf;
+  // List of NF indices on {input#, output} tensors
+  std::vector<std::pair<int,int>> nf1;
+  std::vector<std::pair<int,int>> nf2;
 
-  // List of NC indices on the input tensor
+  // List of NC indices on the {input1,input2} tensors
   std::vector<std::pair<int,int>> nc;
 
   // Current state of the slices
   std::vector<int> slice1;
+  std::vector<int> slice2;
   std::vector<int> slice_out;
 
+  // Strides of the indices which are not running on the slices (zero for
+  // running indices, or if no layout is set), offsets of the slices, and
+  // strides of the running indices
+  std::vector<long long> stride1;
+  std::vector<long long> stride2;
+  std::vector<long long> stride_out;
+  long long os1, os2, os_out;
+  std::pair<long long,long long> run1, run2, run_out;
+
 };
 
+/*
+ * Gets the strides of the indices of a slice in a data array with a given
+ * size and storage. The strides of the running indices (negative entries in
+ * the slice) are set to zero, and are instead returned in run, in the order
+ * they appear in the slice. The offset of the slice in the data array is
+ * written to offset.
+ */
+std::vector<long long> sliceStrides(int size, const std::vector<int>& store,
+                                    const std::vector<int>& slice,
+                                    std::pair<long long,long long>& run,
+                                    long long& offset);
+
 }
 
 #endif //PICHI_SLICE_ITERATOR_H
@@ -0,0 +1,327 @@
+/* ****************************************************************************
+ *
+ * Implementation of the strided contraction engine defined in ENGINES.H
+ *
+ * ***************************************************************************/
+
+#include "engines.h"
+#include "buffer.h"
+#include "gemm.h"
+#include "kernels.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+namespace pichi {
+
+/*
+ * The matrix product C = A B is done in blocks, as in BLIS: a panel of
+ * (block_inner x block_cols) of B is packed and multiplied by the blocks of
+ * (block_rows x block_inner) of A, which are packed in turn. The blocks of
+ * A are split between the threads, each writing its own rows of C.
+ */
+static const long long block_rows = 256;
+static const long long block_inner = 256;
+static const long long block_cols = 1024;
+
+void prepareStrided(ContractionSetup& setup) {
+
+  int rank1 = setup.store1.size();
+  int rank2 = setup.store2.size();
+
+  // Find the free indices on both tensors, and their index on the output
+  vector<int> out1(rank1, 0);
+  vector<int> out2(rank2, 0);
+  for (pair<int,int> p : setup.idx) {
+    out1[p.first] = -1;
+    out2[p.second] = -1;
+  }
+  int count = 0;
+  for (int i = 0; i < rank1; ++i) {
+    if (out1[i] == 0)
+      out1[i] = count++;
+  }
+  for (int i = 0; i < rank2; ++i) {
+    if (out2[i] == 0)
+      out2[i] = count++;
+  }
+
+  // The inputs keep their storage. The output is stored with the free
+  // indices of tensor 1 first, followed by those of tensor 2, each in the
+  // order in which they are stored on the input. The rows and columns of
+  // the matrix product then run along the input tensors as far as possible.
+  setup.store_out.clear();
+  for (int i : setup.store1) {
+    if (out1[i] >= 0)
+      setup.store_out.push_back(out1[i]);
+  }
+  for (int i : setup.store2) {
+    if (out2[i] >= 0)
+      setup.store_out.push_back(out2[i]);
+  }
+}
+
+// Gets the offsets in a data array of all the combinations of the indices
+// with the strides inc, with the first index running fastest.
+static vector<long long> offsets(int size, const vector<long long>& inc) {
+  vector<long long> res(1, 0);
+  for (long long s : inc) {
+    long long count = res.size();
+    res.resize(count*size);
+    for (int j = 1; j < size; ++j) {
+      for (long long i = 0; i < count; ++i)
+        res[i + j*count] = res[i] + j*s;
+    }
+  }
+  return res;
+}
+
+// Gets the stride of the index which the indices with the strides inc fuse
+// into, or 0 if they are not evenly spaced in the data array.
+static long long fusedStride(int size, const vector<long long>& inc) {
+  if (inc.empty())
+    return 1;
+  for (int i = 1; i < inc.size(); ++i) {
+    if (inc[i] != size*inc[i-1])
+      return 0;
+  }
+  return inc[0];
+}
+
+// Gets the length of the runs of consecutive elements in the data array,
+// when the indices with the strides inc are fused
+static long long runLength(int size, const vector<long long>& inc) {
+  long long run = 1;
+  for (int i = 0; i < inc.size() && inc[i] == run; ++i)
+    run *= size;
+  return run;
+}
+
+/*
+ * An operand of the matrix product. Its rows and columns are the indices
+ * with the strides inc_row and inc_col fused, with the first running
+ * fastest. An operand which is a column major matrix in the data array, or
+ * the transpose of one, is used in place (direct) with leading dimension
+ * ld. Otherwise the element (i,j) is found at data[row[i] + col[j]], and
+ * the blocks are packed, transposed (trans) if the elements of a row are
+ * closer together in memory than those of a column. The offsets along the
+ * packed dimension then come in runs of consecutive elements.
+ */
+struct Operand {
+
+  Operand(const cdouble* data, int size, const vector<long long>& inc_row,
+          const vector<long long>& inc_col) : data(data), direct(true) {
+
+    rows = 1;
+    for (int i = 0; i < inc_row.size(); ++i)
+      rows *= size;
+    cols = 1;
+    for (int i = 0; i < inc_col.size(); ++i)
+      cols *= size;
+
+    long long s1 = fusedStride(size, inc_row);
+    long long s2 = fusedStride(size, inc_col);
+    if (s1 == 1 && s2 != 0) {
+      trans = false;
+      ld = (cols > 1 ? s2 : rows);
+    } else if (s2 == 1 && s1 != 0) {
+      trans = true;
+      ld = (rows > 1 ? s1 : cols);
+    } else {
+      direct = false;
+      row = offsets(size, inc_row);
+      col = offsets(size, inc_col);
+      long long step1 = (rows > 1 ? row[1] : LLONG_MAX);
+      long long step2 = (cols > 1 ? col[1] : LLONG_MAX);
+      trans = (step2 < step1);
+      run = (trans ? runLength(size, inc_col) : runLength(size, inc_row));
+    }
+  }
+
+  const cdouble* data;
+  long long rows;
+  long long cols;
+  bool direct;
+  bool trans;
+  long long ld;
+  long long run;
+  vector<long long> row;
+  vector<long long> col;
+
+};
+
+// Copies the elements at in[off[i]] for i in [0,n) to out. The offsets
+// starting at i0 % run follow each other in runs of length run.
+static void packLine(long long n, long long i0, long long run,
+                     const cdouble* in, const long long* off, cdouble* out) {
+  long long i = 0;
+  while (i < n) {
+    long long len = min(run - (i0 + i) % run, n - i);
+    const cdouble* x = in + off[i];
+    copy(x, x + len, out + i);
+    i += len;
+  }
+}
+
+// Gets the (m x k) block of an operand at (i0,j0) in the form in which it is
+// passed to gemm, with the transposition flag of the operand and leading
+// dimension ld. The block is packed into buffer unless the operand is used
+// in place.
+static const cdouble* getBlock(const Operand& op, long long i0, long long j0,
+                               long long m, long long k, cdouble* buffer,
+                               long long& ld) {
+
+  if (op.direct) {
+    ld = op.ld;
+    return op.data + (op.trans ? i0*op.ld + j0 : i0 + j0*op.ld);
+  }
+
+  // The inner loop runs along the rows, or along the columns if the block
+  // is packed transposed
+  const long long* row = op.row.data() + i0;
+  const long long* col = op.col.data() + j0;
+  if (!op.trans) {
+    for (long long j = 0; j < k; ++j)
+      packLine(m, i0, op.run, op.data + col[j], row, buffer + j*m);
+    ld = m;
+  } else {
+    for (long long i = 0; i < m; ++i)
+      packLine(k, j0, op.run, op.data + row[i], col, buffer + i*k);
+    ld = k;
+  }
+  return buffer;
+}
+
+// Gets the data array of a tensor as it is laid out, in the interleaved
+// format. The planes of a planar tensor are interleaved into a buffer taken
+// from the workspace, which is kept in buffer, so the tensor is left as it
+// is.
+static const cdouble* interleaved(const Tensor& t, vector<int>& layout,
+                                  ContractionWorkspace* workspace,
+                                  unique_ptr<WorkspaceBuffer>& buffer) {
+  if (!t.isPlanar())
+    return t.getData(layout);
+  long long total = 1;
+  for (int i = 0; i < t.getRank(); ++i)
+    total *= t.getSize();
+  const double* planes = t.getPlanarData(layout);
+  buffer.reset(new WorkspaceBuffer(workspace, total));
+  interleave(total, planes, planes + total, buffer->data());
+  return buffer->data();
+}
+
+void contractStrided(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                     Tensor& out, ContractionWorkspace* workspace) {
+
+  int size = setup.size;
+  int rank1 = setup.store1.size();
+  int rank2 = setup.store2.size();
+
+  // The data arrays are read as they are laid out, so neither the storage
+  // nor the format of the inputs is touched
+  vector<int> layout1, layout2;
+  unique_ptr<WorkspaceBuffer> buffer1, buffer2;
+  const cdouble* a1 = interleaved(t1, layout1, workspace, buffer1);
+  const cdouble* a2 = interleaved(t2, layout2, workspace, buffer2);
+  vector<long long> inc1 = strides(t1);
+  vector<long long> inc2 = strides(t2);
+
+  // The free indices of each tensor, in the order of the output indices
+  vector<bool> contracted1(rank1, false);
+  vector<bool> contracted2(rank2, false);
+  for (pair<int,int> p : setup.idx) {
+    contracted1[p.first] = true;
+    contracted2[p.second] = true;
+  }
+  vector<int> free1, free2;
+  for (int i = 0; i < rank1; ++i) {
+    if (!contracted1[i])
+      free1.push_back(i);
+  }
+  for (int i = 0; i < rank2; ++i) {
+    if (!contracted2[i])
+      free2.push_back(i);
+  }
+
+  // The rows of the product are the free indices of tensor 1, and the
+  // columns those of tensor 2, in the order of the output storage
+  int nf1 = free1.size();
+  vector<long long> rows1, cols2;
+  for (int o : setup.store_out) {
+    if (o < nf1)
+      rows1.push_back(inc1[free1[o]]);
+    else
+      cols2.push_back(inc2[free2[o - nf1]]);
+  }
+
+  // The contracted indices are fused in the order of their strides on
+  // tensor 1 if its leading dimension is contracted, and in the order of
+  // their strides on tensor 2 otherwise
+  vector<pair<int,int>> idx = setup.idx;
+  bool by1 = contracted1[layout1[0]];
+  sort(idx.begin(), idx.end(), [&](pair<int,int> x, pair<int,int> y) {
+    return (by1 ? inc1[x.first] < inc1[y.first]
+                : inc2[x.second] < inc2[y.second]);
+  });
+  vector<long long> inner1, inner2;
+  for (pair<int,int> p : idx) {
+    inner1.push_back(inc1[p.first]);
+    inner2.push_back(inc2[p.second]);
+  }
+
+  Operand a(a1, size, rows1, inner1);
+  Operand b(a2, size, inner2, cols2);
+  long long rows = a.rows;
+  long long inner = a.cols;
+  long long cols = b.cols;
+
+  // The product overwrites every element of the output
+  out.resize(setup.rank, size, setup.store_out, false);
+  cdouble* c = out.getData();
+
+  // Two operands which are matrices in memory are multiplied in one go
+  if (a.direct && b.direct) {
+    gemm(a.trans, b.trans, rows, cols, inner, a.data, a.ld, b.data, b.ld, 0.0,
+         c, rows);
+    return;
+  }
+
+  unique_ptr<WorkspaceBuffer> panel;
+  if (!b.direct)
+    panel.reset(new WorkspaceBuffer(workspace, min(block_inner, inner) *
+                                               min(block_cols, cols)));
+  long long nblocks = (rows + block_rows - 1) / block_rows;
+
+  for (long long jc = 0; jc < cols; jc += block_cols) {
+    long long n = min(block_cols, cols - jc);
+    for (long long pc = 0; pc < inner; pc += block_inner) {
+      long long k = min(block_inner, inner - pc);
+      cdouble beta = (pc == 0 ? 0.0 : 1.0);
+
+      long long ldb;
+      const cdouble* pb = getBlock(b, pc, jc, k, n,
+                                   (panel ? panel->data() : nullptr), ldb);
+
+      parallelFor(nblocks, [&](long long begin, long long end) {
+        unique_ptr<WorkspaceBuffer> buffer;
+        if (!a.direct)
+          buffer.reset(new WorkspaceBuffer(workspace,
+                                           min(block_rows, rows) * k));
+        for (long long blk = begin; blk < end; ++blk) {
+          long long ic = blk*block_rows;
+          long long m = min(block_rows, rows - ic);
+          long long lda;
+          const cdouble* pa = getBlock(a, ic, pc, m, k,
+                                       (buffer ? buffer->data() : nullptr),
+                                       lda);
+          gemm(a.trans, b.trans, m, n, k, pa, lda, pb, ldb, beta,
+               c + ic + jc*rows, rows);
+        }
+      });
+    }
+  }
+}
+
+}
@@ -6,14 +6,17 @@
  * ***************************************************************************/
 
 #include <iostream>
+#include <algorithm>
 #include <unordered_set>
 #include "pichi/tensor.h"
+#include "pichi/allocator.h"
+#include "kernels.h"
 
 using namespace std;
 
 namespace pichi {
 
-void Tensor::init(int rank, int size) {
+void Tensor::init(int rank, int size, bool clear) {
 
   if (rank == 1) {
     throw invalid_argument("Error in Tensor initialisation: Rank 1 tensors are "
@@ -26,6 +29,7 @@ void Tensor::init(int rank, int size) {
 
   dim = rank;
   n = size;
+  planar = false;
 
   // Get the total number of components of the tensor ( size^rank )
   total_size = 1;
@@ -33,27 +37,45 @@ void Tensor::init(int rank, int size) {
     total_size *= size;
 
   // Allocate the data for the tensor and initialise everything to 0.
-  data = new cdouble[total_size];
-  for (int i = 0; i < total_size; ++i)
-    data[i] = 0.0;
+  allocate(total_size);
+  if (clear) {
+    for (long long i = 0; i < total_size; ++i)
+      data[i] = 0.0;
+  }
+}
+
+void Tensor::allocate(long long n) {
+  if (n == 1)
+    data = &scalar;
+  else
+    data = allocator->allocate(n);
+  capacity = n;
+}
+
+void Tensor::release() {
+  if (data != &scalar)
+    allocator->deallocate(data, capacity);
+  data = nullptr;
+  capacity = 0;
 }
 
 /*
  * Default constructor implementation
  * Creates a scalar with value 0.
  */
-Tensor::Tensor() {
+Tensor::Tensor() : allocator(getAllocator()) {
 
   init(0,1);
 
   storage = {};
+  layout = {};
 
 }
 
 /*
  * Create a tensor with a given rank and size and initialise everything to 0
  */
-Tensor::Tensor(int rank, int size) {
+Tensor::Tensor(int rank, int size) : allocator(getAllocator()) {
 
   init(rank,size);
 
@@ -61,10 +83,12 @@ Tensor::Tensor(int rank, int size) {
   storage = vector<int>(rank);
   for (int i = 0; i < rank; ++i)
     storage[i] = i;
+  layout = storage;
 
 }
 
-Tensor::Tensor(int rank, int size, const std::vector<int>& store) {
+Tensor::Tensor(int rank, int size, const std::vector<int>& store) :
+    allocator(getAllocator()) {
 
   init(rank,size);
 
@@ -82,21 +106,35 @@ Tensor::Tensor(int rank, int size, const std::vector<int>& store) {
                              "contains a repeated index");
   }
   storage = store;
+  layout = store;
+}
+
+Tensor::Tensor(TensorAllocator* a) :
+    allocator(a ? a : getAllocator()) {
+
+  init(0,1);
+
+  storage = {};
+  layout = {};
+
 }
 
 /*
  * Copy constructor
- * Makes a deep copy of the input tensor.
+ * Makes a deep copy of the input tensor, with the current allocator.
  */
 Tensor::Tensor(const Tensor& other) :
-    dim(other.dim), n(other.n), total_size(other.total_size) {
+    dim(other.dim), n(other.n), total_size(other.total_size),
+    planar(other.planar), allocator(getAllocator()) {
 
-  // Allocate the space for the data and copy the numbers from the input tensor.
-  data = new cdouble[total_size];
+  // Allocate the space for the data and copy the numbers from the input
+  // tensor, in the same format.
+  allocate(total_size);
   std::copy(other.data, other.data + total_size, data);
 
-  // Copy storage information
+  // Copy storage information. The data keeps its layout.
   storage = other.storage;
+  layout = other.layout;
 
 }
 
@@ -104,19 +142,26 @@ Tensor::Tensor(const Tensor& other) :
  * Move constructor.
  * Moves the data from the input tensor to this one.
  */
-Tensor::Tensor(Tensor&& other) noexcept {
+Tensor::Tensor(Tensor&& other) noexcept : allocator(other.allocator) {
   // Get the dimensions from the input.
   dim = other.dim;
   n = other.n;
   total_size = other.total_size;
-  // Simply grab the data pointer.
-  data = other.data;
-
-  // Copy storage data
-  storage = other.storage;
-
-  // Re-initialise the input tensor as a default scalar
+  // Simply grab the data pointer. A scalar is copied instead.
+  scalar = other.scalar;
+  data = (other.data == &other.scalar ? &scalar : other.data);
+  capacity = other.capacity;
+  planar = other.planar;
+
+  // Move storage data
+  storage = move(other.storage);
+  layout = move(other.layout);
+
+  // Re-initialise the input tensor as a default scalar, which does not
+  // allocate
   other.init(0,1);
+  other.storage.clear();
+  other.layout.clear();
 }
 
 /*
@@ -134,15 +179,23 @@ Tensor& Tensor::operator=(Tensor&& other) noexcept {
   n = other.n;
   total_size = other.total_size;
 
-  // Copy storage data
-  storage = other.storage;
+  // Move storage data
+  storage = move(other.storage);
+  layout = move(other.layout);
 
-  // Delete our data and grab the input data pointer.
-  delete[] data;
-  data = other.data;
+  // Release our data and grab the input data pointer, together with its
+  // allocator. A scalar is copied instead.
+  release();
+  allocator = other.allocator;
+  scalar = other.scalar;
+  data = (other.data == &other.scalar ? &scalar : other.data);
+  capacity = other.capacity;
+  planar = other.planar;
 
-  // Re-init the input tensor as a default scalar
+  // Re-init the input tensor as a default scalar, which does not allocate
   other.init(0,1);
+  other.storage.clear();
+  other.layout.clear();
 
   return *this;
 }
@@ -161,7 +214,7 @@ Tensor& Tensor::operator=(const Tensor& other) {
  * Destructor
  */
 Tensor::~Tensor() {
-  delete[] data;
+  release();
 }
 
 
@@ -181,17 +234,22 @@ Tensor& Tensor::operator+=(const Tensor& other) {
                            " size and rank");
   }
 
-  // Check for storage conflicts
-  if (other.storage == storage) {
-    // The storage lines up, so addition is easily done element by element
-    for (int i = 0; i < total_size; ++i)
+  // Check for layout conflicts. Pending storage changes do not matter, as
+  // long as the data arrays are laid out in the same way. In the planar
+  // format, the real and imaginary parts are added just the same.
+  if (other.layout == layout && other.planar == planar) {
+    // The layout lines up, so addition is easily done element by element
+    for (long long i = 0; i < total_size; ++i)
       data[i] += other.data[i];
   }
   else {
-    // Storage does not line up. Create a copy, set the correct storage and add
+    // Layout does not line up. Create a copy, set the correct layout and
+    // format and add
     Tensor copy(other);
-    copy.setStorage(storage);
-    for (int i = 0; i < total_size; ++i)
+    copy.setStorage(layout);
+    copy.convert(planar);
+    copy.apply();
+    for (long long i = 0; i < total_size; ++i)
       data[i] += copy.data[i];
   }
   return *this;
@@ -204,8 +262,19 @@ Tensor& Tensor::operator+=(const Tensor& other) {
 Tensor& Tensor::operator*=(cdouble scalar) {
 
   // Multiply each element by the scalar
-  for (int i = 0; i < total_size; ++i)
-    data[i] *= scalar;
+  if (planar && total_size > 1) {
+    double* re = reinterpret_cast<double*>(data);
+    double* im = re + total_size;
+    for (long long i = 0; i < total_size; ++i) {
+      double r = re[i];
+      re[i] = r*scalar.real() - im[i]*scalar.imag();
+      im[i] = r*scalar.imag() + im[i]*scalar.real();
+    }
+  }
+  else {
+    for (long long i = 0; i < total_size; ++i)
+      data[i] *= scalar;
+  }
 
   return *this;
 }
@@ -221,33 +290,18 @@ Tensor operator*(cdouble lhs, const Tensor& rhs) {return rhs*lhs;}
 
 
 void Tensor::conj() {
-  for (int i = 0; i < total_size; ++i)
-    data[i] = std::conj(data[i]);
-}
-
-
-cdouble Tensor::getElement(const std::vector<int>& index) const {
-  // Translate index into offset by using storage information
-  int os = 0;
-  int mult = 1;
-  for (int i = 0; i < dim; ++i) {
-    os += mult*index[storage[i]];
-    mult *= n;
+  if (planar && total_size > 1) {
+    double* im = reinterpret_cast<double*>(data) + total_size;
+    for (long long i = 0; i < total_size; ++i)
+      im[i] = -im[i];
   }
-  return data[os];
-}
-
-void Tensor::setElement(const std::vector<int>& index, cdouble value) {
-  // Translate index into offset by using storage information
-  int os = 0;
-  int mult = 1;
-  for (int i = 0; i < dim; ++i) {
-    os += mult*index[storage[i]];
-    mult *= n;
+  else {
+    for (long long i = 0; i < total_size; ++i)
+      data[i] = std::conj(data[i]);
   }
-  data[os] = value;
 }
 
+
 bool Tensor::getSlice(const std::vector<int>& slice, cdouble * buff) const {
 
   // For rank 0 tensors, just return the element, we don't check the slice
@@ -273,7 +327,9 @@ bool Tensor::getSlice(const std::vector<int>& slice, cdouble * buff) const {
 
   // Check if the data is correctly aligned:
   // The data is aligned correctly if the free indices of the slice
-  // corresponds to the first two entries in the storage tensor
+  // corresponds to the first two entries in the storage tensor. The slice
+  // is then returned transposed if the storage says so, also while a storage
+  // change is pending.
   bool aligned = true;
   for (int i = 0; i < dim && aligned; ++i) {
     if (slice[i] < 0) {
@@ -281,24 +337,30 @@ bool Tensor::getSlice(const std::vector<int>& slice, cdouble * buff) const {
       aligned = ((i == storage[0]) || (i == storage[1]));
     }
   }
+  bool trans = aligned && storage[0] > storage[1];
 
   // If  the data is aligned, simply copy the relevant part of the data pointer
-  if (aligned) {
+  if (aligned && layout == storage) {
     // Find the offset
-    int os = 0;
-    int mult = n*n;
+    long long os = 0;
+    long long mult = (long long)n*n;
     for (int i = 2; i < dim; ++i) {
       os += slice[storage[i]]*mult;
       mult *= n;
     }
 
     // Copy from the offset and n*n elements forward
-    std::copy(data+os, data + os + n*n, buff);
+    if (planar) {
+      const double* re = reinterpret_cast<const double*>(data);
+      gather(n, re + os, re + total_size + os, 1, n, buff);
+    }
+    else
+      std::copy(data+os, data + os + n*n, buff);
 
     // Check whether the data is transposed
-    return storage[0] > storage[1];
+    return trans;
 
-  } else { // If not, do it the slow way
+  } else { // If not, gather/scatter the elements with strides
 
     // Find the position of the running indices
     int r1, r2;
@@ -315,20 +377,37 @@ bool Tensor::getSlice(const std::vector<int>& slice, cdouble * buff) const {
       }
     }
 
-    // Make a copy of the input slice vector with 0's on the running indices
-    vector<int> cslice(slice);
-    cslice[r1] = 0; cslice[r2] = 0;
+    // If slice is transposed, swap r1 and r2
+    if (trans) {
+      int temp = r1;
+      r1 = r2;
+      r2 = temp;
+    }
 
-    int idx = 0;
-    for (int i = 0; i < n; ++i) {
-      cslice[r2] = i;
-      for (int j = 0; j < n; ++j) {
-        cslice[r1] = j;
-        buff[idx++] = getElement(cslice);
-      }
+    // Find the offset of the fixed indices and the strides of the running
+    // indices in the data array
+    long long os = 0;
+    long long inc1 = 0;
+    long long inc2 = 0;
+    long long mult = 1;
+    for (int i = 0; i < dim; ++i) {
+      if (layout[i] == r1)
+        inc1 = mult;
+      else if (layout[i] == r2)
+        inc2 = mult;
+      else
+        os += slice[layout[i]]*mult;
+      mult *= n;
     }
 
-    return false;
+    if (planar) {
+      const double* re = reinterpret_cast<const double*>(data);
+      gather(n, re + os, re + total_size + os, inc1, inc2, buff);
+    }
+    else
+      gather(n, data + os, inc1, inc2, buff);
+
+    return trans;
 
   }
 
@@ -360,34 +439,39 @@ void Tensor::setSlice(const std::vector<int>& slice, const cdouble * buff,
 
   // Check if the data is correctly aligned:
   // The data is aligned correctly if the free indices of the slice
-  // corresponds to the first two entries in the storage tensor in the
+  // corresponds to the first two entries in the layout vector in the
   // correct order corresponding to whether the slice is transposed or not.
   bool aligned = true;
-  if ((storage[0] > storage[1]) && !trans)
+  if ((layout[0] > layout[1]) && !trans)
     aligned = false;
-  else if ((storage[1] > storage[0]) && trans)
+  else if ((layout[1] > layout[0]) && trans)
     aligned = false;
   for (int i = 0; i < dim && aligned; ++i) {
     if (slice[i] < 0) {
-      // Still aligned if i is in one of the first two entries in the storage
-      aligned = ((i == storage[0]) || (i == storage[1]));
+      // Still aligned if i is in one of the first two entries in the layout
+      aligned = ((i == layout[0]) || (i == layout[1]));
     }
   }
 
   // If  the data is aligned, simply copy the relevant part of the data pointer
   if (aligned) {
     // Find the offset
-    int os = 0;
-    int mult = n*n;
+    long long os = 0;
+    long long mult = (long long)n*n;
     for (int i = 2; i < dim; ++i) {
-      os += slice[storage[i]]*mult;
+      os += slice[layout[i]]*mult;
       mult *= n;
     }
 
     // Copy from n*n elements from the buffer to the offset in the data
-    std::copy(buff, buff + n*n, data + os);
+    if (planar) {
+      double* re = reinterpret_cast<double*>(data);
+      scatter(n, buff, re + os, re + total_size + os, 1, n);
+    }
+    else
+      std::copy(buff, buff + n*n, data + os);
 
-  } else { // If not, do it the slow way
+  } else { // If not, gather/scatter the elements with strides
 
     // Find the position of the running indices
     int r1, r2;
@@ -411,36 +495,73 @@ void Tensor::setSlice(const std::vector<int>& slice, const cdouble * buff,
       r2 = temp;
     }
 
-    // Make a copy of the input slice vector with 0's on the running indices
-    vector<int> cslice(slice);
-    cslice[r1] = 0; cslice[r2] = 0;
+    // Find the offset of the fixed indices and the strides of the running
+    // indices in the data array
+    long long os = 0;
+    long long inc1 = 0;
+    long long inc2 = 0;
+    long long mult = 1;
+    for (int i = 0; i < dim; ++i) {
+      if (layout[i] == r1)
+        inc1 = mult;
+      else if (layout[i] == r2)
+        inc2 = mult;
+      else
+        os += slice[layout[i]]*mult;
+      mult *= n;
+    }
 
-    int idx = 0;
-    for (int i = 0; i < n; ++i) {
-      cslice[r2] = i;
-      for (int j = 0; j < n; ++j) {
-        cslice[r1] = j;
-        setElement(cslice, buff[idx++]);
-      }
+    if (planar) {
+      double* re = reinterpret_cast<double*>(data);
+      scatter(n, buff, re + os, re + total_size + os, inc1, inc2);
     }
+    else
+      scatter(n, buff, data + os, inc1, inc2);
 
   }
 
 }
 
+void Tensor::reset(int rank, int size, bool clear) {
+
+  long long total = 1;
+  for (int i = 0; i < rank; ++i)
+    total *= size;
+
+  if (total <= capacity && rank != 1 && (rank == 0 || size >= 2)) {
+    // The data array is large enough. Reuse it instead of allocating a new
+    // one, clearing it as if it was freshly created.
+    dim = rank;
+    n = size;
+    total_size = total;
+    planar = false;
+    if (clear)
+      std::fill(data, data + total_size, cdouble(0.0));
+  }
+  else {
+    release();
+    init(rank,size,clear);
+  }
+}
+
 void Tensor::resize(int rank, int size) {
-  delete[] data;
-  init(rank,size);
+  reset(rank,size,true);
 
   // Set default storage
-        storage = vector<int>(rank);
+  storage = vector<int>(rank);
   for (int i = 0; i < rank; ++i)
     storage[i] = i;
+  layout = storage;
 }
 
-void Tensor::resize(int rank, int size, const vector<int>& store) {
-  resize(rank,size);
+void Tensor::resize(int rank, int size, const vector<int>& store,
+                    bool clear, bool p) {
+  reset(rank,size,clear);
   storage = store;
+  layout = store;
+
+  // The elements are all 0 or undefined, so the format needs no conversion
+  planar = p;
 }
 
 vector<int> Tensor::getStorage() const {
@@ -460,37 +581,94 @@ void Tensor::setStorage(const std::vector<int>& store) {
       throw invalid_argument("Error in Tensor::setStorage: Store vector contains a repeated index");
   }
 
-  // Check that the storage is different
-  if (store != storage) {
-    // Create a new data array and assign with new storage info
-    cdouble *ndata = new cdouble[total_size];
-    vector<int> index(dim, 0);
-    bool flag = false;
-    int idx = 0;
-    while (!flag) {
-      // Insert element at the current index
-      ndata[idx++] = getElement(index);
-
-      // Increase the current index
-      flag = true;
-      for (int i = 0; i < dim && flag; ++i) {
-        // Increase index store[i]
-        int z = ++index[store[i]];
-        if (z == n) {
-          // We need to roll over
-          index[store[i]] = 0;
-        }
-        else // Index increased, escape loop and continue with next element
-          flag = false;
-      }
+  // The data array is laid out again when it is next accessed (see apply)
+  storage = store;
+}
+
+void Tensor::apply() {
+  if (layout != storage) {
+    // Create a new data array and copy the data with the new storage. The
+    // planes of a planar tensor are copied one at a time.
+    cdouble *ndata = allocator->allocate(total_size);
+    if (planar) {
+      const double* in = reinterpret_cast<const double*>(data);
+      double* out = reinterpret_cast<double*>(ndata);
+      permute(dim, n, layout, in, storage, out);
+      permute(dim, n, layout, in + total_size, storage, out + total_size);
     }
+    else
+      permute(dim, n, layout, data, storage, ndata);
 
     // Use the new data pointer
-    delete[] data;
+    release();
     data = ndata;
+    capacity = total_size;
+    layout = storage;
+  }
+}
+
+void Tensor::convert(bool p) {
+  if (planar == p)
+    return;
 
+  // A single element is the same in both formats
+  if (total_size > 1) {
+    cdouble *ndata = allocator->allocate(total_size);
+    if (p) {
+      double* re = reinterpret_cast<double*>(ndata);
+      split(total_size, data, re, re + total_size);
+    }
+    else {
+      const double* re = reinterpret_cast<const double*>(data);
+      interleave(total_size, re, re + total_size, ndata);
+    }
+    release();
+    data = ndata;
+    capacity = total_size;
   }
-  storage = store;
+  planar = p;
 }
 
-}
\ No newline at end of file
+const cdouble* Tensor::getData() const {
+  if (planar && total_size > 1)
+    throw invalid_argument("Error in Tensor::getData: The tensor is in the "
+                           "planar format");
+  if (layout != storage)
+    throw invalid_argument("Error in Tensor::getData: The tensor has a "
+                           "pending storage change");
+  return data;
+}
+
+const cdouble* Tensor::getData(std::vector<int>& store) const {
+  if (planar && total_size > 1)
+    throw invalid_argument("Error in Tensor::getData: The tensor is in the "
+                           "planar format");
+  store = layout;
+  return data;
+}
+
+const double* Tensor::getPlanarData() const {
+  if (!planar && total_size > 1)
+    throw invalid_argument("Error in Tensor::getPlanarData: The tensor is in "
+                           "the interleaved format");
+  if (layout != storage)
+    throw invalid_argument("Error in Tensor::getPlanarData: The tensor has a "
+                           "pending storage change");
+  return reinterpret_cast<const double*>(data);
+}
+
+double* Tensor::getPlanarData() {
+  convert(true);
+  apply();
+  return reinterpret_cast<double*>(data);
+}
+
+const double* Tensor::getPlanarData(std::vector<int>& store) const {
+  if (!planar && total_size > 1)
+    throw invalid_argument("Error in Tensor::getPlanarData: The tensor is in "
+                           "the interleaved format");
+  store = layout;
+  return reinterpret_cast<const double*>(data);
+}
+
+}
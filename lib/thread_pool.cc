@@ -0,0 +1,178 @@
+/* ****************************************************************************
+ *
+ * Implementation of the thread pool defined in THREAD_POOL.H
+ *
+ * ***************************************************************************/
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include "pichi/contraction.h"
+#include "thread_pool.h"
+#include "gemm.h"
+
+using namespace std;
+
+namespace pichi {
+
+// Marks the worker threads of the pools
+static thread_local bool worker_thread = false;
+
+ThreadPool::ThreadPool(int n) : stop(false) {
+  for (int i = 0; i < n; ++i)
+    workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(mtx);
+    stop = true;
+  }
+  cv.notify_all();
+  for (thread& t : workers)
+    t.join();
+}
+
+void ThreadPool::submit(const std::function<void()>& task) {
+  {
+    lock_guard<mutex> lock(mtx);
+    tasks.push(task);
+  }
+  cv.notify_one();
+}
+
+bool ThreadPool::inWorker() {
+  return worker_thread;
+}
+
+SerialRegion::SerialRegion() : previous(worker_thread) {
+  worker_thread = true;
+}
+
+SerialRegion::~SerialRegion() {
+  worker_thread = previous;
+}
+
+void ThreadPool::work() {
+  worker_thread = true;
+  while (true) {
+    function<void()> task;
+    {
+      unique_lock<mutex> lock(mtx);
+      cv.wait(lock, [this]{ return stop || !tasks.empty(); });
+      // Finish the queue before stopping
+      if (tasks.empty())
+        return;
+      task = move(tasks.front());
+      tasks.pop();
+    }
+    task();
+  }
+}
+
+
+// --- Global pool -------------------------------------------------------
+
+// The number of threads used for contractions, and the pool of workers
+static int threads = 1;
+static unique_ptr<ThreadPool> pool(new ThreadPool(0));
+
+// The number of live regions in which BLAS runs on a single thread
+static mutex blas_mtx;
+static int serial_blas_regions = 0;
+
+void setThreads(int n) {
+  if (n < 1)
+    throw invalid_argument("Error in setThreads: The number of threads must "
+                           "be at least 1");
+  if (n != threads) {
+    pool.reset(new ThreadPool(n-1)); // The caller is the last thread
+    threads = n;
+  }
+  // Large single multiplications may use all the threads in BLAS. Parallel
+  // loops restrict BLAS to one thread while they run.
+  lock_guard<mutex> lock(blas_mtx);
+  if (serial_blas_regions == 0)
+    setBlasThreads(n);
+}
+
+int getThreads() {
+  return threads;
+}
+
+SerialBlasRegion::SerialBlasRegion() {
+  lock_guard<mutex> lock(blas_mtx);
+  if (serial_blas_regions++ == 0)
+    setBlasThreads(1);
+}
+
+SerialBlasRegion::~SerialBlasRegion() {
+  lock_guard<mutex> lock(blas_mtx);
+  if (--serial_blas_regions == 0)
+    setBlasThreads(threads);
+}
+
+ThreadPool& threadPool() {
+  return *pool;
+}
+
+void parallelFor(long long count,
+                 const std::function<void(long long, long long)>& f) {
+
+  if (count <= 0)
+    return;
+  if (count == 1 || threads == 1 || ThreadPool::inWorker()) {
+    f(0, count);
+    return;
+  }
+
+  // Split the range into a number of chunks, which are picked up by the
+  // participating threads one at a time, to balance the load.
+  long long chunks = (count < 4*threads ? count : 4*threads);
+  int helpers = (chunks - 1 < pool->size() ? chunks - 1 : pool->size());
+
+  atomic<long long> next(0);
+  mutex mtx;
+  condition_variable done;
+  int running = helpers;
+  exception_ptr error;
+
+  auto run = [&]() {
+    long long c;
+    while ((c = next++) < chunks) {
+      try {
+        f(c*count/chunks, (c+1)*count/chunks);
+      } catch (...) {
+        lock_guard<mutex> lock(mtx);
+        if (!error)
+          error = current_exception();
+      }
+    }
+  };
+
+  // Run BLAS on a single thread while the loop runs in parallel
+  SerialBlasRegion serial_blas;
+
+  for (int i = 0; i < helpers; ++i) {
+    pool->submit([&]() {
+      run();
+      lock_guard<mutex> lock(mtx);
+      if (--running == 0)
+        done.notify_one();
+    });
+  }
+  {
+    SerialRegion serial; // Makes the caller run its chunks serially
+    run();
+  }
+
+  {
+    unique_lock<mutex> lock(mtx);
+    done.wait(lock, [&]{ return running == 0; });
+  }
+
+  if (error)
+    rethrow_exception(error);
+}
+
+}
@@ -0,0 +1,131 @@
+#ifndef PICHI_THREAD_POOL_H
+#define PICHI_THREAD_POOL_H
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+namespace pichi {
+
+/* ************************************************************************
+ *
+ * This file declares the thread pool used for parallel contractions.
+ *
+ * PICHI keeps a single global pool of worker threads. The number of threads
+ * is set through setThreads (see CONTRACTION.H), and the calling thread
+ * always takes part in the work, so a pool for T threads has T-1 workers.
+ *
+ * Work is handed to the pool either as independent tasks (submit) or as a
+ * loop over a range of integers (parallelFor). Parallel work started from
+ * within a task runs serially on the worker itself. This way nested parallel
+ * regions never wait for each other and can not oversubscribe the machine.
+ *
+ * ***********************************************************************/
+
+class ThreadPool {
+
+public:
+
+  /*
+   * Creates a pool with a given number of worker threads.
+   */
+  explicit ThreadPool(int workers);
+
+  /*
+   * Finishes all queued tasks and joins the workers.
+   */
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /*
+   * Adds a task to the queue. The task will be executed by one of the
+   * workers as soon as one is available.
+   */
+  void submit(const std::function<void()>& task);
+
+  /*
+   * Gets the number of worker threads in the pool.
+   */
+  int size() const { return workers.size(); };
+
+  /*
+   * Returns true if the calling thread is a worker in any pool.
+   */
+  static bool inWorker();
+
+private:
+
+  // Main loop of the worker threads
+  void work();
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stop;
+
+};
+
+/*
+ * Marks the calling thread as a worker for as long as the object lives.
+ * Parallel work started by the thread in the meantime runs serially. This is
+ * used when the calling thread takes part in work distributed on the pool.
+ */
+class SerialRegion {
+
+public:
+  SerialRegion();
+  ~SerialRegion();
+
+  SerialRegion(const SerialRegion&) = delete;
+  SerialRegion& operator=(const SerialRegion&) = delete;
+
+private:
+  bool previous;
+
+};
+
+/*
+ * Runs BLAS on a single thread for as long as the object lives. This is used
+ * while work runs in parallel on the pool. The regions are counted, such that
+ * regions which overlap, also on different threads, leave BLAS on a single
+ * thread until the last of them ends. BLAS then gets back the number of
+ * threads set through setThreads.
+ */
+class SerialBlasRegion {
+
+public:
+  SerialBlasRegion();
+  ~SerialBlasRegion();
+
+  SerialBlasRegion(const SerialBlasRegion&) = delete;
+  SerialBlasRegion& operator=(const SerialBlasRegion&) = delete;
+
+};
+
+/*
+ * Gets the global thread pool.
+ */
+ThreadPool& threadPool();
+
+/*
+ * Splits the range [0,count) into chunks and calls f(begin,end) for each
+ * chunk. The chunks are distributed on the global thread pool and the
+ * calling thread, and the call returns when all chunks are done. If any of
+ * the calls throw, the first exception is rethrown on the calling thread.
+ * If there is only one thread, or if the call is made from within a worker,
+ * f(0,count) is called directly. Parallel work started from within f runs
+ * serially, also on the calling thread.
+ */
+void parallelFor(long long count,
+                 const std::function<void(long long, long long)>& f);
+
+}
+
+#endif //PICHI_THREAD_POOL_H
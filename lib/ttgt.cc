@@ -0,0 +1,138 @@
+/* ****************************************************************************
+ *
+ * Implementation of the TTGT contraction engine defined in ENGINES.H
+ *
+ * ***************************************************************************/
+
+#include "engines.h"
+#include "buffer.h"
+#include "gemm.h"
+#include "kernels.h"
+
+using namespace std;
+
+namespace pichi {
+
+void prepareTTGT(ContractionSetup& setup) {
+
+  int rank1 = setup.store1.size();
+  int rank2 = setup.store2.size();
+
+  // Find the free indices on both tensors
+  vector<bool> free1(rank1, true);
+  vector<bool> free2(rank2, true);
+  for (pair<int,int> p : setup.idx) {
+    free1[p.first] = false;
+    free2[p.second] = false;
+  }
+
+  // Tensor 1 is stored with the free indices first (in order), followed by
+  // the contracted indices. Tensor 2 is stored with the contracted indices
+  // first, in the same order as on tensor 1, followed by the free indices.
+  vector<int> store1;
+  vector<int> store2;
+  for (int i = 0; i < rank1; ++i) {
+    if (free1[i])
+      store1.push_back(i);
+  }
+  for (pair<int,int> p : setup.idx) {
+    store1.push_back(p.first);
+    store2.push_back(p.second);
+  }
+  for (int i = 0; i < rank2; ++i) {
+    if (free2[i])
+      store2.push_back(i);
+  }
+  setup.store1 = store1;
+  setup.store2 = store2;
+
+  // The output indices are the free indices of tensor 1 followed by those of
+  // tensor 2, so the matrix product is exactly the output tensor with
+  // default storage.
+  setup.store_out.clear();
+  for (int i = 0; i < setup.rank; ++i)
+    setup.store_out.push_back(i);
+}
+
+// Gets the real and imaginary planes of a tensor with a given number of
+// elements. The planes of an interleaved tensor are split into a buffer
+// taken from the workspace, which is kept in buffer.
+static const double* getPlanes(Tensor& t, long long total,
+                               ContractionWorkspace* workspace,
+                               unique_ptr<WorkspaceBuffer>& buffer) {
+  if (t.isPlanar())
+    return t.getPlanarData();
+  buffer.reset(new WorkspaceBuffer(workspace, total));
+  double* planes = reinterpret_cast<double*>(buffer->data());
+  split(total, t.getData(), planes, planes + total);
+  return planes;
+}
+
+void contractTTGT(const ContractionSetup& setup, Tensor& t1, Tensor& t2,
+                  Tensor& out, ContractionWorkspace* workspace) {
+
+  int size = setup.size;
+  int nc = setup.idx.size();
+  int rank1 = setup.store1.size();
+  int rank2 = setup.store2.size();
+
+  t1.setStorage(setup.store1);
+  t2.setStorage(setup.store2);
+
+  // Dimensions of the matrices: tensor 1 is (rows x inner), tensor 2 is
+  // (inner x cols).
+  long long rows = 1;
+  long long inner = 1;
+  long long cols = 1;
+  for (int i = 0; i < rank1 - nc; ++i)
+    rows *= size;
+  for (int i = 0; i < nc; ++i)
+    inner *= size;
+  for (int i = 0; i < rank2 - nc; ++i)
+    cols *= size;
+
+  // Two interleaved tensors are multiplied with a complex product. The
+  // product overwrites every element of the output.
+  bool planar = (t1.isPlanar() && t2.isPlanar());
+  bool interleaved = (!t1.isPlanar() && !t2.isPlanar());
+  if (interleaved && setup.method == GemmMethod::Standard) {
+    out.resize(setup.rank, size, setup.store_out, false);
+    gemm(false, false, rows, cols, inner, t1.getData(), rows,
+         t2.getData(), inner, 0.0, out.getData(), rows);
+    return;
+  }
+
+  // Otherwise the real and imaginary planes are multiplied, such that a
+  // planar input is read without converting it. Two planar tensors give a
+  // planar output, while the planes of an interleaved output are computed
+  // in a buffer and interleaved afterwards.
+  unique_ptr<WorkspaceBuffer> buffer1, buffer2, buffer_out;
+  const double* a = getPlanes(t1, rows*inner, workspace, buffer1);
+  const double* b = getPlanes(t2, inner*cols, workspace, buffer2);
+  out.resize(setup.rank, size, setup.store_out, false, planar);
+  double* c;
+  if (planar)
+    c = out.getPlanarData();
+  else {
+    buffer_out.reset(new WorkspaceBuffer(workspace, rows*cols));
+    c = reinterpret_cast<double*>(buffer_out->data());
+  }
+
+  // The 3M method forms the sums of the planes of both operands in one
+  // more buffer (of complex numbers, so half as many elements)
+  if (setup.method == GemmMethod::Gauss) {
+    WorkspaceBuffer sums(workspace, (rows*inner + inner*cols + 1) / 2);
+    double* sa = reinterpret_cast<double*>(sums.data());
+    gemm3M(false, false, rows, cols, inner, a, a + rows*inner, rows,
+           b, b + inner*cols, inner, c, c + rows*cols, rows, sa,
+           sa + rows*inner);
+  } else {
+    gemmPlanar(false, false, rows, cols, inner, a, a + rows*inner, rows,
+               b, b + inner*cols, inner, c, c + rows*cols, rows);
+  }
+
+  if (!planar)
+    interleave(rows*cols, c, c + rows*cols, out.getData());
+}
+
+}
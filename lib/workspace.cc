@@ -0,0 +1,83 @@
+/* ****************************************************************************
+ *
+ * Implementation of the ContractionWorkspace defined in WORKSPACE.H, and of
+ * the buffers defined in BUFFER.H
+ *
+ * ***************************************************************************/
+
+#include "pichi/workspace.h"
+#include "buffer.h"
+
+using namespace std;
+
+namespace pichi {
+
+ContractionWorkspace::Block::Block(long long n) :
+    data(allocateAligned(n)), capacity(n) {}
+
+ContractionWorkspace::Block::~Block() {
+  freeAligned(data);
+}
+
+ContractionWorkspace::ContractionWorkspace() {}
+
+ContractionWorkspace::~ContractionWorkspace() {}
+
+int ContractionWorkspace::countBuffers() const {
+  lock_guard<mutex> lock(mtx);
+  return blocks.size();
+}
+
+long long ContractionWorkspace::countElements() const {
+  lock_guard<mutex> lock(mtx);
+  long long res = 0;
+  for (const unique_ptr<Block>& b : blocks)
+    res += b->capacity;
+  return res;
+}
+
+void ContractionWorkspace::clear() {
+  lock_guard<mutex> lock(mtx);
+  blocks.clear();
+}
+
+
+// --- Buffers -----------------------------------------------------------
+
+WorkspaceBuffer::WorkspaceBuffer(ContractionWorkspace* ws, long long n) :
+    ws(ws) {
+
+  if (ws) {
+    lock_guard<mutex> lock(ws->mtx);
+    vector<unique_ptr<ContractionWorkspace::Block>>& blocks = ws->blocks;
+
+    // Take the smallest block which is large enough. If there is none, the
+    // largest block is replaced by a new one, such that the number of
+    // blocks does not grow.
+    int best = -1;
+    for (int i = 0; i < blocks.size(); ++i) {
+      bool fits = (blocks[i]->capacity >= n);
+      if (best == -1 ||
+          (fits && (blocks[best]->capacity < n ||
+                    blocks[i]->capacity < blocks[best]->capacity)) ||
+          (!fits && blocks[i]->capacity > blocks[best]->capacity))
+        best = i;
+    }
+    if (best != -1) {
+      block = move(blocks[best]);
+      blocks.erase(blocks.begin() + best);
+      if (block->capacity >= n)
+        return;
+    }
+  }
+  block.reset(new ContractionWorkspace::Block(n));
+}
+
+WorkspaceBuffer::~WorkspaceBuffer() {
+  if (ws) {
+    lock_guard<mutex> lock(ws->mtx);
+    ws->blocks.push_back(move(block));
+  }
+}
+
+}
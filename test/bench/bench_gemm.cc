@@ -0,0 +1,98 @@
+/*
+ * Benchmark test:
+ *
+ * Times the SIMD microkernels against the default backend (BLAS if
+ * available, otherwise Armadillo) on square complex matrices of increasing
+ * size, for the products and transpositions used by the slice engine. The
+ * crossover is the size from which the backend is faster; gemm uses the
+ * microkernels below it (see smallGemm in GEMM.CC).
+ */
+
+#include "pichi/pichi.h"
+#include "gemm.h"
+#include "simd.h"
+
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+#define N 20
+
+using namespace pichi;
+using namespace std;
+
+mt19937 gen;
+
+cdouble rc() {
+  uniform_real_distribution<> dist(-1,1);
+  double r = dist(gen);
+  double c = dist(gen);
+  return cdouble(r,c);
+}
+
+// Fastest of N runs of reps products, in microseconds per product
+double time(bool ta, bool tb, int n, const vector<cdouble>& a,
+            const vector<cdouble>& b, vector<cdouble>& c) {
+  int reps = 1 + (1 << 22) / (n*n*n);
+  double best = 1e30;
+  for (int i = 0; i < N; ++i) {
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r)
+      gemm(ta, tb, n, n, n, a.data(), n, b.data(), n, 0.0, c.data(), n);
+    auto end = chrono::steady_clock::now();
+    double t = chrono::duration<double, micro>(end - start).count() / reps;
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+int main() {
+
+  gen.seed(time(NULL));
+
+  SimdLevel level = getSimdLevel();
+  if (level == SimdLevel::None) {
+    cout << "The SIMD microkernels are not supported on this machine" << endl;
+    return 0;
+  }
+  Backend backend = getBackend();
+
+  cout << "Launching PICHI benchmark test: SIMD microkernels" << endl << endl;
+  cout << "   Microkernels: " << (level == SimdLevel::AVX512 ? "AVX-512" :
+                                  "AVX2") << endl;
+  cout << "   Backend: " << (backend == Backend::BLAS ? "BLAS" :
+                             "Armadillo") << endl;
+  cout << "   Fastest of " << N << " runs" << endl << endl;
+
+  cout << "---------------------------------- " << endl << endl;
+  cout << "n\top\tkernel/us\tbackend/us\tratio" << endl;
+  cout << "------------------------------------------------------" << endl;
+
+  for (int n : {4, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256}) {
+    vector<cdouble> a(n*n), b(n*n), c(n*n);
+    for (int i = 0; i < n*n; ++i) {
+      a[i] = rc();
+      b[i] = rc();
+    }
+    for (int t = 0; t < 3; ++t) {
+      bool ta = (t == 1);
+      bool tb = (t == 2);
+
+      // The microkernels through the builtin backend, and the backend alone
+      setBackend(Backend::Builtin);
+      double kernel = time(ta, tb, n, a, b, c);
+      setBackend(backend);
+      setSimdLevel(SimdLevel::None);
+      double ref = time(ta, tb, n, a, b, c);
+      setSimdLevel(level);
+
+      cout << setprecision(3) << n << "\t" << (ta ? "T" : "N") <<
+           (tb ? "T" : "N") << "\t" << kernel << "\t\t" << ref << "\t\t" <<
+           ref/kernel << endl;
+    }
+  }
+
+  return 0;
+}
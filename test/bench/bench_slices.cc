@@ -0,0 +1,270 @@
+/*
+ * Benchmark test:
+ *
+ * Times the slice engine on a set of contractions with different numbers of
+ * contracted and free indices, and with storage which needs strided access
+ * to the slices.
+ *
+ * On the diagrams of the table in DIAGRAMS.H, the slice iterators are then
+ * timed on their own. Every pair of input slices of the contractions in the
+ * plan of a diagram is read in the order of the slice engine, once through
+ * the slice vectors and getSlice, and once through the offsets which the
+ * iterators track once their layout is set.
+ */
+
+#include "pichi/pichi.h"
+#include "slice_iterator.h"
+#include "kernels.h"
+
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+
+#define N 10
+#define P 3
+#define SIZE 16
+
+using namespace pichi;
+using namespace std;
+
+mt19937 gen;
+cdouble checksum = 0.0;
+
+cdouble rc() {
+  uniform_real_distribution<> dist(-1,1);
+  double r = dist(gen);
+  double c = dist(gen);
+  return cdouble(r,c);
+}
+
+void fill(Tensor& t) {
+  long long n = 1;
+  for (int i = 0; i < t.getRank(); ++i)
+    n *= t.getSize();
+  cdouble* data = t.getData();
+  for (long long i = 0; i < n; ++i)
+    data[i] = rc();
+}
+
+double mean(vector<double> x) {
+  double sum = 0.0;
+  for (double xx : x)
+    sum += xx;
+  return sum/x.size();
+}
+
+double stdev(vector<double> x) {
+  double m = mean(x);
+  double sum = 0.0;
+  for (double xx : x)
+    sum += (xx - m)*(xx - m);
+  return sqrt(sum/x.size());
+}
+
+// A contraction of one or two tensors
+struct Case {
+  string name;
+  int rank1, rank2;
+  vector<pair<int,int>> indices;
+  vector<int> store1, store2;
+};
+
+// Reads every pair of input slices of a contraction in the order of the
+// slice engine, either through the slice vectors or through the offsets of
+// the iterator. As in the engine, each slice is read in the orientation in
+// which its columns are closest together in memory. Returns the sum of the first element of each slice, such
+// that the reads are not optimised away.
+cdouble readSlices(const Tensor& t1, const Tensor& t2,
+                   const vector<pair<int,int>>& idx, bool offsets) {
+  int n = t1.getSize();
+  vector<int> layout1, layout2;
+  const cdouble* a1 = t1.getData(layout1);
+  const cdouble* a2 = t2.getData(layout2);
+  vector<int> store_out(t1.getRank() + t2.getRank() - 2*idx.size());
+  for (int i = 0; i < store_out.size(); ++i)
+    store_out[i] = i;
+
+  DoubleSliceIterator it(t1, t2, idx);
+  if (offsets)
+    it.setLayout(layout1, layout2, store_out);
+  pair<long long,long long> run1 = it.getStrides1();
+  pair<long long,long long> run2 = it.getStrides2();
+
+  vector<cdouble> s1(n*n), s2(n*n);
+  cdouble sum = 0.0;
+  for (long long k = 0; k < it.countNonSlicedFree(); ++k) {
+    do {
+      do {
+        if (offsets) {
+          gather(n, a1 + it.getOffset1(), min(run1.first, run1.second),
+                 max(run1.first, run1.second), s1.data());
+          gather(n, a2 + it.getOffset2(), min(run2.first, run2.second),
+                 max(run2.first, run2.second), s2.data());
+        } else {
+          t1.getSlice(it.getSlice1(), s1.data());
+          t2.getSlice(it.getSlice2(), s2.data());
+        }
+        sum += s1[0] + s2[0];
+      } while (it.nextContracted());
+    } while (it.nextSlicedFree());
+    it.nextNonSlicedFree();
+  }
+  return sum;
+}
+
+// Mean time of reading the slices of all two-tensor contractions in the
+// plan of a diagram for the slice engine, in seconds
+double timeDiagram(const Graph& graph, const vector<Tensor>& tensors,
+                   bool offsets) {
+  setEngine(Engine::Slice);
+  ContractionPlan plan(graph, tensors);
+  setEngine(Engine::Auto);
+
+  // The intermediates are made up front, with the rank of the output of
+  // their step
+  vector<Tensor> all(tensors);
+  for (const ContractionStep& step : plan.getSteps()) {
+    int rank = -2*step.indices.size();
+    for (int i : step.inputs)
+      rank += all[i].getRank();
+    all.resize(step.output + 1);
+    if (rank > 0) {
+      all[step.output].resize(rank, SIZE);
+      fill(all[step.output]);
+    }
+  }
+
+  vector<double> times;
+  for (int i = -P; i < N; ++i) {
+    auto start = chrono::steady_clock::now();
+    for (const ContractionStep& step : plan.getSteps()) {
+      if (step.inputs.size() == 2)
+        checksum += readSlices(all[step.inputs[0]], all[step.inputs[1]],
+                               step.indices, offsets);
+    }
+    auto end = chrono::steady_clock::now();
+    if (i >= 0)
+      times.push_back(chrono::duration<double>(end - start).count());
+  }
+  return mean(times);
+}
+
+void header() {
+  cout << "Launching PICHI benchmark test: slice engine" << endl << endl;
+  cout << "   Running each contraction " << N << " times with tensors of "
+       "size " << SIZE << endl;
+  cout << "   Warm-up runs without measuring: " << P << endl << endl;
+
+  cout << "---------------------------------- " << endl << endl;
+  cout << "Contraction\t\t\tT/ms" << endl;
+  cout << "------------------------------------------" << endl;
+}
+
+void report(const string& name, vector<double> times) {
+  cout << setprecision(3) << left << setw(32) << name << 1000*mean(times) <<
+       " +/- " << setprecision(2) << 1000*stdev(times) << endl;
+}
+
+int main() {
+
+  gen.seed(time(NULL));
+  setEngine(Engine::Slice);
+
+  vector<Case> cases = {
+      {"A_abcd B_aefd", 4, 4, {{0,0},{3,3}}, {0,1,2,3}, {0,1,2,3}},
+      {"A_abcd B_aefd (permuted)", 4, 4, {{0,0},{3,3}}, {2,0,3,1},
+       {3,1,0,2}},
+      {"A_abcd B_ebfd", 4, 4, {{1,1},{3,3}}, {0,1,2,3}, {0,1,2,3}},
+      {"A_abc B_abd", 3, 3, {{0,0},{1,1}}, {0,1,2}, {0,1,2}},
+      {"A_abc B_dbe", 3, 3, {{1,1}}, {2,0,1}, {0,1,2}},
+      {"A_abcd B_de", 4, 2, {{3,0}}, {0,1,2,3}, {0,1}},
+      {"A_ab B_bcde", 2, 4, {{1,0}}, {0,1}, {0,1,2,3}},
+      {"A_abcd B_abcd", 4, 4, {{0,0},{1,1},{2,2}}, {0,1,2,3}, {0,1,2,3}},
+      {"A_aabc", 4, 0, {{0,1}}, {0,1,2,3}, {}},
+      {"A_abac (permuted)", 4, 0, {{0,2}}, {3,1,2,0}, {}},
+  };
+
+  header();
+
+  for (const Case& c : cases) {
+    Tensor a(c.rank1, SIZE), b;
+    fill(a);
+    if (c.rank2 > 0) {
+      b.resize(c.rank2, SIZE);
+      fill(b);
+      b.setStorage(c.store2);
+    }
+    a.setStorage(c.store1);
+
+    vector<double> times;
+    for (int i = -P; i < N; ++i) {
+      auto start = chrono::steady_clock::now();
+
+      Tensor res;
+      if (c.rank2 > 0)
+        contract(a, b, c.indices, res);
+      else
+        contract(a, c.indices, res);
+
+      auto end = chrono::steady_clock::now();
+
+      double et_tot = chrono::duration_cast<
+          chrono::duration<double>>(end-start).count();
+      if (i >= 0)
+        times.push_back(et_tot);
+    }
+    report(c.name, times);
+  }
+
+  setEngine(Engine::Auto);
+
+  vector<pair<string,string>> diagrams = {
+      {"A_ab B_ab", "0ab1ab"},
+      {"A_ab B_bc C_ac", "0ab1bc2ac"},
+      {"A_ab B_bc C_cd D_ad", "0ab1bc2cd3ad"},
+      {"A_abc B_abc", "0abc1abc"},
+      {"A_abc B_abd C_cd", "0abc1abd2cd"},
+      {"A_abc B_abd C_ce D_de", "0abc1abd2ce3de"},
+      {"A_abc B_ade C_bd D_ce", "0abc1ade2bd3ce"},
+      {"A_abc B_abd C_def D_cef", "0abc1abd2def3cef"},
+      {"A_ab B_cd C_abcd", "0ab1cd2abcd"},
+  };
+
+  cout << endl << "---------------------------------- " << endl << endl;
+  cout << "Reading the slices of the diagrams" << endl << endl;
+  cout << "Diagram				Storage		vectors/ms	offsets/ms	ratio" << endl;
+  cout << "------------------------------------------------------------------"
+          "--------------------" << endl;
+
+  for (const pair<string,string>& d : diagrams) {
+    Graph graph(d.second);
+    vector<Tensor> tensors;
+    for (int node : graph.getNodes()) {
+      tensors.emplace_back(graph.connections(node).size(), SIZE);
+      fill(tensors.back());
+    }
+
+    for (bool reversed : {false, true}) {
+      vector<Tensor> input(tensors);
+      if (reversed) {
+        for (Tensor& t : input) {
+          vector<int> store;
+          for (int i = t.getRank() - 1; i >= 0; --i)
+            store.push_back(i);
+          t.setStorage(store);
+          t.applyStorage();
+        }
+      }
+
+      double vectors = timeDiagram(graph, input, false);
+      double offsets = timeDiagram(graph, input, true);
+      cout << setprecision(3) << left << setw(32) << d.first <<
+           (reversed ? "reversed" : "default") << "\t" << 1000*vectors <<
+           "\t\t" << 1000*offsets << "\t\t" << vectors/offsets << endl;
+    }
+  }
+
+  return 0;
+}
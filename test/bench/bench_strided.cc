@@ -0,0 +1,132 @@
+/*
+ * Benchmark test:
+ *
+ * Times the strided engine against TTGT on the diagrams of the table in
+ * DIAGRAMS.H. TTGT reorders the input tensors of each contraction before a
+ * single matrix product, while the strided engine packs the blocks of the
+ * product straight from the tensors as they are stored. Each diagram is
+ * evaluated with default storage, and with the input tensors stored in
+ * reverse order, such that the contractions run along strided indices.
+ */
+
+#include "pichi/pichi.h"
+
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+#define N 10
+#define P 2
+#define SIZE 32
+
+using namespace pichi;
+using namespace std;
+
+mt19937 gen;
+
+cdouble rc() {
+  uniform_real_distribution<> dist(-1,1);
+  double r = dist(gen);
+  double c = dist(gen);
+  return cdouble(r,c);
+}
+
+void fill(Tensor& t) {
+  long long n = 1;
+  for (int i = 0; i < t.getRank(); ++i)
+    n *= t.getSize();
+  cdouble* data = t.getData();
+  for (long long i = 0; i < n; ++i)
+    data[i] = rc();
+}
+
+double mean(vector<double> x) {
+  double sum = 0.0;
+  for (double xx : x)
+    sum += xx;
+  return sum/x.size();
+}
+
+// Mean time of evaluating a diagram with an engine, in seconds. The plan is
+// made for the storage of the tensors, which are copied before each run,
+// since TTGT changes their storage.
+double time(const Graph& graph, const vector<Tensor>& tensors, Engine e) {
+  setEngine(e);
+  ContractionPlan plan(graph, tensors);
+  vector<double> times;
+  for (int i = -P; i < N; ++i) {
+    vector<Tensor> copies(tensors);
+    Tensor res;
+
+    auto start = chrono::steady_clock::now();
+    plan.execute(copies, res);
+    auto end = chrono::steady_clock::now();
+
+    if (i >= 0)
+      times.push_back(chrono::duration<double>(end - start).count());
+  }
+  setEngine(Engine::Auto);
+  return mean(times);
+}
+
+void header() {
+  cout << "Launching PICHI benchmark test: strided engine" << endl << endl;
+  cout << "   Running each diagram " << N << " times with tensors of size "
+       << SIZE << endl;
+  cout << "   Warm-up runs without measuring: " << P << endl << endl;
+
+  cout << "---------------------------------- " << endl << endl;
+  cout << "Diagram\t\t\t\tStorage\t\tTTGT/ms\t\tStrided/ms\tratio" << endl;
+  cout << "------------------------------------------------------------------"
+          "--------------------" << endl;
+}
+
+int main() {
+
+  gen.seed(time(NULL));
+
+  vector<pair<string,string>> diagrams = {
+      {"A_ab B_ab", "0ab1ab"},
+      {"A_ab B_bc C_ac", "0ab1bc2ac"},
+      {"A_ab B_bc C_cd D_ad", "0ab1bc2cd3ad"},
+      {"A_abc B_abc", "0abc1abc"},
+      {"A_abc B_abd C_cd", "0abc1abd2cd"},
+      {"A_abc B_abd C_ce D_de", "0abc1abd2ce3de"},
+      {"A_abc B_ade C_bd D_ce", "0abc1ade2bd3ce"},
+      {"A_abc B_abd C_def D_cef", "0abc1abd2def3cef"},
+      {"A_ab B_cd C_abcd", "0ab1cd2abcd"},
+  };
+
+  header();
+
+  for (const pair<string,string>& d : diagrams) {
+    Graph graph(d.second);
+    vector<Tensor> tensors;
+    for (int node : graph.getNodes()) {
+      tensors.emplace_back(graph.connections(node).size(), SIZE);
+      fill(tensors.back());
+    }
+
+    for (bool reversed : {false, true}) {
+      vector<Tensor> input(tensors);
+      if (reversed) {
+        for (Tensor& t : input) {
+          vector<int> store;
+          for (int i = t.getRank() - 1; i >= 0; --i)
+            store.push_back(i);
+          t.setStorage(store);
+          t.applyStorage();
+        }
+      }
+
+      double ttgt = time(graph, input, Engine::TTGT);
+      double strided = time(graph, input, Engine::Strided);
+      cout << setprecision(3) << left << setw(32) << d.first <<
+           (reversed ? "reversed" : "default") << "\t" << 1000*ttgt <<
+           "\t\t" << 1000*strided << "\t\t" << ttgt/strided << endl;
+    }
+  }
+
+  return 0;
+}
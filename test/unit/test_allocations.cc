@@ -0,0 +1,180 @@
+#include "engines.h"
+#include "pichi/contraction.h"
+#include "pichi/workspace.h"
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+/*
+ * Unit tests of the heap allocations made by the slice engine defined in
+ * CONTRACTION.CC. The global operator new is replaced, so these tests are
+ * built into their own program (allocation_ut), and the other tests run
+ * with the default allocator.
+ */
+
+using namespace pichi;
+using namespace std;
+
+// Counts the heap allocations made while counting is set. All forms of new
+// and delete are replaced, such that they match, including the sized delete
+// used by code compiled for later standards. They all go through the two
+// functions which call malloc and free. These are not inlined, such that the
+// compiler does not pair a free with an operator new it can see
+// (-Wmismatched-new-delete).
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+static atomic<bool> counting(false);
+static atomic<long long> allocations(0);
+
+NOINLINE void* operator new(size_t n, const nothrow_t&) noexcept {
+  if (counting)
+    ++allocations;
+  return malloc(n > 0 ? n : 1);
+}
+
+void* operator new(size_t n) {
+  void* p = operator new(n, nothrow);
+  if (!p)
+    throw bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t n) {
+  return operator new(n);
+}
+
+void* operator new[](size_t n, const nothrow_t&) noexcept {
+  return operator new(n, nothrow);
+}
+
+NOINLINE void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  operator delete(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept {
+  operator delete(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept {
+  operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  operator delete(p);
+}
+
+namespace {
+
+// A contraction of two tensors with default storage
+struct Case {
+  int rank1, rank2;
+  vector<pair<int,int>> idx;
+};
+
+vector<Case> cases = {
+    {4, 2, {{3,0}}},
+    {2, 4, {{1,0}}},
+    {3, 3, {{2,0}}},
+    {4, 4, {{0,1},{2,3}}},
+    {3, 3, {{0,0},{2,1}}}
+};
+
+TEST(Allocations, SliceLoopAllocatesNothing) {
+  // Once the iterator is set up, the loop of the slice engine over the
+  // slices only takes its buffers from the workspace. The first run fills
+  // the workspace and warms up the backend. Armadillo may allocate
+  // temporaries for a product of padded matrices, so it is not checked.
+  int size = 6;
+  Backend def = getBackend();
+  for (Backend backend : {Backend::BLAS, Backend::Builtin}) {
+    try {
+      setBackend(backend);
+    } catch (invalid_argument&) {
+      continue; // Backend not available in this build
+    }
+    for (const Case& c : cases) {
+      Tensor a = filled(c.rank1, size, 1);
+      Tensor b = filled(c.rank2, size, 2);
+      ContractionSetup setup = prepareContraction(size, a.getStorage(),
+                                                  b.getStorage(), c.idx,
+                                                  Engine::Slice);
+      a.setStorage(setup.store1);
+      b.setStorage(setup.store2);
+      Tensor out;
+      out.resize(setup.rank, size, setup.store_out);
+      long long count = setup.slices->countNonSlicedFree();
+
+      const cdouble* a1 = a.getData();
+      const cdouble* a2 = b.getData();
+      cdouble* result = out.getData();
+
+      ContractionWorkspace workspace;
+      DoubleSliceIterator it(*setup.slices);
+      it.setLayout(setup.store1, setup.store2, setup.store_out);
+      for (int run = 0; run < 2; ++run) {
+        DoubleSliceIterator its(it);
+        allocations = 0;
+        counting = (run == 1);
+        contractSliceRange(setup, its, a1, a2, result, 0, count, &workspace);
+        counting = false;
+      }
+      EXPECT_EQ(0, allocations);
+    }
+  }
+  setBackend(def);
+}
+
+// Counts the heap allocations of a contraction with the slice engine, on
+// tensors of the given size with default storage. The builtin backend is
+// used, since Armadillo may allocate temporaries for a product.
+long long countAllocations(int size, int rank1, int rank2,
+                           const vector<pair<int,int>>& idx) {
+  Tensor a = filled(rank1, size, 1);
+  Tensor b = filled(rank2 > 0 ? rank2 : 2, size, 2);
+  setEngine(Engine::Slice);
+  Backend def = getBackend();
+  setBackend(Backend::Builtin);
+  // The data arrays of tensors come from a pool, whose state depends on the
+  // earlier tests. The first contraction fills it with the arrays needed.
+  for (int i = 0; i < 2; ++i) {
+    allocations = 0;
+    counting = (i == 1);
+    Tensor out;
+    if (rank2 > 0)
+      contract(a, b, idx, out);
+    else
+      contract(a, idx, out);
+    counting = false;
+  }
+  setBackend(def);
+  setEngine(Engine::Auto);
+  return allocations;
+}
+
+TEST(Allocations, ContractionsDoNotDependOnSize) {
+  // The buffers of the engines are allocated once per contraction. The
+  // number of slices grows with the size, the number of allocations does
+  // not.
+  for (const Case& c : cases) {
+    EXPECT_EQ(countAllocations(3, c.rank1, c.rank2, c.idx),
+              countAllocations(8, c.rank1, c.rank2, c.idx));
+  }
+  EXPECT_EQ(countAllocations(3, 5, 0, {{1,3}}),
+            countAllocations(8, 5, 0, {{1,3}}));
+}
+
+}
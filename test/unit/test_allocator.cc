@@ -0,0 +1,205 @@
+#include "pichi/allocator.h"
+#include "pichi/contraction.h"
+#include "pichi/plan.h"
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+#include <cstdint>
+
+/*
+ * Unit tests of the allocators defined in ALLOCATOR.CC, and of their use by
+ * tensors and plans
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+// Allocator counting the arrays it hands out and gets back
+class CountingAllocator : public TensorAllocator {
+
+public:
+
+  cdouble* allocate(long long n) override {
+    ++allocated;
+    elements += n;
+    return new cdouble[n];
+  }
+
+  void deallocate(cdouble* data, long long n) override {
+    ++released;
+    elements -= n;
+    delete[] data;
+  }
+
+  int allocated = 0;
+  int released = 0;
+  long long elements = 0;
+
+};
+
+TEST(Allocator, PoolIsAligned) {
+  PoolAllocator pool(0);
+  for (long long n : {2, 3, 17, 1000}) {
+    cdouble* data = pool.allocate(n);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(data) % 64);
+    pool.deallocate(data, n);
+  }
+}
+
+TEST(Allocator, PoolReusesArrays) {
+  PoolAllocator pool(0);
+  cdouble* data = pool.allocate(1000);
+  for (int i = 0; i < 1000; ++i)
+    data[i] = 0.0;
+  pool.deallocate(data, 1000);
+  PoolAllocator::Stats stats = pool.getStats();
+  EXPECT_EQ(0, stats.hits);
+  EXPECT_EQ(1, stats.misses);
+  EXPECT_LE(1000, stats.pooled);
+
+  // A request of a similar size gets the same array
+  EXPECT_EQ(data, pool.allocate(900));
+  stats = pool.getStats();
+  EXPECT_EQ(1, stats.hits);
+  EXPECT_EQ(0, stats.pooled);
+
+  // A much smaller or larger request does not
+  cdouble* small = pool.allocate(100);
+  cdouble* large = pool.allocate(2000);
+  EXPECT_EQ(1, pool.getStats().hits);
+  EXPECT_EQ(3, pool.getStats().misses);
+
+  pool.deallocate(data, 900);
+  pool.deallocate(small, 100);
+  pool.deallocate(large, 2000);
+  pool.clear();
+  EXPECT_EQ(0, pool.getStats().pooled);
+}
+
+TEST(Allocator, PoolLimit) {
+  PoolAllocator pool(1500);
+  cdouble* a1 = pool.allocate(1000);
+  cdouble* a2 = pool.allocate(1000);
+  pool.deallocate(a1, 1000);
+  pool.deallocate(a2, 1000);
+
+  // Only one of the arrays is kept
+  long long pooled = pool.getStats().pooled;
+  EXPECT_LE(1000, pooled);
+  EXPECT_GE(1500, pooled);
+}
+
+TEST(Allocator, Tensors) {
+  CountingAllocator counter;
+  setAllocator(&counter);
+  {
+    // Scalars keep their element in the tensor
+    Tensor s;
+    Tensor r0(0, 4);
+    EXPECT_EQ(0, counter.allocated);
+
+    Tensor t(3, 4);
+    EXPECT_EQ(1, counter.allocated);
+    EXPECT_EQ(64, counter.elements);
+    fill(t, 1);
+    Tensor ref(t);
+    EXPECT_EQ(2, counter.allocated);
+
+    // Moving does not allocate
+    Tensor m(move(t));
+    t = move(m);
+    s = move(t);
+    EXPECT_EQ(2, counter.allocated);
+    EXPECT_EQ(0, counter.released);
+    for (int i = 0; i < 64; ++i)
+      EXPECT_EQ(ref.getData()[i], s.getData()[i]);
+
+    // Moving a scalar keeps its value
+    Tensor x(0, 1);
+    x.getData()[0] = 3.0;
+    Tensor y(move(x));
+    EXPECT_EQ(3.0, y.getData()[0]);
+    EXPECT_EQ(0.0, x.getData()[0]);
+
+    // A pending storage change takes a new array
+    s.setStorage({2,1,0});
+    s.applyStorage();
+    EXPECT_EQ(3, counter.allocated);
+    EXPECT_EQ(1, counter.released);
+  }
+  setAllocator(nullptr);
+  EXPECT_EQ(counter.allocated, counter.released);
+  EXPECT_EQ(0, counter.elements);
+
+  // Tensors created from now on use the default pool
+  Tensor t(3, 4);
+  EXPECT_EQ(3, counter.allocated);
+}
+
+TEST(Allocator, PlanArena) {
+  Tensor a(4, 5, {2,0,3,1}), b(3, 5), c(3, 5);
+  fill(a, 1);
+  fill(b, 2);
+  fill(c, 3);
+  vector<Tensor> tensors = {a, b, c};
+  Tensor ref;
+  contract(Graph("0abcd1abe2cde"), tensors, ref);
+
+  ContractionPlan plan(Graph("0abcd1abe2cde"), {4,3,3}, 5);
+  EXPECT_EQ(0, plan.getArenaStats().misses);
+  tensors = {a, b, c};
+  Tensor res;
+  plan.execute(tensors, res);
+  EXPECT_NEAR(0.0, abs(ref.getData()[0] - res.getData()[0]), 1e-9);
+  PoolAllocator::Stats stats = plan.getArenaStats();
+  EXPECT_LT(0, stats.misses);
+  EXPECT_LT(0, stats.pooled);
+
+  // The intermediates of a second execution are found in the arena
+  tensors = {a, b, c};
+  plan.execute(tensors, res);
+  EXPECT_NEAR(0.0, abs(ref.getData()[0] - res.getData()[0]), 1e-9);
+  EXPECT_EQ(stats.misses, plan.getArenaStats().misses);
+  EXPECT_LT(stats.hits, plan.getArenaStats().hits);
+  EXPECT_EQ(stats.pooled, plan.getArenaStats().pooled);
+
+  // Copies share the arena
+  ContractionPlan copy(plan);
+  tensors = {a, b, c};
+  copy.execute(tensors, res);
+  EXPECT_EQ(stats.misses, plan.getArenaStats().misses);
+}
+
+// The intermediates of a diagram evaluated by contract come from the global
+// allocator, and a second evaluation finds their arrays there
+TEST(Allocator, OneShotUsesGlobalAllocator) {
+  Tensor a(4, 5, {2,0,3,1}), b(3, 5), c(3, 5);
+  fill(a, 1);
+  fill(b, 2);
+  fill(c, 3);
+  Graph graph("0abcd1abe2cde");
+  Tensor ref;
+  vector<Tensor> tensors = {a, b, c};
+  contract(graph, tensors, ref);
+  vector<Tensor> first = {a, b, c}, second = {a, b, c};
+
+  PoolAllocator pool(0);
+  setAllocator(&pool);
+  {
+    Tensor res;
+    contract(graph, first, res);
+    EXPECT_NEAR(0.0, abs(ref.getData()[0] - res.getData()[0]), 1e-9);
+    PoolAllocator::Stats stats = pool.getStats();
+    EXPECT_LT(0, stats.misses);
+    EXPECT_LT(0, stats.pooled);
+
+    contract(graph, second, res);
+    EXPECT_NEAR(0.0, abs(ref.getData()[0] - res.getData()[0]), 1e-9);
+    EXPECT_EQ(stats.misses, pool.getStats().misses);
+    EXPECT_LT(stats.hits, pool.getStats().hits);
+  }
+  setAllocator(nullptr);
+}
+
+}
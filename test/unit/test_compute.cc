@@ -152,12 +152,23 @@ TEST_F(ComputeTest, Diagram8) {
   EXPECT_EQ(-499.0, r[0]);
 }
 
-TEST_F(ComputeTest, UnknownDiagram) {
+TEST_F(ComputeTest, MesonPentagon) {
+  Tensor res;
+  contract(Graph("0ae1ab2bc3cd8de"),tensors,res);
+  cdouble r[1]; res.getSlice({0},r);
+  EXPECT_EQ(-10708.0, r[0]);
+}
+
+TEST_F(ComputeTest, NodeWithoutTensor) {
   Tensor res;
-  cdouble r[1];
   EXPECT_THROW(contract(Graph("1ae2ab3bc4cd9de"),tensors,res),
                invalid_argument);
 }
 
+TEST_F(ComputeTest, RankMismatch) {
+  Tensor res;
+  EXPECT_THROW(contract(Graph("4ab5ab"),tensors,res), invalid_argument);
+}
+
 }
 
@@ -758,5 +758,70 @@ TEST(Contract, aabc_bc) {
 
 }
 
+TEST(Contract, abc_bca_PermutedStorage) {
+  // Full contraction where the two tensors are stored in incompatible orders
+  Tensor t1(3,3,{1,2,0});
+  Tensor t2(3,3,{2,0,1});
+  cdouble data[9];
+  for (int c = 0; c < 3; ++c) {
+    for (int i = 0; i < 9; ++i)
+      data[i] = cdouble(i+c, i-2*c);
+    t1.setSlice({-1,-1,c}, data);
+    for (int i = 0; i < 9; ++i)
+      data[i] = cdouble(1-i*c, 2+i);
+    t2.setSlice({-1,-1,c}, data);
+  }
+
+  // Reference: sum over a,b,c of t1(a,b,c) t2(b,c,a)
+  cdouble ref = 0.0;
+  for (int a = 0; a < 3; ++a)
+    for (int b = 0; b < 3; ++b)
+      for (int c = 0; c < 3; ++c)
+        ref += cdouble(a+3*b+c, a+3*b-2*c) * cdouble(1-(b+3*c)*a, 2+b+3*c);
+
+  Tensor t3;
+  contract(t1,t2,{{0,2},{1,0},{2,1}},t3);
+
+  ASSERT_EQ(0, t3.getRank());
+
+  cdouble datar[1];
+  t3.getSlice({0},datar);
+  EXPECT_NEAR(ref.real(), datar[0].real(), 1.0e-10);
+  EXPECT_NEAR(ref.imag(), datar[0].imag(), 1.0e-10);
+
+  // The input storage is left untouched
+  EXPECT_EQ(vector<int>({1,2,0}), t1.getStorage());
+  EXPECT_EQ(vector<int>({2,0,1}), t2.getStorage());
+}
+
+TEST(Contract, abcd_abcd_CompatibleStorage) {
+  // Full contraction where the data is read as a single dot product
+  Tensor t1(4,5,{3,1,0,2});
+  Tensor t2(4,5,{3,1,0,2});
+  cdouble data[25];
+  cdouble ref = 0.0;
+  for (int d = 0; d < 5; ++d) {
+    for (int c = 0; c < 5; ++c) {
+      for (int i = 0; i < 25; ++i)
+        data[i] = cdouble(i-c, d+1);
+      t1.setSlice({-1,-1,c,d}, data);
+      for (int i = 0; i < 25; ++i) {
+        ref += data[i] * cdouble(c+d, -i);
+        data[i] = cdouble(c+d, -i);
+      }
+      t2.setSlice({-1,-1,c,d}, data);
+    }
+  }
+
+  Tensor t3;
+  contract(t1,t2,{{0,0},{1,1},{2,2},{3,3}},t3);
+
+  ASSERT_EQ(0, t3.getRank());
+
+  cdouble datar[1];
+  t3.getSlice({0},datar);
+  EXPECT_NEAR(ref.real(), datar[0].real(), 1.0e-9);
+  EXPECT_NEAR(ref.imag(), datar[0].imag(), 1.0e-9);
+}
 
 }
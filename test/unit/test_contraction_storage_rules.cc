@@ -68,6 +68,34 @@ TEST(ContractionStorageRules, TwoTensorThreeIndexWithNumberOutput) {
 
 }
 
+TEST(ContractionStorageRules, TwoTensorStridedEngine) {
+  Tensor t1(3,2,{2,0,1});
+  Tensor t2(4,2,{3,2,0,1});
+
+  setEngine(Engine::Strided);
+  Tensor t3;
+  contract(t1,t2,{{1,0},{0,3}},t3);
+  setEngine(Engine::Auto);
+
+  // The inputs keep their storage
+  EXPECT_EQ(2, t1.getStorage()[0]);
+  EXPECT_EQ(0, t1.getStorage()[1]);
+  EXPECT_EQ(1, t1.getStorage()[2]);
+
+  EXPECT_EQ(3, t2.getStorage()[0]);
+  EXPECT_EQ(2, t2.getStorage()[1]);
+  EXPECT_EQ(0, t2.getStorage()[2]);
+  EXPECT_EQ(1, t2.getStorage()[3]);
+
+  // The free indices of each input are stored in the same order on the
+  // output
+  ASSERT_EQ(3, t3.getRank());
+  EXPECT_EQ(0, t3.getStorage()[0]);
+  EXPECT_EQ(2, t3.getStorage()[1]);
+  EXPECT_EQ(1, t3.getStorage()[2]);
+
+}
+
 TEST(ContractionStorageRules, OneTensorWithTensorOutput) {
   Tensor t1(5,2);
 
@@ -81,9 +109,10 @@ TEST(ContractionStorageRules, OneTensorWithTensorOutput) {
   Tensor t2;
   contract(t1,{{0,2}},t2);
 
+  // The input keeps its storage
   EXPECT_EQ(0, t1.getStorage()[0]);
-  EXPECT_EQ(2, t1.getStorage()[1]);
-  EXPECT_EQ(1, t1.getStorage()[2]);
+  EXPECT_EQ(1, t1.getStorage()[1]);
+  EXPECT_EQ(2, t1.getStorage()[2]);
   EXPECT_EQ(3, t1.getStorage()[3]);
   EXPECT_EQ(4, t1.getStorage()[4]);
 
@@ -91,6 +120,20 @@ TEST(ContractionStorageRules, OneTensorWithTensorOutput) {
   EXPECT_EQ(1, t2.getStorage()[1]);
   EXPECT_EQ(2, t2.getStorage()[2]);
 
+  // The free indices are stored on the output in the order of the input
+  Tensor t3(5,2,{4,2,0,3,1});
+  contract(t3,{{0,2}},t2);
+
+  EXPECT_EQ(4, t3.getStorage()[0]);
+  EXPECT_EQ(2, t3.getStorage()[1]);
+  EXPECT_EQ(0, t3.getStorage()[2]);
+  EXPECT_EQ(3, t3.getStorage()[3]);
+  EXPECT_EQ(1, t3.getStorage()[4]);
+
+  EXPECT_EQ(2, t2.getStorage()[0]);
+  EXPECT_EQ(1, t2.getStorage()[1]);
+  EXPECT_EQ(0, t2.getStorage()[2]);
+
 
 }
 
@@ -107,8 +150,8 @@ TEST(ContractionStorageRules, OneTensorWithNumberOutput) {
   contract(t1,{{0,2},{1,3}},t2);
 
   EXPECT_EQ(0, t1.getStorage()[0]);
-  EXPECT_EQ(2, t1.getStorage()[1]);
-  EXPECT_EQ(1, t1.getStorage()[2]);
+  EXPECT_EQ(1, t1.getStorage()[1]);
+  EXPECT_EQ(2, t1.getStorage()[2]);
   EXPECT_EQ(3, t1.getStorage()[3]);
 
 
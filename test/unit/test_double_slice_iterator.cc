@@ -10,6 +10,33 @@ using namespace std;
 
 namespace {
 
+// The offset of a slice in a data array with a given size and storage
+long long offset(int size, const vector<int>& store, const vector<int>& slice) {
+  long long os = 0;
+  long long mult = 1;
+  for (int i : store) {
+    if (slice[i] >= 0)
+      os += slice[i]*mult;
+    mult *= size;
+  }
+  return os;
+}
+
+// The strides of the running indices of a slice, in the order of the slice
+pair<long long,long long> running(int size, const vector<int>& store,
+                                  const vector<int>& slice) {
+  vector<long long> strides;
+  for (int i = 0; i < slice.size(); ++i) {
+    if (slice[i] < 0) {
+      long long mult = 1;
+      for (int j = 0; store[j] != i; ++j)
+        mult *= size;
+      strides.push_back(mult);
+    }
+  }
+  return make_pair(strides[0], strides[1]);
+}
+
 TEST(DoubleIterator, Simple) {
   DoubleSliceIterator s(Tensor(3,2), Tensor(3,2), {{1,1},{2,0}});
   vector<int> s1 = s.getSlice1();
@@ -259,19 +286,22 @@ TEST(DoubleIterator, OnlyContractedIndices) {
   ASSERT_EQ(3, s2.size());
   ASSERT_EQ(0, so.size());
 
-  EXPECT_EQ(-2, s1[0]); EXPECT_EQ(-1, s1[1]); EXPECT_EQ(0, s1[2]);
-  EXPECT_EQ(0, s2[0]); EXPECT_EQ(-1, s2[1]); EXPECT_EQ(-2, s2[2]);
+  // Slicing along a and c gives slices with contiguous columns on both
+  // tensors. This is cheaper than a contiguous slice on one tensor and a
+  // strided slice on the other (a and b).
+  EXPECT_EQ(-1, s1[0]); EXPECT_EQ(0, s1[1]); EXPECT_EQ(-2, s1[2]);
+  EXPECT_EQ(-2, s2[0]); EXPECT_EQ(0, s2[1]); EXPECT_EQ(-1, s2[2]);
 
   EXPECT_FALSE(s.nextNonSlicedFree());
   EXPECT_FALSE(s.nextSlicedFree());
 
   EXPECT_TRUE(s.nextContracted());
-  EXPECT_EQ(1, s.getSlice1()[2]);
-  EXPECT_EQ(1, s.getSlice2()[0]);
+  EXPECT_EQ(1, s.getSlice1()[1]);
+  EXPECT_EQ(1, s.getSlice2()[1]);
 
   EXPECT_FALSE(s.nextContracted());
-  EXPECT_EQ(0, s.getSlice1()[2]);
-  EXPECT_EQ(0, s.getSlice2()[0]);
+  EXPECT_EQ(0, s.getSlice1()[1]);
+  EXPECT_EQ(0, s.getSlice2()[1]);
 
 }
 
@@ -409,6 +439,67 @@ TEST(DoubleIterator, MinimumStorageSlicingTwoContractedIndices1) {
 
 
 
+TEST(DoubleIterator, CheapestSlices) {
+  // Slicing along the first two contracted indices gives a strided slice on
+  // tensor 1. Slicing along the last two gives slices with contiguous
+  // columns on both tensors.
+  DoubleSliceIterator s(Tensor(4,3,{3,2,1,0}), Tensor(4,3),
+                        {{0,1},{1,0},{3,3}});
+  EXPECT_EQ("SC (1,0) (3,3) | NC (0,1) | SF 1:2 2:2", s.toString());
+
+  s.setLayout({3,2,1,0}, {0,1,2,3}, {0,1});
+  EXPECT_EQ(1, min(s.getStrides1().first, s.getStrides1().second));
+  EXPECT_EQ(1, min(s.getStrides2().first, s.getStrides2().second));
+}
+
+TEST(DoubleIterator, LoopOrderFollowsStrides) {
+  // The NF index with the shortest strides on the input and output tensors
+  // together runs fastest
+  DoubleSliceIterator s(Tensor(5,3,{0,1,3,4,2}), Tensor(2,3), {{0,0}});
+  EXPECT_EQ("SC (0,0) | SF 1:1 2:1 | NF 1:3 1:2 1:4", s.toString());
+
+  EXPECT_TRUE(s.nextNonSlicedFree());
+  EXPECT_EQ(1, s.getSlice1()[3]);
+  EXPECT_EQ(0, s.getSlice1()[2]);
+  EXPECT_EQ(1, s.getSliceOut()[2]);
+}
+
+TEST(DoubleIterator, OffsetsFollowSlices) {
+  vector<int> store1 = {2,0,4,1,3};
+  vector<int> store2 = {1,3,0,4,2};
+  vector<int> store_out = {3,1,0,2};
+  DoubleSliceIterator s(Tensor(5,3), Tensor(5,3), {{1,2},{4,0},{3,3}});
+  s.setLayout(store1, store2, store_out);
+
+  // The running strides follow the order of the indices in the slices
+  EXPECT_EQ(running(3, store1, s.getSlice1()), s.getStrides1());
+  EXPECT_EQ(running(3, store2, s.getSlice2()), s.getStrides2());
+  EXPECT_EQ(running(3, store_out, s.getSliceOut()), s.getStridesOut());
+
+  auto check = [&]() {
+    EXPECT_EQ(offset(3, store1, s.getSlice1()), s.getOffset1());
+    EXPECT_EQ(offset(3, store2, s.getSlice2()), s.getOffset2());
+    EXPECT_EQ(offset(3, store_out, s.getSliceOut()), s.getOffsetOut());
+  };
+
+  int count = 0;
+  do {
+    do {
+      check();
+      while (s.nextContracted()) {
+        check();
+        ++count;
+      }
+    } while (s.nextSlicedFree());
+  } while (s.nextNonSlicedFree());
+  EXPECT_LT(0, count);
+
+  for (long long n = s.countNonSlicedFree() - 1; n >= 0; --n) {
+    s.setNonSlicedFree(n);
+    check();
+  }
+}
+
 TEST(DoubleIteratorErrorHandling, ValidRankAndSize) {
   EXPECT_THROW(DoubleSliceIterator(Tensor(1,2), Tensor(2,2),{{0,1}}),
                invalid_argument);
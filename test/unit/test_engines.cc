@@ -0,0 +1,295 @@
+#include "pichi/contraction.h"
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+#include <cstdlib>
+
+/*
+ * Unit tests comparing the contraction engines defined in ENGINES.H
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+// Contract two tensors with every engine and compare the results to the
+// slice engine.
+void compareEngines(int rank1, int rank2, const vector<int>& store1,
+                    const vector<int>& store2,
+                    const vector<pair<int,int>>& idx) {
+  Tensor a(rank1, 3, store1);
+  Tensor b(rank2, 3, store2);
+  fill(a, 1);
+  fill(b, 2);
+
+  Tensor ref;
+  {
+    Tensor a1(a), b1(b);
+    setEngine(Engine::Slice);
+    contract(a1, b1, idx, ref);
+  }
+  Backend def = getBackend();
+  for (Backend backend : {Backend::Armadillo, Backend::BLAS, Backend::Builtin}) {
+    try {
+      setBackend(backend);
+    } catch (invalid_argument&) {
+      continue; // Backend not available in this build
+    }
+    for (GemmMethod m : {GemmMethod::Standard, GemmMethod::Gauss})
+    for (Engine e : {Engine::Slice, Engine::TTGT, Engine::Strided,
+                     Engine::Auto}) {
+      Tensor a1(a), b1(b), res;
+      setEngine(e);
+      setGemmMethod(m);
+      contract(a1, b1, idx, res);
+      expectEqual(ref, res);
+    }
+  }
+  setEngine(Engine::Auto);
+  setGemmMethod(GemmMethod::Standard);
+  setBackend(def);
+}
+
+TEST(Engines, ab_bc) {
+  compareEngines(2, 2, {0,1}, {1,0}, {{1,0}});
+}
+
+TEST(Engines, abc_cd) {
+  compareEngines(3, 2, {0,1,2}, {0,1}, {{2,0}});
+}
+
+TEST(Engines, abc_abd) {
+  compareEngines(3, 3, {0,1,2}, {2,1,0}, {{0,0},{1,1}});
+}
+
+TEST(Engines, abc_dbe) {
+  compareEngines(3, 3, {1,2,0}, {0,1,2}, {{1,1}});
+}
+
+TEST(Engines, abcd_dcbe) {
+  compareEngines(4, 4, {0,1,2,3}, {3,1,0,2}, {{1,2},{2,1},{3,0}});
+}
+
+TEST(Engines, abcd_ecaf) {
+  compareEngines(4, 4, {2,0,3,1}, {0,1,2,3}, {{0,2},{2,1}});
+}
+
+TEST(Engines, abc_ade) {
+  compareEngines(3, 3, {0,1,2}, {0,1,2}, {{0,0}});
+}
+
+TEST(Engines, MultPanels) {
+  // One contracted index, where the slices of tensor 1 (or 2) change with
+  // the fastest NF indices. The NF combinations span several panels.
+  Tensor a(5, 12, {3,0,4,1,2});
+  Tensor b(2, 12, {1,0});
+  fill(a, 5);
+  fill(b, 6);
+  for (int threads : {1, 3}) {
+    setThreads(threads);
+    for (bool swap : {false, true}) {
+      Tensor a1(a), b1(b), ref, res;
+      setEngine(Engine::TTGT);
+      if (swap)
+        contract(b1, a1, {{1,2}}, ref);
+      else
+        contract(a1, b1, {{2,1}}, ref);
+      setEngine(Engine::Slice);
+      if (swap)
+        contract(b1, a1, {{1,2}}, res);
+      else
+        contract(a1, b1, {{2,1}}, res);
+      expectEqual(ref, res);
+    }
+  }
+  setThreads(1);
+  setEngine(Engine::Auto);
+}
+
+TEST(Engines, Threads) {
+  // Contract with several threads and compare to the serial result
+  Tensor a(4, 4, {2,0,3,1});
+  Tensor b(3, 4);
+  fill(a, 3);
+  fill(b, 4);
+  for (Engine e : {Engine::Slice, Engine::TTGT, Engine::Strided}) {
+    setEngine(e);
+    for (vector<pair<int,int>> idx : {vector<pair<int,int>>{{1,0}},
+                                      vector<pair<int,int>>{{2,1},{0,2}}}) {
+      Tensor a1(a), b1(b), ref, res;
+      setThreads(1);
+      contract(a1, b1, idx, ref);
+      setThreads(4);
+      contract(a1, b1, idx, res);
+      expectEqual(ref, res);
+    }
+  }
+
+  // Single tensor contraction
+  Tensor ref, res;
+  setThreads(1);
+  contract(a, {{0,3}}, ref);
+  setThreads(4);
+  contract(a, {{0,3}}, res);
+  expectEqual(ref, res);
+
+  setThreads(1);
+  setEngine(Engine::Auto);
+}
+
+TEST(Engines, StridedBlocks) {
+  // Products of more than one block of rows and columns, and of more than
+  // one block of contracted indices, with pending storage changes on the
+  // inputs
+  struct Case {
+    int rank1, rank2;
+    vector<int> store1, store2;
+    vector<pair<int,int>> idx;
+  };
+  vector<Case> cases = {
+      {5, 6, {3,0,4,1,2}, {5,2,0,4,1,3}, {{1,4},{3,2}}},
+      {4, 4, {2,0,3,1}, {1,3,0,2}, {{0,1},{2,3},{3,0}}},
+  };
+  for (const Case& c : cases) {
+    Tensor a(c.rank1, 7), b(c.rank2, 7);
+    fill(a, 7);
+    fill(b, 8);
+    a.setStorage(c.store1);
+    b.setStorage(c.store2);
+
+    Tensor ref;
+    {
+      Tensor a1(a), b1(b);
+      setEngine(Engine::TTGT);
+      contract(a1, b1, c.idx, ref);
+    }
+
+    setEngine(Engine::Strided);
+    for (int threads : {1, 3}) {
+      setThreads(threads);
+      Tensor a1(a), b1(b), res;
+      contract(a1, b1, c.idx, res);
+
+      // The inputs are left as they were
+      EXPECT_EQ(c.store1, a1.getStorage());
+      EXPECT_EQ(c.store2, b1.getStorage());
+      EXPECT_TRUE(a1.hasPendingStorage());
+      EXPECT_TRUE(b1.hasPendingStorage());
+      expectEqual(ref, res);
+    }
+  }
+  setThreads(1);
+  setEngine(Engine::Auto);
+}
+
+TEST(Engines, PartialTrace) {
+  // Traces of a tensor with a pending storage change, in both formats and
+  // on several threads, compared to the sums of the elements. The diagonal
+  // of the last trace is closer together in memory than the output.
+  Tensor a(6, 5);
+  fill(a, 9);
+  a.setStorage({3,0,5,4,1,2});
+  Tensor ref_a(a);
+  for (vector<pair<int,int>> idx : {vector<pair<int,int>>{{1,3}},
+                                    vector<pair<int,int>>{{5,0},{1,2}},
+                                    vector<pair<int,int>>{{3,0}}}) {
+    vector<bool> traced(6, false);
+    for (pair<int,int> p : idx) {
+      traced[p.first] = true;
+      traced[p.second] = true;
+    }
+
+    for (bool planar : {false, true}) {
+      for (int threads : {1, 3}) {
+        setThreads(threads);
+        Tensor a1(a), res;
+        a1.setPlanar(planar);
+        contract(a1, idx, res);
+        EXPECT_TRUE(a1.hasPendingStorage());
+        EXPECT_EQ(planar, a1.isPlanar());
+        ASSERT_EQ(6 - 2*(int)idx.size(), res.getRank());
+
+        // Loop over the output elements, and sum the diagonal
+        vector<int> index(res.getRank(), 0);
+        bool flag = true;
+        while (flag) {
+          cdouble sum = 0.0;
+          for (int d = 0; d < (idx.size() == 1 ? 5 : 25); ++d) {
+            vector<int> full(6);
+            for (int i = 0, f = 0; i < 6; ++i) {
+              if (!traced[i])
+                full[i] = index[f++];
+            }
+            full[idx[0].first] = full[idx[0].second] = d % 5;
+            if (idx.size() > 1)
+              full[idx[1].first] = full[idx[1].second] = d / 5;
+            sum += element(ref_a, full);
+          }
+          EXPECT_NEAR(0.0, abs(sum - element(res, index)), 1.0e-10);
+          flag = false;
+          for (int i = 0; i < res.getRank() && !flag; ++i) {
+            if (++index[i] == 5)
+              index[i] = 0;
+            else
+              flag = true;
+          }
+        }
+      }
+    }
+  }
+  setThreads(1);
+}
+
+TEST(Engines, GaussAccuracy) {
+  // Random elements of magnitude 1, contracted over 4096 values, with both
+  // methods. The 3M method loses a few more bits than the standard one,
+  // relative to the size of the result.
+  Tensor a(4, 8), b(4, 8);
+  srand(1);
+  for (Tensor* t : {&a, &b}) {
+    cdouble* data = t->getData();
+    for (int i = 0; i < 4096; ++i)
+      data[i] = cdouble(2.0*rand()/RAND_MAX - 1.0, 2.0*rand()/RAND_MAX - 1.0);
+  }
+
+  // The reference is accumulated in long double
+  vector<complex<long double>> ref(4096, 0.0);
+  const cdouble* da = a.getData();
+  const cdouble* db = b.getData();
+  for (int j = 0; j < 64; ++j) {
+    for (int l = 0; l < 64; ++l) {
+      complex<long double> y = db[l + j*64];
+      for (int i = 0; i < 64; ++i)
+        ref[i + j*64] += complex<long double>(da[i + l*64]) * y;
+    }
+  }
+
+  double error[2];
+  for (int m = 0; m < 2; ++m) {
+    setGemmMethod(m == 0 ? GemmMethod::Standard : GemmMethod::Gauss);
+    Tensor a1(a), b1(b), res;
+    contract(a1, b1, {{2,0},{3,1}}, res, nullptr);
+    error[m] = 0.0;
+    for (int i = 0; i < 4096; ++i) {
+      complex<long double> d = complex<long double>(res.getData()[i]) - ref[i];
+      error[m] = max(error[m], (double)abs(d) / (double)abs(ref[i]));
+    }
+  }
+  setGemmMethod(GemmMethod::Standard);
+  EXPECT_GT(1.0e-12, error[0]);
+  EXPECT_GT(1.0e-11, error[1]);
+}
+
+TEST(Engines, EngineSetting) {
+  EXPECT_EQ(Engine::Auto, getEngine());
+  setEngine(Engine::TTGT);
+  EXPECT_EQ(Engine::TTGT, getEngine());
+  setEngine(Engine::Auto);
+
+  EXPECT_EQ(GemmMethod::Standard, getGemmMethod());
+  setGemmMethod(GemmMethod::Gauss);
+  EXPECT_EQ(GemmMethod::Gauss, getGemmMethod());
+  setGemmMethod(GemmMethod::Standard);
+}
+
+}
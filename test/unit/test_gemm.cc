@@ -0,0 +1,276 @@
+#include "gemm.h"
+#include "kernels.h"
+#include "simd.h"
+#include "pichi/contraction.h"
+#include "gtest/gtest.h"
+
+/*
+ * Unit tests of the matrix multiplication layer defined in GEMM.CC
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+// Element (i,j) of op(X) for a column major matrix with leading dimension ld
+cdouble op(const vector<cdouble>& x, bool trans, int i, int j, int ld) {
+  return trans ? x[j + i*ld] : x[i + j*ld];
+}
+
+// Multiply padded, rectangular matrices with all combinations of
+// transposition, using every available backend, with and without the SIMD
+// microkernels, and compare with a direct computation.
+TEST(Gemm, PaddedRectangularAllBackends) {
+  int m = 3, n = 4, k = 5;
+  int ld = 7; // Leading dimension larger than any matrix dimension
+
+  Backend def = getBackend();
+  SimdLevel level = getSimdLevel();
+  for (SimdLevel l : {SimdLevel::None, level})
+  for (Backend backend : {Backend::Armadillo, Backend::BLAS, Backend::Builtin}) {
+    setSimdLevel(l);
+    try {
+      setBackend(backend);
+    } catch (invalid_argument&) {
+      continue; // Backend not available in this build
+    }
+    for (int t = 0; t < 4; ++t) {
+      bool ta = t & 1;
+      bool tb = t & 2;
+      vector<cdouble> a(ld*7), b(ld*7), c(ld*n);
+      for (int i = 0; i < a.size(); ++i) {
+        a[i] = cdouble(i % 5 - 2, i % 3);
+        b[i] = cdouble(1 - i % 4, i % 7 - 3);
+      }
+      for (int i = 0; i < c.size(); ++i)
+        c[i] = cdouble(i, -1.0);
+      vector<cdouble> c0(c);
+
+      cdouble beta(0.5, -2.0);
+      gemm(ta, tb, m, n, k, a.data(), ld, b.data(), ld, beta, c.data(), ld);
+
+      for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < ld; ++i) {
+          cdouble ref = c0[i + j*ld];
+          if (i < m) {
+            ref *= beta;
+            for (int l = 0; l < k; ++l)
+              ref += op(a, ta, i, l, ld) * op(b, tb, l, j, ld);
+          }
+          // The padding must be left untouched
+          EXPECT_NEAR(ref.real(), c[i + j*ld].real(), 1.0e-12);
+          EXPECT_NEAR(ref.imag(), c[i + j*ld].imag(), 1.0e-12);
+        }
+      }
+    }
+  }
+  setBackend(def);
+  setSimdLevel(level);
+}
+
+// Multiply rectangular matrices without padding, which the Armadillo backend
+// writes straight into C, with and without a previous value of C.
+TEST(Gemm, UnpaddedRectangularAllBackends) {
+  int m = 3, n = 4, k = 5;
+
+  Backend def = getBackend();
+  SimdLevel level = getSimdLevel();
+  setSimdLevel(SimdLevel::None);
+  for (Backend backend : {Backend::Armadillo, Backend::BLAS, Backend::Builtin}) {
+    try {
+      setBackend(backend);
+    } catch (invalid_argument&) {
+      continue; // Backend not available in this build
+    }
+    for (cdouble beta : {cdouble(0.0), cdouble(0.5, -2.0)})
+    for (int t = 0; t < 4; ++t) {
+      bool ta = t & 1;
+      bool tb = t & 2;
+      vector<cdouble> a(m*k), b(k*n), c(m*n);
+      for (int i = 0; i < a.size(); ++i)
+        a[i] = cdouble(i % 5 - 2, i % 3);
+      for (int i = 0; i < b.size(); ++i)
+        b[i] = cdouble(1 - i % 4, i % 7 - 3);
+      for (int i = 0; i < c.size(); ++i)
+        c[i] = cdouble(i, -1.0);
+      vector<cdouble> c0(c);
+
+      gemm(ta, tb, m, n, k, a.data(), ta ? k : m, b.data(), tb ? n : k, beta,
+           c.data(), m);
+
+      for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < m; ++i) {
+          cdouble ref = beta * c0[i + j*m];
+          for (int l = 0; l < k; ++l)
+            ref += op(a, ta, i, l, ta ? k : m) * op(b, tb, l, j, tb ? n : k);
+          EXPECT_NEAR(ref.real(), c[i + j*m].real(), 1.0e-12);
+          EXPECT_NEAR(ref.imag(), c[i + j*m].imag(), 1.0e-12);
+        }
+      }
+    }
+  }
+  setBackend(def);
+  setSimdLevel(level);
+}
+
+// The planar product of padded, rectangular matrices, with both methods and
+// every backend, with and without the SIMD microkernels. The larger matrices
+// have partial register blocks and more than one packed piece of op(A).
+TEST(Gemm, PlanarAllBackends) {
+  Backend def = getBackend();
+  SimdLevel level = getSimdLevel();
+  for (SimdLevel lev : {SimdLevel::None, SimdLevel::AVX2, level})
+  for (Backend backend : {Backend::Armadillo, Backend::BLAS, Backend::Builtin})
+  for (vector<int> dims : {vector<int>{3,4,5}, vector<int>{37,19,300}}) {
+    setSimdLevel(lev);
+    try {
+      setBackend(backend);
+    } catch (invalid_argument&) {
+      continue;
+    }
+    int m = dims[0], n = dims[1], k = dims[2];
+    int ld = k + 2; // Leading dimension larger than any matrix dimension
+    for (int t = 0; t < 4; ++t) {
+      bool ta = t & 1;
+      bool tb = t & 2;
+      vector<cdouble> a(ld*k), b(ld*k);
+      vector<double> ar(ld*k), ai(ld*k), br(ld*k), bi(ld*k);
+      for (int i = 0; i < a.size(); ++i) {
+        a[i] = cdouble(i % 5 - 2, i % 3);
+        b[i] = cdouble(1 - i % 4, i % 7 - 3);
+      }
+      split(a.size(), a.data(), ar.data(), ai.data());
+      split(b.size(), b.data(), br.data(), bi.data());
+      for (bool gauss : {false, true}) {
+        vector<double> cr(ld*n, -1.0), ci(ld*n, -1.0);
+        vector<double> sa(m*k), sb(k*n);
+
+        if (gauss)
+          gemm3M(ta, tb, m, n, k, ar.data(), ai.data(), ld, br.data(),
+                 bi.data(), ld, cr.data(), ci.data(), ld, sa.data(),
+                 sb.data());
+        else
+          gemmPlanar(ta, tb, m, n, k, ar.data(), ai.data(), ld, br.data(),
+                     bi.data(), ld, cr.data(), ci.data(), ld);
+
+        for (int j = 0; j < n; ++j) {
+          for (int i = 0; i < ld; ++i) {
+            cdouble ref(-1.0, -1.0);
+            if (i < m) {
+              ref = 0.0;
+              for (int l = 0; l < k; ++l)
+                ref += op(a, ta, i, l, ld) * op(b, tb, l, j, ld);
+            }
+            // The padding must be left untouched
+            EXPECT_NEAR(ref.real(), cr[i + j*ld], 1.0e-9);
+            EXPECT_NEAR(ref.imag(), ci[i + j*ld], 1.0e-9);
+          }
+        }
+      }
+    }
+  }
+  setBackend(def);
+  setSimdLevel(level);
+}
+
+TEST(Gemm, TraceOfProduct) {
+  int n = 4, ld = 6;
+  vector<cdouble> a(ld*n), b(ld*n);
+  for (int i = 0; i < a.size(); ++i) {
+    a[i] = cdouble(i % 5 - 2, i % 3);
+    b[i] = cdouble(1 - i % 4, i % 7 - 3);
+  }
+  for (int t = 0; t < 4; ++t) {
+    bool ta = t & 1;
+    bool tb = t & 2;
+    cdouble ref = 0.0;
+    for (int i = 0; i < n; ++i)
+      for (int l = 0; l < n; ++l)
+        ref += op(a, ta, i, l, ld) * op(b, tb, l, i, ld);
+    cdouble res = gemmTrace(ta, tb, n, a.data(), ld, b.data(), ld);
+    EXPECT_NEAR(ref.real(), res.real(), 1.0e-12);
+    EXPECT_NEAR(ref.imag(), res.imag(), 1.0e-12);
+  }
+}
+
+// Run the SIMD microkernels of every level available on this machine, on
+// sizes which leave partial registers and blocks, and compare with a direct
+// computation.
+TEST(Gemm, SimdKernels) {
+  SimdLevel def = getSimdLevel();
+  for (SimdLevel level : {SimdLevel::AVX2, SimdLevel::AVX512}) {
+    setSimdLevel(level);
+    if (getSimdLevel() != level)
+      continue; // Not supported
+    int ld = 13;
+    vector<cdouble> a(ld*ld), b(ld*ld);
+    for (int i = 0; i < a.size(); ++i) {
+      a[i] = cdouble(i % 5 - 2, i % 3);
+      b[i] = cdouble(1 - i % 4, i % 7 - 3);
+    }
+    for (int m : {1, 3, 8, 11}) {
+      for (int n : {1, 2, 5, 9}) {
+        for (int k : {0, 1, 7, 12}) {
+          for (int t = 0; t < 8; ++t) {
+            bool ta = t & 1;
+            bool tb = t & 2;
+            cdouble beta = (t & 4 ? cdouble(0.5, -2.0) : 0.0);
+            vector<cdouble> c(ld*n);
+            for (int i = 0; i < c.size(); ++i)
+              c[i] = cdouble(i, -1.0);
+            vector<cdouble> c0(c);
+            gemmSimd(ta, tb, m, n, k, a.data(), ld, b.data(), ld, beta,
+                     c.data(), ld);
+            for (int j = 0; j < n; ++j) {
+              for (int i = 0; i < ld; ++i) {
+                cdouble ref = c0[i + j*ld];
+                if (i < m) {
+                  ref *= beta;
+                  for (int l = 0; l < k; ++l)
+                    ref += op(a, ta, i, l, ld) * op(b, tb, l, j, ld);
+                }
+                EXPECT_NEAR(ref.real(), c[i + j*ld].real(), 1.0e-12);
+                EXPECT_NEAR(ref.imag(), c[i + j*ld].imag(), 1.0e-12);
+              }
+            }
+          }
+        }
+      }
+    }
+
+    // Dot products, contiguous and strided
+    for (int n : {0, 1, 3, 8, 13}) {
+      for (int inc : {1, 3}) {
+        cdouble ref = 0.0;
+        for (int i = 0; i < n; ++i)
+          ref += a[i] * b[i*inc];
+        cdouble res = dot(n, a.data(), b.data(), inc);
+        EXPECT_NEAR(ref.real(), res.real(), 1.0e-12);
+        EXPECT_NEAR(ref.imag(), res.imag(), 1.0e-12);
+      }
+    }
+  }
+  setSimdLevel(def);
+}
+
+TEST(Gemm, SimdLevelSetting) {
+  SimdLevel def = getSimdLevel();
+  setSimdLevel(SimdLevel::None);
+  EXPECT_EQ(SimdLevel::None, getSimdLevel());
+  EXPECT_EQ(SimdLevel::None, setSimdLevel(SimdLevel::AVX512));
+  EXPECT_LE(getSimdLevel(), SimdLevel::AVX512);
+  setSimdLevel(def);
+  EXPECT_EQ(def, getSimdLevel());
+}
+
+TEST(Gemm, BackendSetting) {
+  Backend def = getBackend();
+  setBackend(Backend::Builtin);
+  EXPECT_EQ(Backend::Builtin, getBackend());
+  setBackend(Backend::Armadillo);
+  EXPECT_EQ(Backend::Armadillo, getBackend());
+  setBackend(def);
+}
+
+}
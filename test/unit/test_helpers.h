@@ -0,0 +1,70 @@
+#ifndef PICHI_TEST_HELPERS_H
+#define PICHI_TEST_HELPERS_H
+
+#include "pichi/tensor.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+/*
+ * Helpers shared by the unit tests, for making tensors with reproducible
+ * values and comparing them
+ */
+
+namespace pichi {
+
+// Fill a tensor with reproducible, non-symmetric values
+inline void fill(Tensor& t, int seed) {
+  cdouble* data = t.getData();
+  long long total = 1;
+  for (int i = 0; i < t.getRank(); ++i)
+    total *= t.getSize();
+  for (long long i = 0; i < total; ++i)
+    data[i] = cdouble((i*7 + seed) % 11 - 5, (i*3 + 2*seed) % 7 - 3);
+}
+
+// A tensor with default storage and reproducible, non-symmetric values
+inline Tensor filled(int rank, int size, int seed) {
+  Tensor t(rank, size);
+  fill(t, seed);
+  return t;
+}
+
+// Get a single element of a tensor, independently of its storage and
+// format. Neither a pending storage change nor the format is changed.
+inline cdouble element(const Tensor& t, const std::vector<int>& index) {
+  std::vector<int> layout;
+  const double* planes = (t.isPlanar() ? t.getPlanarData(layout) : nullptr);
+  const cdouble* data = (t.isPlanar() ? nullptr : t.getData(layout));
+  long long os = 0;
+  long long mult = 1;
+  for (int i = 0; i < t.getRank(); ++i) {
+    os += mult*index[layout[i]];
+    mult *= t.getSize();
+  }
+  return (planes ? cdouble(planes[os], planes[mult + os]) : data[os]);
+}
+
+// Compare all elements of two tensors of equal rank and size
+inline void expectEqual(const Tensor& t1, const Tensor& t2) {
+  ASSERT_EQ(t1.getRank(), t2.getRank());
+  ASSERT_EQ(t1.getSize(), t2.getSize());
+  std::vector<int> index(t1.getRank(), 0);
+  bool flag = true;
+  while (flag) {
+    cdouble x1 = element(t1, index);
+    cdouble x2 = element(t2, index);
+    EXPECT_NEAR(x1.real(), x2.real(), 1.0e-10);
+    EXPECT_NEAR(x1.imag(), x2.imag(), 1.0e-10);
+    flag = false;
+    for (int i = 0; i < t1.getRank() && !flag; ++i) {
+      if (++index[i] == t1.getSize())
+        index[i] = 0;
+      else
+        flag = true;
+    }
+  }
+}
+
+}
+
+#endif //PICHI_TEST_HELPERS_H
@@ -0,0 +1,318 @@
+#include "pichi/pichi.h"
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+
+/*
+ * Unit tests of the ContractionPlan class defined in PLAN.CC
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+cdouble value(const Tensor& t) {
+  cdouble r[1];
+  t.getSlice({0}, r);
+  return r[0];
+}
+
+void expectNear(cdouble x, cdouble y) {
+  EXPECT_NEAR(x.real(), y.real(), 1e-9 * abs(x));
+  EXPECT_NEAR(x.imag(), y.imag(), 1e-9 * abs(x));
+}
+
+TEST(ContractionPlan, RepeatedExecution) {
+  Graph graph("0abc1abd2def3cef");
+  ContractionPlan plan(graph, {3,3,3,3}, 5);
+
+  // Execute the same plan for several sets of tensors, comparing to a
+  // direct contraction.
+  for (int seed = 0; seed < 3; ++seed) {
+    vector<Tensor> tensors;
+    for (int i = 0; i < 4; ++i)
+      tensors.push_back(filled(3, 5, 4*seed + i));
+    vector<Tensor> copies(tensors);
+
+    Tensor res1, res2;
+    plan.execute(tensors, res1);
+    contract(graph, copies, res2);
+    expectNear(value(res2), value(res1));
+  }
+}
+
+TEST(ContractionPlan, PlanFromTensors) {
+  vector<Tensor> tensors;
+  tensors.push_back(filled(2, 4, 1));
+  tensors.push_back(filled(3, 4, 2));
+  tensors.push_back(filled(3, 4, 3));
+  Graph graph("0ab1acd2cdb");
+  ContractionPlan plan(graph, tensors);
+
+  vector<Tensor> copies(tensors);
+  Tensor res1, res2;
+  plan.execute(tensors, res1);
+  contract(graph, copies, res2);
+  expectNear(value(res2), value(res1));
+}
+
+TEST(ContractionPlan, DifferentStorage) {
+  // Tensors with another storage than planned for give the same result
+  Graph graph("0abc1abd2cd");
+  ContractionPlan plan(graph, {3,3,2}, 4);
+
+  vector<Tensor> tensors;
+  tensors.push_back(filled(3, 4, 1));
+  tensors.push_back(filled(3, 4, 2));
+  tensors.push_back(filled(2, 4, 3));
+  vector<Tensor> copies(tensors);
+  copies[0].setStorage({2,0,1});
+  copies[1].setStorage({1,2,0});
+
+  Tensor res1, res2;
+  plan.execute(tensors, res1);
+  plan.execute(copies, res2);
+  expectNear(value(res1), value(res2));
+}
+
+TEST(ContractionPlan, Information) {
+  Graph graph("0abc1abd2def3cef");
+  ContractionPlan plan(graph, {3,3,3,3}, 10);
+  EXPECT_EQ(3, plan.getSteps().size());
+  EXPECT_EQ(6, plan.getSteps().back().output);
+
+  ContractionCost cost = estimateCost(graph, 10);
+  EXPECT_EQ(cost.flops, plan.getCost().flops);
+  EXPECT_EQ(cost.memory, plan.getCost().memory);
+
+  // The intermediates are all the outputs of the steps
+  EXPECT_EQ((long long)cost.memory, plan.getWorkspaceSize());
+  EXPECT_LE(plan.getPeakMemory(), plan.getWorkspaceSize());
+}
+
+TEST(ContractionPlan, IntermediatesReleased) {
+  // Intermediates of a ring of matrices are released after their use, so
+  // never all of them are alive at the same time
+  Graph graph("0ab1bc2cd3de4ef5fa");
+  ContractionPlan plan(graph, {2,2,2,2,2,2}, 6);
+  EXPECT_EQ(5, plan.getSteps().size());
+  EXPECT_LT(plan.getPeakMemory(), plan.getWorkspaceSize());
+
+  vector<Tensor> tensors;
+  for (int i = 0; i < 6; ++i)
+    tensors.push_back(filled(2,6,i));
+  Tensor res, expected;
+  plan.execute(tensors, res);
+  contract(graph, tensors, expected);
+  expectNear(value(expected), value(res));
+
+  setThreads(3);
+  plan.execute(tensors, res);
+  setThreads(1);
+  expectNear(value(expected), value(res));
+}
+
+TEST(ContractionPlan, MemoryLimit) {
+  // Every pair of tensors shares one connection, so the first contraction
+  // makes a rank 4 tensor
+  Graph graph("0abc1ade2bdf3cef");
+  vector<Tensor> tensors;
+  for (int i = 0; i < 4; ++i)
+    tensors.push_back(filled(3,6,i));
+  Tensor expected;
+  contract(graph, tensors, expected);
+
+  ContractionPlan full(graph, tensors);
+  EXPECT_TRUE(full.getSlicedConnections().empty());
+
+  // Within the limit, no connections are sliced
+  setMemoryLimit(full.getPeakMemory());
+  EXPECT_TRUE(ContractionPlan(graph, tensors).getSlicedConnections().empty());
+
+  setMemoryLimit(full.getPeakMemory() / 2);
+  ContractionPlan plan(graph, tensors);
+  EXPECT_FALSE(plan.getSlicedConnections().empty());
+  EXPECT_GE(full.getPeakMemory() / 2, plan.getPeakMemory());
+  EXPECT_LT(full.getCost().flops, plan.getCost().flops);
+
+  Tensor res;
+  plan.execute(tensors, res);
+  expectNear(value(expected), value(res));
+
+  // Sliced tensors with a different storage
+  tensors[0].setStorage({2,0,1});
+  tensors[3].setStorage({1,2,0});
+  plan.execute(tensors, res);
+  expectNear(value(expected), value(res));
+
+  setThreads(3);
+  plan.execute(tensors, res);
+  setThreads(1);
+  expectNear(value(expected), value(res));
+
+  // The diagrams evaluated directly also use the limit
+  contract(graph, tensors, res);
+  expectNear(value(expected), value(res));
+
+  // Too small
+  setMemoryLimit(10);
+  EXPECT_THROW(ContractionPlan(graph, tensors), invalid_argument);
+  setMemoryLimit(0);
+
+  EXPECT_THROW(setMemoryLimit(-1), invalid_argument);
+}
+
+TEST(ContractionPlan, EngineChosenAtPlanning) {
+  Graph graph("0abc1abd2cd");
+  setEngine(Engine::Slice);
+  ContractionPlan plan(graph, {3,3,2}, 4);
+  setEngine(Engine::Auto);
+
+  vector<Tensor> tensors;
+  tensors.push_back(filled(3, 4, 1));
+  tensors.push_back(filled(3, 4, 2));
+  tensors.push_back(filled(2, 4, 3));
+  vector<Tensor> copies(tensors);
+
+  Tensor res1, res2;
+  plan.execute(tensors, res1);
+  contract(graph, copies, res2);
+  expectNear(value(res2), value(res1));
+}
+
+TEST(ContractionPlan, Description) {
+  setEngine(Engine::Slice);
+  ContractionPlan plan(Graph("0abc1abd2cd"), {3,3,2}, 4);
+  setEngine(Engine::Auto);
+
+  // One line per step, with the roles of the indices for the slice engine
+  EXPECT_EQ("3 = contract(0, 2, {(2,0)}) Slices: SC (2,0) | SF 1:0 2:1 | "
+            "NF 1:1\n"
+            "4 = contract(3, 1, {(0,0),(1,1),(2,2)}) Inner\n",
+            plan.toString());
+}
+
+TEST(ContractionPlan, MethodChosenAtPlanning) {
+  Graph graph("0abcd1abef2cdef");
+  setGemmMethod(GemmMethod::Gauss);
+  ContractionPlan gauss(graph, {4,4,4}, 4);
+  setGemmMethod(GemmMethod::Standard);
+  ContractionPlan standard(graph, {4,4,4}, 4);
+
+  EXPECT_EQ("3 = contract(0, 2, {(2,0),(3,1)}) TTGT 3M\n"
+            "4 = contract(3, 1, {(0,0),(1,1),(2,2),(3,3)}) Inner\n",
+            gauss.toString());
+  EXPECT_EQ("3 = contract(0, 2, {(2,0),(3,1)}) TTGT\n"
+            "4 = contract(3, 1, {(0,0),(1,1),(2,2),(3,3)}) Inner\n",
+            standard.toString());
+
+  vector<Tensor> tensors;
+  tensors.push_back(filled(4, 4, 1));
+  tensors.push_back(filled(4, 4, 2));
+  tensors.push_back(filled(4, 4, 3));
+  vector<Tensor> copies(tensors);
+
+  Tensor res1, res2;
+  gauss.execute(tensors, res1);
+  standard.execute(copies, res2);
+  expectNear(value(res2), value(res1));
+}
+
+TEST(ContractionPlan, Errors) {
+  Graph graph("0ab1ab");
+  // Rank does not match the graph
+  EXPECT_THROW(ContractionPlan(graph, {2,3}, 4), invalid_argument);
+  // Missing tensor
+  EXPECT_THROW(ContractionPlan(graph, {2}, 4), invalid_argument);
+
+  ContractionPlan plan(graph, {2,2}, 4);
+  Tensor out;
+  vector<Tensor> tensors = {Tensor(2,4), Tensor(2,5)};
+  EXPECT_THROW(plan.execute(tensors, out), invalid_argument);
+  tensors = {Tensor(2,4)};
+  EXPECT_THROW(plan.execute(tensors, out), invalid_argument);
+}
+
+TEST(ContractionBatch, SharedContractions) {
+  // Baryon-baryon-meson diagrams sharing the contraction A_abc B_abd
+  vector<int> ranks = {3,3,2,2,3,3};
+  vector<ContractionJob> jobs = {
+      {Graph("0abc1abd2cd"), {0,1,2}},
+      {Graph("0abc1abd2ce3de"), {0,1,2,3}},
+      {Graph("0abc1abd2def3cef"), {0,1,4,5}},
+      {Graph("0abd1abc2cd"), {1,0,3}}
+  };
+  ContractionBatch batch(jobs, ranks, 4);
+  EXPECT_LE(1, batch.countShared());
+
+  // Fewer contractions than when planning the jobs separately
+  int separate = 0;
+  for (const ContractionJob& job : jobs) {
+    vector<int> r;
+    for (int t : job.tensors)
+      r.push_back(ranks[t]);
+    separate += ContractionPlan(job.graph, r, 4).getSteps().size();
+  }
+  EXPECT_GT(separate, batch.getSteps().size());
+
+  vector<Tensor> tensors;
+  for (int i = 0; i < ranks.size(); ++i)
+    tensors.push_back(filled(ranks[i], 4, i));
+
+  vector<Tensor> out;
+  vector<Tensor> copies(tensors);
+  batch.execute(copies, out);
+  ASSERT_EQ(jobs.size(), out.size());
+
+  for (int j = 0; j < jobs.size(); ++j) {
+    vector<Tensor> inputs;
+    for (int t : jobs[j].tensors)
+      inputs.push_back(tensors[t]);
+    Tensor res;
+    contract(jobs[j].graph, inputs, res);
+    expectNear(value(res), value(out[j]));
+  }
+}
+
+TEST(ContractionBatch, IdenticalJobs) {
+  vector<ContractionJob> jobs = {
+      {Graph("0ab1bc2ca"), {0,1,2}},
+      {Graph("0ab1bc2ca"), {0,1,2}}
+  };
+  ContractionBatch batch(jobs, {2,2,2}, 5);
+  EXPECT_EQ(2, batch.getSteps().size());
+  EXPECT_EQ(2, batch.countShared());
+
+  vector<Tensor> tensors = {filled(2,5,0), filled(2,5,1), filled(2,5,2)};
+  vector<Tensor> out;
+  batch.execute(tensors, out);
+  ASSERT_EQ(2, out.size());
+  EXPECT_EQ(value(out[0]), value(out[1]));
+
+  // The steps are computed once for both jobs. The peak is reached by the
+  // last step, which holds the matrix of the first step and its own result.
+  vector<int> rank = {2,2,2};
+  vector<long long> elements;
+  for (const ContractionStep& step : batch.getSteps()) {
+    rank.resize(step.output + 1);
+    for (int i : step.inputs)
+      rank[step.output] += rank[i];
+    rank[step.output] -= 2*step.indices.size();
+    elements.push_back(1);
+    for (int i = 0; i < rank[step.output]; ++i)
+      elements.back() *= 5;
+  }
+  EXPECT_EQ(25, elements[0]);
+  EXPECT_EQ(elements[0] + elements[1], batch.getPeakMemory());
+}
+
+TEST(ContractionBatch, Errors) {
+  // Tensor index out of range
+  EXPECT_THROW(ContractionBatch({{Graph("0ab1ab"), {0,2}}}, {2,2}, 4),
+               invalid_argument);
+  // Rank does not match
+  EXPECT_THROW(ContractionBatch({{Graph("0ab1ab"), {0,1}}}, {2,3}, 4),
+               invalid_argument);
+}
+
+}
@@ -0,0 +1,339 @@
+#include "schedule.h"
+#include "thread_pool.h"
+#include "pichi/allocator.h"
+#include "pichi/contraction.h"
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+#include <map>
+#include <mutex>
+
+/*
+ * Unit tests of the scheduling functions defined in SCHEDULE.CC
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+// A square matrix with deterministic, non-symmetric entries
+Tensor matrix(int size, int seed) {
+  Tensor t(2, size);
+  vector<cdouble> data(size*size);
+  for (int i = 0; i < size*size; ++i)
+    data[i] = cdouble((i*7 + seed*13) % 11 - 5.0, (i*3 + seed) % 5 - 2.0);
+  t.setSlice({-1,-1}, data.data());
+  return t;
+}
+
+// Evaluates a closed diagram by summing over all values of all connections.
+// Only feasible for small sizes.
+cdouble bruteForce(const Graph& graph, const vector<Tensor>& tensors,
+                   int size) {
+
+  // Number the connections between the tensor indices
+  map<pair<int,int>, int> edge;
+  int ne = 0;
+  for (int node : graph.getNodes()) {
+    auto conn = graph.connections(node);
+    for (int i = 0; i < conn.size(); ++i) {
+      if (edge.count(conn[i]))
+        edge[make_pair(node, i)] = edge[conn[i]];
+      else
+        edge[make_pair(node, i)] = ne++;
+    }
+  }
+
+  cdouble res = 0.0;
+  vector<int> value(ne, 0);
+  bool flag = true;
+  while (flag) {
+    cdouble term = 1.0;
+    for (int node : graph.getNodes()) {
+      long long os = 0;
+      long long mult = 1;
+      for (int i = 0; i < tensors[node].getRank(); ++i) {
+        os += mult*value[edge[make_pair(node, i)]];
+        mult *= size;
+      }
+      term *= tensors[node].getData()[os];
+    }
+    res += term;
+    flag = false;
+    for (int i = 0; i < ne && !flag; ++i) {
+      if (++value[i] == size)
+        value[i] = 0;
+      else
+        flag = true;
+    }
+  }
+  return res;
+}
+
+// Compares contract(Graph) to the brute force evaluation
+void compareBruteForce(const string& diagram, const vector<int>& ranks,
+                       int size) {
+  vector<Tensor> tensors;
+  for (int i = 0; i < ranks.size(); ++i)
+    tensors.push_back(filled(ranks[i], size, i));
+  Graph graph(diagram);
+  cdouble expected = bruteForce(graph, tensors, size);
+
+  Tensor res;
+  contract(graph, tensors, res);
+  cdouble r[1];
+  res.getSlice({0}, r);
+  EXPECT_NEAR(expected.real(), r[0].real(), 1e-9 * abs(expected));
+  EXPECT_NEAR(expected.imag(), r[0].imag(), 1e-9 * abs(expected));
+}
+
+// tr(ABCD), evaluated as tr((AB)(CD)), where the two products are
+// independent steps.
+vector<ContractionStep> treeSchedule() {
+  return {
+      {{0,1}, {{1,0}}, 4},
+      {{2,3}, {{1,0}}, 5},
+      {{4,5}, {{0,1},{1,0}}, 6}
+  };
+}
+
+// Prepares and executes a schedule on tensors of a given size with default
+// storage
+void run(const vector<ContractionStep>& steps, vector<Tensor>& tensors,
+         Tensor& out) {
+  vector<vector<int>> storage;
+  for (const Tensor& t : tensors)
+    storage.push_back(t.getStorage());
+  auto setups = prepare(steps, storage, tensors[0].getSize(), Engine::Auto);
+  execute(steps, setups, planMemory(steps, setups, {steps.back().output}),
+          tensors, out);
+}
+
+// A chain of products of matrices, tr(A(B(C(DE)))). Each intermediate is a
+// matrix used by the next step only.
+vector<ContractionStep> chainSchedule() {
+  return {
+      {{3,4}, {{1,0}}, 5},
+      {{2,5}, {{1,0}}, 6},
+      {{1,6}, {{1,0}}, 7},
+      {{0,7}, {{0,1},{1,0}}, 8}
+  };
+}
+
+TEST(Schedule, SingleStep) {
+  auto steps = schedule(Graph("0ab1ab"), 2, 4);
+  ASSERT_EQ(1, steps.size());
+  EXPECT_EQ(vector<int>({0,1}), steps[0].inputs);
+  EXPECT_EQ(2, steps[0].output);
+  EXPECT_EQ(2, steps[0].indices.size());
+}
+
+TEST(Schedule, StepsNumberTemporaries) {
+  auto steps = schedule(Graph("4adc5aec7efg6fgd"), 9, 4);
+  ASSERT_EQ(3, steps.size());
+  for (int s = 0; s < 3; ++s)
+    EXPECT_EQ(9+s, steps[s].output);
+  EXPECT_EQ(11, steps.back().output);
+}
+
+TEST(Schedule, TracesFirst) {
+  auto steps = schedule(Graph("0aabc1bddc"), 2, 4);
+  ASSERT_EQ(3, steps.size());
+  EXPECT_EQ(vector<int>({0}), steps[0].inputs);
+  EXPECT_EQ(vector<int>({1}), steps[1].inputs);
+  EXPECT_EQ(vector<int>({2,3}), steps[2].inputs);
+}
+
+TEST(Schedule, InvalidDiagrams) {
+  // Open connection
+  EXPECT_THROW(schedule(Graph("0ab1a"), 2, 4), invalid_argument);
+  // Not connected
+  EXPECT_THROW(schedule(Graph("0ab1ab2cc"), 3, 4), invalid_argument);
+  // Node without a tensor
+  EXPECT_THROW(schedule(Graph("0ab1ab"), 1, 4), invalid_argument);
+  // A trace would leave a rank 1 tensor
+  EXPECT_THROW(schedule(Graph("0aab1bcc"), 2, 4), invalid_argument);
+}
+
+TEST(Schedule, BaryonBoxOrder) {
+  // A good order never creates a rank 4 tensor, which costs N^5 operations.
+  // Each of the three steps costs at most N^4 operations.
+  ContractionCost cost;
+  auto steps = schedule(Graph("0abc1abd2def3cef"), 4, 10, &cost);
+  ASSERT_EQ(3, steps.size());
+  EXPECT_GE(3e4, cost.flops);
+  EXPECT_GE(2e3, cost.memory);
+
+  ContractionCost estimate = estimateCost(Graph("0abc1abd2def3cef"), 10);
+  EXPECT_EQ(cost.flops, estimate.flops);
+  EXPECT_EQ(cost.memory, estimate.memory);
+  EXPECT_EQ(cost.moves, estimate.moves);
+}
+
+TEST(Schedule, GeneralDiagrams) {
+  // Meson pentagon
+  compareBruteForce("0ae1ab2bc3cd4de", {2,2,2,2,2}, 3);
+  // Pentaquark-style rank 5 tensors
+  compareBruteForce("0abcde1abcfg2defhi3ghi", {5,5,5,3}, 2);
+  compareBruteForce("0abccd1abefg2defghh", {5,5,6}, 2);
+  // Six tensors
+  compareBruteForce("0abc1abd2cef3dgh4egi5fhi", {3,3,3,3,3,3}, 3);
+}
+
+TEST(Schedule, ParallelTreeMatchesSerial) {
+  vector<Tensor> tensors;
+  for (int i = 0; i < 4; ++i)
+    tensors.push_back(matrix(20, i));
+
+  Tensor serial;
+  vector<Tensor> copies(tensors);
+  run(treeSchedule(), copies, serial);
+
+  setThreads(4);
+  Tensor parallel;
+  copies = tensors;
+  run(treeSchedule(), copies, parallel);
+  setThreads(1);
+
+  cdouble r1[1], r2[1];
+  serial.getSlice({0}, r1);
+  parallel.getSlice({0}, r2);
+  EXPECT_NEAR(0.0, abs(r1[0] - r2[0]), 1e-9 * abs(r1[0]));
+}
+
+TEST(Schedule, ParallelErrorIsRethrown) {
+  vector<Tensor> tensors;
+  for (int i = 0; i < 4; ++i)
+    tensors.push_back(matrix(4, i));
+  auto steps = treeSchedule();
+  auto setups = prepare(steps, vector<vector<int>>(4, {0,1}), 4, Engine::Auto);
+  tensors[2] = Tensor(3,4); // Does not match the prepared layout
+
+  setThreads(4);
+  Tensor out;
+  EXPECT_THROW(execute(steps, setups, planMemory(steps, setups, {6}), tensors,
+                       out), invalid_argument);
+  setThreads(1);
+}
+
+// Allocator which starts a parallel loop whenever an array is allocated,
+// and records whether the loop was split into chunks. This shows whether
+// parallel work within the step allocating the array is split between
+// threads.
+class SplitProbe : public TensorAllocator {
+
+public:
+
+  cdouble* allocate(long long n) override {
+    bool split = false;
+    parallelFor(8, [&](long long begin, long long end) {
+      if (end - begin < 8)
+        split = true;
+    });
+    lock_guard<mutex> lock(mtx);
+    splits.push_back(split);
+    return new cdouble[n];
+  }
+
+  void deallocate(cdouble* data, long long) override {
+    delete[] data;
+  }
+
+  vector<bool> splits;
+  mutex mtx;
+
+};
+
+TEST(Schedule, LastStepUsesAllThreads) {
+  // The box diagram cut open between D and A, (AB)(CD), such that the last
+  // step has an array to allocate. The two products AB and CD may run in
+  // parallel, each on a single thread. The last step runs alone, with all
+  // threads.
+  vector<Tensor> tensors;
+  for (int i = 0; i < 4; ++i)
+    tensors.push_back(matrix(6, i));
+  vector<ContractionStep> steps = {
+      {{0,1}, {{1,0}}, 4},
+      {{2,3}, {{1,0}}, 5},
+      {{4,5}, {{1,0}}, 6}
+  };
+  auto setups = prepare(steps, vector<vector<int>>(4, {0,1}), 6, Engine::Auto);
+
+  setThreads(4);
+  SplitProbe probe;
+  Tensor out;
+  execute(steps, setups, planMemory(steps, setups, {6}), tensors, out,
+          nullptr, &probe);
+  setThreads(1);
+
+  ASSERT_EQ(3, probe.splits.size());
+  EXPECT_TRUE(probe.splits[2]);
+}
+
+TEST(Schedule, MemoryPlanChain) {
+  auto steps = chainSchedule();
+  auto setups = prepare(steps, vector<vector<int>>(5, {0,1}), 10,
+                        Engine::Auto);
+  MemoryPlan memory = planMemory(steps, setups, {8});
+
+  // At most two matrices are alive at any time, and the second one can take
+  // over the first one's data array two steps later.
+  EXPECT_EQ(200, memory.peak);
+  EXPECT_EQ(vector<int>({-1,-1,5,-1}), memory.recycle);
+  EXPECT_EQ(vector<vector<int>>({{},{},{6},{7}}), memory.release);
+
+  // Keeping an intermediate prevents its release
+  memory = planMemory(steps, setups, {6,8});
+  EXPECT_EQ(201, memory.peak);
+  EXPECT_EQ(vector<int>({-1,-1,5,-1}), memory.recycle);
+  EXPECT_EQ(vector<vector<int>>({{},{},{},{7}}), memory.release);
+}
+
+TEST(Schedule, RecycledMatchesSerial) {
+  vector<Tensor> tensors;
+  for (int i = 0; i < 5; ++i)
+    tensors.push_back(matrix(8, i));
+
+  Tensor res;
+  vector<Tensor> copies(tensors);
+  run(chainSchedule(), copies, res);
+
+  // Direct evaluation, one matrix product at a time
+  Tensor t = tensors[4];
+  for (int i = 3; i >= 0; --i) {
+    Tensor next;
+    contract(tensors[i], t, {{1,0}}, next);
+    t = next;
+  }
+  Tensor expected;
+  contract(t, {{0,1}}, expected);
+
+  cdouble r1[1], r2[1];
+  res.getSlice({0}, r1);
+  expected.getSlice({0}, r2);
+  EXPECT_NEAR(0.0, abs(r1[0] - r2[0]), 1e-9 * abs(r2[0]));
+}
+
+TEST(Schedule, DiagramWithThreads) {
+  vector<Tensor> tensors;
+  for (int i = 0; i < 4; ++i)
+    tensors.push_back(matrix(6, i));
+  Graph graph("0ab1bc2cd3da");
+
+  Tensor serial;
+  vector<Tensor> copies(tensors);
+  contract(graph, copies, serial);
+
+  setThreads(4);
+  Tensor parallel;
+  copies = tensors;
+  contract(graph, copies, parallel);
+  setThreads(1);
+
+  cdouble r1[1], r2[1];
+  serial.getSlice({0}, r1);
+  parallel.getSlice({0}, r2);
+  EXPECT_NEAR(0.0, abs(r1[0] - r2[0]), 1e-9 * abs(r1[0]));
+}
+
+}
@@ -230,4 +230,44 @@ TEST(TensorGetSetSlice, SetSliceErrorOnWrongNumberOfEntries) {
   EXPECT_THROW(t.setSlice({-1,-1,0,1}, data), invalid_argument);
 }
 
+
+TEST(TensorGetSetSlice, UnalignedSlicesOfLargeTensor) {
+  // Size above the tile size of the gather kernel, with running indices in
+  // every position of the storage
+  int n = 37;
+  Tensor t(3,n,{1,2,0});
+  for (long long i = 0; i < n*n*n; ++i)
+    t.getData()[i] = cdouble(i, 0);
+  vector<cdouble> data(n*n);
+
+  // Index (i,j,k) is stored at j + n*k + n*n*i
+  EXPECT_FALSE(t.getSlice({5,-1,-1}, data.data()));
+  for (int j = 0; j < n; ++j) {
+    for (int k = 0; k < n; ++k)
+      ASSERT_EQ(cdouble(j + n*k + n*n*5, 0), data[j + n*k]);
+  }
+  EXPECT_FALSE(t.getSlice({-1,3,-1}, data.data()));
+  for (int i = 0; i < n; ++i) {
+    for (int k = 0; k < n; ++k)
+      ASSERT_EQ(cdouble(3 + n*k + n*n*i, 0), data[i + n*k]);
+  }
+
+  // Write a slice and read it back
+  for (int x = 0; x < n*n; ++x)
+    data[x] = cdouble(-x, 1);
+  t.setSlice({-1,-1,7}, data.data());
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j)
+      ASSERT_EQ(cdouble(-(i + n*j), 1), t.getData()[j + n*7 + n*n*i]);
+  }
+  t.setSlice({-1,-1,8}, data.data(), true);
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j)
+      ASSERT_EQ(cdouble(-(j + n*i), 1), t.getData()[j + n*8 + n*n*i]);
+  }
+  vector<cdouble> back(n*n);
+  EXPECT_FALSE(t.getSlice({-1,-1,7}, back.data()));
+  EXPECT_EQ(data, back);
+}
+
 }
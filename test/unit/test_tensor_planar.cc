@@ -0,0 +1,306 @@
+#include "gtest/gtest.h"
+#include "pichi/tensor.h"
+#include "pichi/contraction.h"
+#include "pichi/plan.h"
+#include "test_helpers.h"
+
+/*
+ * Unit tests of the planar format of the tensor class, implemented in
+ * TENSOR.CC, and of the contractions of planar tensors
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+TEST(TensorPlanar, DefaultIsInterleaved) {
+  Tensor s;
+  Tensor t(3,4);
+  EXPECT_FALSE(s.isPlanar());
+  EXPECT_FALSE(t.isPlanar());
+}
+
+TEST(TensorPlanar, ConvertFormat) {
+  Tensor t(3,4,{1,2,0});
+  fill(t, 1);
+  Tensor ref(t);
+
+  t.setPlanar(true);
+  EXPECT_TRUE(t.isPlanar());
+  const double* p = t.getPlanarData();
+  for (int i = 0; i < 64; ++i) {
+    EXPECT_EQ(ref.getData()[i].real(), p[i]);
+    EXPECT_EQ(ref.getData()[i].imag(), p[64 + i]);
+  }
+
+  // The interleaved data is given back in the interleaved format
+  const cdouble* d = t.getData();
+  EXPECT_FALSE(t.isPlanar());
+  for (int i = 0; i < 64; ++i)
+    EXPECT_EQ(ref.getData()[i], d[i]);
+}
+
+TEST(TensorPlanar, Scalar) {
+  Tensor s;
+  cdouble x(2.0, -3.0);
+  s.setSlice({}, &x);
+  s.setPlanar(true);
+  EXPECT_EQ(2.0, s.getPlanarData()[0]);
+  EXPECT_EQ(-3.0, s.getPlanarData()[1]);
+  cdouble y;
+  s.getSlice({}, &y);
+  EXPECT_EQ(x, y);
+}
+
+TEST(TensorPlanar, ConstAccessChangesNothing) {
+  Tensor t(3,4);
+  fill(t, 9);
+  Tensor ref(t);
+  t.setPlanar(true);
+  t.setStorage({2,0,1});
+
+  // The const accessors give the array as it is laid out, or throw
+  const Tensor& c = t;
+  vector<int> layout;
+  EXPECT_THROW(c.getData(), invalid_argument);
+  EXPECT_THROW(c.getData(layout), invalid_argument);
+  EXPECT_THROW(c.getPlanarData(), invalid_argument);
+  const double* p = c.getPlanarData(layout);
+  EXPECT_EQ(vector<int>({0,1,2}), layout);
+  for (int i = 0; i < 64; ++i) {
+    EXPECT_EQ(ref.getData()[i].real(), p[i]);
+    EXPECT_EQ(ref.getData()[i].imag(), p[64 + i]);
+  }
+  EXPECT_TRUE(t.isPlanar());
+  EXPECT_TRUE(t.hasPendingStorage());
+
+  // The same for the interleaved format
+  t.setPlanar(false);
+  EXPECT_THROW(c.getData(), invalid_argument);
+  EXPECT_THROW(c.getPlanarData(layout), invalid_argument);
+  const cdouble* d = c.getData(layout);
+  EXPECT_EQ(vector<int>({0,1,2}), layout);
+  for (int i = 0; i < 64; ++i)
+    EXPECT_EQ(ref.getData()[i], d[i]);
+  EXPECT_TRUE(t.hasPendingStorage());
+  t.applyStorage();
+  expectEqual(ref, c);
+}
+
+TEST(TensorPlanar, SlicesAreInterleaved) {
+  Tensor ref(3,4,{2,0,1});
+  Tensor t(3,4,{2,0,1});
+  t.setPlanar(true);
+
+  // Write aligned, transposed and strided slices
+  vector<vector<int>> slices = {{-1,3,-1}, {-1,-1,1}, {2,-1,-1}};
+  vector<cdouble> data(16);
+  for (int s = 0; s < slices.size(); ++s) {
+    for (int i = 0; i < 16; ++i)
+      data[i] = cdouble(i + s, 2*s - i);
+    ref.setSlice(slices[s], data.data(), s == 2);
+    t.setSlice(slices[s], data.data(), s == 2);
+  }
+  EXPECT_TRUE(t.isPlanar());
+  expectEqual(ref, t);
+  EXPECT_TRUE(t.isPlanar());
+}
+
+TEST(TensorPlanar, StorageChange) {
+  Tensor ref(3,5);
+  fill(ref, 2);
+  Tensor t(ref);
+  t.setPlanar(true);
+
+  ref.setStorage({1,2,0});
+  t.setStorage({1,2,0});
+  const double* p = t.getPlanarData();
+  const cdouble* d = ref.getData();
+  for (int i = 0; i < 125; ++i) {
+    EXPECT_EQ(d[i].real(), p[i]);
+    EXPECT_EQ(d[i].imag(), p[125 + i]);
+  }
+  expectEqual(ref, t);
+}
+
+TEST(TensorPlanar, CopyMoveAndResize) {
+  Tensor t(3,4);
+  fill(t, 3);
+  Tensor ref(t);
+  t.setPlanar(true);
+
+  Tensor copy(t);
+  EXPECT_TRUE(copy.isPlanar());
+  expectEqual(ref, copy);
+  Tensor moved(move(copy));
+  EXPECT_TRUE(moved.isPlanar());
+  expectEqual(ref, moved);
+
+  // Resizing gives a cleared tensor in the chosen format
+  moved.resize(3, 4);
+  EXPECT_FALSE(moved.isPlanar());
+  moved.resize(3, 4, {0,1,2}, true, true);
+  EXPECT_TRUE(moved.isPlanar());
+  for (int i = 0; i < 128; ++i)
+    EXPECT_EQ(0.0, moved.getPlanarData()[i]);
+}
+
+TEST(TensorPlanar, Algebra) {
+  Tensor a(3,4), b(3,4,{2,1,0});
+  fill(a, 4);
+  fill(b, 5);
+  Tensor ref = (a + b) * cdouble(0.5, -2.0);
+  ref.conj();
+
+  // Both formats and mixed formats
+  for (int f = 0; f < 4; ++f) {
+    Tensor x(a), y(b);
+    x.setPlanar(f & 1);
+    y.setPlanar(f & 2);
+    x += y;
+    x *= cdouble(0.5, -2.0);
+    x.conj();
+    EXPECT_EQ(bool(f & 1), x.isPlanar());
+    expectEqual(ref, x);
+  }
+}
+
+TEST(TensorPlanar, Contractions) {
+  Tensor a(3,6,{1,0,2}), b(3,6), c(4,6);
+  fill(a, 6);
+  fill(b, 7);
+  fill(c, 8);
+  vector<vector<pair<int,int>>> idx = {{{1,2}}, {{0,1},{2,0}}};
+
+  for (const vector<pair<int,int>>& id : idx) {
+    Tensor ref;
+    Tensor a0(a), c0(c);
+    contract(a0, c0, id, ref);
+
+    // Planar tensors give a planar result
+    Tensor ap(a), cp(c);
+    ap.setPlanar(true);
+    cp.setPlanar(true);
+    Tensor res;
+    contract(ap, cp, id, res);
+    EXPECT_TRUE(res.isPlanar());
+    ASSERT_EQ(ref.getRank(), res.getRank());
+    long long total = 1;
+    for (int i = 0; i < ref.getRank(); ++i)
+      total *= 6;
+    vector<int> store = ref.getStorage();
+    res.setStorage(store);
+    const cdouble* r = ref.getData();
+    const double* p = res.getPlanarData();
+    for (long long i = 0; i < total; ++i) {
+      EXPECT_NEAR(r[i].real(), p[i], 1e-10);
+      EXPECT_NEAR(r[i].imag(), p[total + i], 1e-10);
+    }
+
+    // Mixed formats are contracted in the interleaved format
+    Tensor am(a), cm(c);
+    am.setPlanar(true);
+    contract(am, cm, id, res);
+    EXPECT_FALSE(res.isPlanar());
+    res.setStorage(store);
+    for (long long i = 0; i < total; ++i)
+      EXPECT_NEAR(0.0, abs(r[i] - res.getData()[i]), 1e-10);
+  }
+
+  // Complete contraction
+  Tensor ref;
+  Tensor a0(a), b0(b);
+  contract(a0, b0, {{0,2},{1,0},{2,1}}, ref);
+  a.setPlanar(true);
+  b.setPlanar(true);
+  Tensor res;
+  contract(a, b, {{0,2},{1,0},{2,1}}, res);
+  EXPECT_NEAR(0.0, abs(ref.getData()[0] - res.getData()[0]), 1e-10);
+}
+
+TEST(TensorPlanar, Plans) {
+  // A box of single index contractions, which the Auto engine does with the
+  // slice engine for interleaved tensors
+  Graph graph("0ab1bc2cd3da");
+  vector<Tensor> tensors;
+  for (int i = 0; i < 4; ++i)
+    tensors.push_back(filled(2, 5, i));
+  Tensor ref;
+  vector<Tensor> copies(tensors);
+  contract(graph, copies, ref);
+  EXPECT_NE(string::npos, ContractionPlan(graph, tensors).toString()
+                              .find("Slices"));
+
+  vector<Tensor> planar(tensors);
+  for (Tensor& t : planar)
+    t.setPlanar(true);
+
+  // Plans made for planar tensors keep them planar
+  ContractionPlan plan(graph, planar);
+  EXPECT_EQ(string::npos, plan.toString().find("Slices"));
+  EXPECT_EQ(plan.toString(), ContractionPlan(graph, {2,2,2,2}, 5, true)
+                                 .toString());
+  Tensor res;
+  plan.execute(planar, res);
+  EXPECT_NEAR(0.0, abs(ref.getData()[0] - res.getData()[0]), 1e-9);
+  for (const Tensor& t : planar)
+    EXPECT_TRUE(t.isPlanar());
+
+  // The same for diagrams and batches
+  copies = planar;
+  contract(graph, copies, res);
+  EXPECT_NEAR(0.0, abs(ref.getData()[0] - res.getData()[0]), 1e-9);
+  for (const Tensor& t : copies)
+    EXPECT_TRUE(t.isPlanar());
+
+  ContractionBatch batch({{graph, {0,1,2,3}}}, {2,2,2,2}, 5, true);
+  EXPECT_EQ(string::npos, batch.toString().find("Slices"));
+  vector<Tensor> out;
+  batch.execute(planar, out);
+  EXPECT_NEAR(0.0, abs(ref.getData()[0] - out[0].getData()[0]), 1e-9);
+  for (const Tensor& t : planar)
+    EXPECT_TRUE(t.isPlanar());
+}
+
+TEST(TensorPlanar, InputsKeepTheirFormat) {
+  // The strided engine reads the inputs as they are
+  Tensor a(3,6,{1,0,2}), c(4,6);
+  fill(a, 6);
+  fill(c, 8);
+  Tensor ref;
+  Tensor a0(a), c0(c);
+  contract(a0, c0, {{1,2}}, ref);
+  a.setPlanar(true);
+  c.setPlanar(true);
+  setEngine(Engine::Strided);
+  Tensor res;
+  contract(a, c, {{1,2}}, res);
+  setEngine(Engine::Auto);
+  EXPECT_TRUE(a.isPlanar());
+  EXPECT_TRUE(c.isPlanar());
+  expectEqual(ref, res);
+
+  // Sliced plans cut planar tensors into planar parts, without converting
+  // them
+  Graph graph("0abc1ade2bdf3cef");
+  vector<Tensor> tensors;
+  for (int i = 0; i < 4; ++i)
+    tensors.push_back(filled(3,6,i));
+  Tensor expected;
+  vector<Tensor> copies(tensors);
+  contract(graph, copies, expected);
+  for (Tensor& t : tensors)
+    t.setPlanar(true);
+  setMemoryLimit(ContractionPlan(graph, tensors).getPeakMemory() / 2);
+  ContractionPlan plan(graph, tensors);
+  setMemoryLimit(0);
+  EXPECT_FALSE(plan.getSlicedConnections().empty());
+  plan.execute(tensors, res);
+  EXPECT_NEAR(0.0, abs(expected.getData()[0] - res.getData()[0]),
+              1e-9 * abs(expected.getData()[0]));
+  for (const Tensor& t : tensors)
+    EXPECT_TRUE(t.isPlanar());
+}
+
+}
@@ -1,5 +1,7 @@
 #include "gtest/gtest.h"
 #include "pichi/tensor.h"
+#include "pichi/contraction.h"
+#include <algorithm>
 
 /*
  * Unit tests of the data storage in the tensor class, implemented in TENSOR.CC
@@ -89,6 +91,123 @@ TEST(TensorStorage, ErrorOnInvalidIndex) {
   EXPECT_THROW(t.setStorage({1,3,0}), invalid_argument);
 }
 
+// Changes the storage of a tensor with known values to every permutation
+// and checks all elements through the layout of the data array
+void checkAllStorages(int rank, int size) {
+  vector<int> store(rank);
+  for (int i = 0; i < rank; ++i)
+    store[i] = i;
+
+  long long total = 1;
+  for (int i = 0; i < rank; ++i)
+    total *= size;
+  Tensor t(rank, size);
+  for (long long i = 0; i < total; ++i)
+    t.getData()[i] = cdouble(i, -i);
+
+  do {
+    Tensor c(t);
+    c.setStorage(store);
+    vector<int> index(rank, 0);
+    for (long long i = 0; i < total; ++i) {
+      // Element i of the data array, in the new storage
+      long long k = i;
+      for (int d = 0; d < rank; ++d) {
+        index[store[d]] = k % size;
+        k /= size;
+      }
+      // Its position in the default storage
+      long long os = 0;
+      for (int d = rank-1; d >= 0; --d)
+        os = os*size + index[d];
+      ASSERT_EQ(cdouble(os, -os), c.getData()[i]);
+    }
+  } while (next_permutation(store.begin(), store.end()));
+}
+
+TEST(TensorStorage, PermuteAllStorages) {
+  checkAllStorages(2, 37);
+  checkAllStorages(3, 33);
+  checkAllStorages(4, 7);
+  checkAllStorages(5, 3);
+}
+
+TEST(TensorStorage, PermuteWithThreads) {
+  setThreads(4);
+  checkAllStorages(2, 300);
+  checkAllStorages(3, 45);
+  setThreads(1);
+}
+
+TEST(TensorStorage, LazyStorageChange) {
+  Tensor t(3,4);
+  for (int i = 0; i < 64; ++i)
+    t.getData()[i] = cdouble(i, 1);
+  cdouble slice[16];
+  t.getSlice({1,-1,-1}, slice);
+
+  // The storage changes, but the data array keeps its layout
+  vector<int> layout;
+  const cdouble* data = t.getData(layout);
+  t.setStorage({2,0,1});
+  EXPECT_TRUE(t.hasPendingStorage());
+  EXPECT_EQ(vector<int>({2,0,1}), t.getStorage());
+  EXPECT_EQ(data, t.getData(layout));
+  EXPECT_EQ(vector<int>({0,1,2}), layout);
+
+  // Slices and copies work on the data as it is
+  cdouble pending[16];
+  bool trans = t.getSlice({1,-1,-1}, pending);
+  Tensor copy(t);
+  EXPECT_TRUE(copy.hasPendingStorage());
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      EXPECT_EQ(slice[i + 4*j], trans ? pending[j + 4*i] : pending[i + 4*j]);
+    }
+  }
+
+  // Changing the storage back never moves the data
+  t.setStorage({0,1,2});
+  EXPECT_FALSE(t.hasPendingStorage());
+  EXPECT_EQ(data, t.getData());
+
+  // Accessing the data array applies the storage
+  copy.applyStorage();
+  EXPECT_FALSE(copy.hasPendingStorage());
+  copy.getData(layout);
+  EXPECT_EQ(vector<int>({2,0,1}), layout);
+  EXPECT_EQ(t.getData()[1 + 4*2 + 16*3], copy.getData()[3 + 4*1 + 16*2]);
+}
+
+TEST(TensorStorage, PendingStorageInAlgebra) {
+  Tensor t1(3,5);
+  Tensor t2(3,5);
+  for (int i = 0; i < 125; ++i) {
+    t1.getData()[i] = cdouble(i, 2*i);
+    t2.getData()[i] = cdouble(3*i, -i);
+  }
+  Tensor sum = t1 + t2;
+  cdouble inner;
+  {
+    Tensor r;
+    contract(t1, t2, {{0,0},{1,1},{2,2}}, r);
+    inner = r.getData()[0];
+  }
+
+  // Only the layout of the data arrays matters
+  t1.setStorage({1,2,0});
+  t2.setStorage({2,1,0});
+  Tensor lazy = t1 + t2;
+  lazy.setStorage({0,1,2});
+  for (int i = 0; i < 125; ++i)
+    EXPECT_EQ(sum.getData()[i], lazy.getData()[i]);
+
+  // The inner product reads the data as it is laid out
+  Tensor r;
+  contract(t1, t2, {{0,0},{1,1},{2,2}}, r);
+  EXPECT_EQ(inner, r.getData()[0]);
+  EXPECT_TRUE(t1.hasPendingStorage());
+}
 
 TEST(TensorResize, ResizeRank3TensorToRank2) {
   Tensor t(3,2,{2,1,0});
@@ -135,4 +254,49 @@ TEST(TensorResize, ResizeRank2TensorToRank3WithStorage) {
 }
 
 
+TEST(TensorResize, SameNumberOfElementsKeepsData) {
+  Tensor t(4,3);
+  t.getData()[5] = 1.0;
+  cdouble* data = t.getData();
+
+  // 3^4 = 9^2, the data array is reused and cleared
+  t.resize(2,9,{1,0});
+  EXPECT_EQ(data, t.getData());
+  ASSERT_EQ(2, t.getRank());
+  ASSERT_EQ(9, t.getSize());
+  ASSERT_EQ(1, t.getStorage()[0]);
+  for (int i = 0; i < 81; ++i)
+    EXPECT_EQ(0.0, t.getData()[i]);
+
+  // Invalid sizes still throw
+  EXPECT_THROW(t.resize(2,1), invalid_argument);
+}
+
+TEST(TensorResize, SmallerTensorKeepsData) {
+  Tensor t(4,3);
+  cdouble* data = t.getData();
+
+  // A rank 3 tensor fits in the data array of the rank 4 tensor
+  t.resize(3,3);
+  EXPECT_EQ(data, t.getData());
+  for (int i = 0; i < 27; ++i)
+    EXPECT_EQ(0.0, t.getData()[i]);
+
+  // Growing back within the original array keeps it as well, and the
+  // elements are only cleared on request
+  t.getData()[7] = 2.0;
+  t.resize(4,3,{3,2,1,0},false);
+  EXPECT_EQ(data, t.getData());
+  EXPECT_EQ(2.0, t.getData()[7]);
+  EXPECT_EQ(3, t.getStorage()[0]);
+  EXPECT_FALSE(t.hasPendingStorage());
+
+  // A larger tensor needs a new array
+  t.resize(5,3);
+  ASSERT_EQ(5, t.getRank());
+  for (int i = 0; i < 243; ++i)
+    EXPECT_EQ(0.0, t.getData()[i]);
+}
+
+
 }
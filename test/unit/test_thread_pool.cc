@@ -0,0 +1,96 @@
+#include "thread_pool.h"
+#include "gemm.h"
+#include "pichi/contraction.h"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+
+/*
+ * Unit tests of the thread pool defined in THREAD_POOL.CC
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+TEST(ThreadPool, ThreadSetting) {
+  EXPECT_EQ(1, getThreads());
+  setThreads(3);
+  EXPECT_EQ(3, getThreads());
+  EXPECT_EQ(2, threadPool().size());
+  setThreads(1);
+  EXPECT_EQ(0, threadPool().size());
+  EXPECT_THROW(setThreads(0), invalid_argument);
+}
+
+TEST(ThreadPool, ParallelForCoversRangeOnce) {
+  setThreads(4);
+  vector<atomic<int>> hits(1000);
+  for (atomic<int>& h : hits)
+    h = 0;
+  parallelFor(1000, [&](long long begin, long long end) {
+    for (long long i = begin; i < end; ++i)
+      ++hits[i];
+  });
+  for (atomic<int>& h : hits)
+    EXPECT_EQ(1, h);
+  setThreads(1);
+}
+
+TEST(ThreadPool, NestedParallelForRunsSerially) {
+  setThreads(4);
+  atomic<int> total(0);
+  atomic<int> split(0);
+  parallelFor(8, [&](long long begin, long long end) {
+    for (long long i = begin; i < end; ++i) {
+      // Nested loops run in one go, also on the calling thread
+      parallelFor(10, [&](long long b, long long e) {
+        total += e - b;
+        if (b != 0 || e != 10)
+          ++split;
+      });
+    }
+  });
+  EXPECT_EQ(80, total);
+  EXPECT_EQ(0, split);
+  setThreads(1);
+}
+
+TEST(ThreadPool, ParallelForRethrows) {
+  setThreads(4);
+  EXPECT_THROW(parallelFor(100, [](long long begin, long long end) {
+    if (begin <= 50 && 50 < end)
+      throw invalid_argument("Error");
+  }), invalid_argument);
+  setThreads(1);
+}
+
+TEST(ThreadPool, OverlappingSerialBlasRegions) {
+  // The BLAS threads as set by setThreads, as far as the library allows
+  setThreads(2);
+  int blas = setBlasThreads(1);
+  setBlasThreads(blas);
+
+  // Two regions on different threads, where the first one ends first. BLAS
+  // stays on one thread until both have ended, and is then restored.
+  unique_ptr<SerialBlasRegion> first(new SerialBlasRegion());
+  unique_ptr<SerialBlasRegion> second;
+  thread([&]() { second.reset(new SerialBlasRegion()); }).join();
+  first.reset();
+  EXPECT_EQ(1, setBlasThreads(1));
+  thread([&]() { second.reset(); }).join();
+  EXPECT_EQ(blas, setBlasThreads(blas));
+
+  // Changing the threads within a region takes effect when it ends
+  first.reset(new SerialBlasRegion());
+  setThreads(1);
+  EXPECT_EQ(1, setBlasThreads(1));
+  setThreads(2);
+  first.reset();
+  EXPECT_EQ(blas, setBlasThreads(blas));
+  setThreads(1);
+}
+
+}
@@ -0,0 +1,147 @@
+#include "buffer.h"
+#include "pichi/contraction.h"
+#include "pichi/plan.h"
+#include "gtest/gtest.h"
+#include "test_helpers.h"
+#include <cstdint>
+
+/*
+ * Unit tests of the ContractionWorkspace defined in WORKSPACE.CC
+ */
+
+using namespace pichi;
+using namespace std;
+
+namespace {
+
+TEST(Workspace, BuffersAreAligned) {
+  ContractionWorkspace ws;
+  for (long long n : {1, 3, 17, 1000}) {
+    WorkspaceBuffer b(&ws, n);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(b.data()) % buffer_alignment);
+    WorkspaceBuffer own(nullptr, n);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(own.data()) % buffer_alignment);
+  }
+}
+
+TEST(Workspace, BuffersAreReused) {
+  ContractionWorkspace ws;
+  EXPECT_EQ(0, ws.countBuffers());
+
+  cdouble* first;
+  {
+    WorkspaceBuffer b1(&ws, 100);
+    WorkspaceBuffer b2(&ws, 50);
+    first = b1.data();
+    EXPECT_EQ(0, ws.countBuffers());
+  }
+  EXPECT_EQ(2, ws.countBuffers());
+  EXPECT_EQ(150, ws.countElements());
+
+  // The smallest buffer which is large enough is taken
+  {
+    WorkspaceBuffer b(&ws, 80);
+    EXPECT_EQ(first, b.data());
+  }
+
+  // A request larger than all buffers replaces the largest one
+  {
+    WorkspaceBuffer b(&ws, 200);
+  }
+  EXPECT_EQ(2, ws.countBuffers());
+  EXPECT_EQ(250, ws.countElements());
+
+  ws.clear();
+  EXPECT_EQ(0, ws.countBuffers());
+}
+
+TEST(Workspace, Contractions) {
+  Tensor a(4, 5, {2,0,3,1}), b(3, 5), c(3, 5);
+  fill(a, 1);
+  fill(b, 2);
+  fill(c, 3);
+
+  // The same contractions with and without a workspace
+  ContractionWorkspace ws;
+  for (Engine e : {Engine::Slice, Engine::TTGT, Engine::Strided}) {
+    setEngine(e);
+    for (vector<pair<int,int>> idx : {vector<pair<int,int>>{{1,0}},
+                                      vector<pair<int,int>>{{2,1},{0,2}}}) {
+      Tensor a1(a), b1(b), ref, res;
+      contract(a1, b1, idx, ref);
+      contract(a1, b1, idx, res, &ws);
+      EXPECT_EQ(ref.getStorage(), res.getStorage());
+      expectEqual(ref, res);
+    }
+  }
+  setEngine(Engine::Auto);
+
+  Tensor ref, res;
+  contract(a, {{0,3}}, ref);
+  contract(a, {{0,3}}, res, &ws);
+  expectEqual(ref, res);
+
+  // Repeating a contraction takes no new buffers
+  Tensor a1(a), b1(b);
+  setEngine(Engine::Slice);
+  contract(a1, b1, {{2,1},{0,2}}, res, &ws);
+  int buffers = ws.countBuffers();
+  long long elements = ws.countElements();
+  EXPECT_LT(0, buffers);
+  contract(a1, b1, {{2,1},{0,2}}, res, &ws);
+  EXPECT_EQ(buffers, ws.countBuffers());
+  EXPECT_EQ(elements, ws.countElements());
+  setEngine(Engine::Auto);
+
+  // The 3M method takes the planes of the inputs and the output, and the
+  // sums of the planes, from the workspace
+  ContractionWorkspace ws3m;
+  setEngine(Engine::TTGT);
+  setGemmMethod(GemmMethod::Gauss);
+  contract(a1, b1, {{2,1},{0,2}}, ref);
+  contract(a1, b1, {{2,1},{0,2}}, res, &ws3m);
+  expectEqual(ref, res);
+  EXPECT_EQ(4, ws3m.countBuffers());
+  elements = ws3m.countElements();
+  contract(a1, b1, {{2,1},{0,2}}, res, &ws3m);
+  EXPECT_EQ(4, ws3m.countBuffers());
+  EXPECT_EQ(elements, ws3m.countElements());
+  setGemmMethod(GemmMethod::Standard);
+  setEngine(Engine::Auto);
+
+  // Diagrams, also on several threads
+  vector<Tensor> tensors = {a, b, c};
+  for (int threads : {1, 3}) {
+    setThreads(threads);
+    vector<Tensor> copies(tensors);
+    Tensor r1, r2;
+    contract(Graph("0abcd1abe2cde"), copies, r1);
+    copies = tensors;
+    contract(Graph("0abcd1abe2cde"), copies, r2, &ws);
+    cdouble x1 = r1.getData()[0], x2 = r2.getData()[0];
+    EXPECT_NEAR(0.0, abs(x1 - x2), 1e-9 * abs(x1));
+  }
+  setThreads(1);
+}
+
+TEST(Workspace, OutputIsReused) {
+  Tensor a(3, 6), b(3, 6), out;
+  fill(a, 1);
+  fill(b, 2);
+  ContractionWorkspace ws;
+  setEngine(Engine::Slice);
+  contract(a, b, {{2,0}}, out, &ws);
+  const cdouble* data = out.getData();
+  Tensor ref(out);
+
+  // The output has the same layout, so its data array is reused. Every
+  // element is computed again.
+  fill(out, 5);
+  contract(a, b, {{2,0}}, out, &ws);
+  EXPECT_EQ(data, out.getData());
+  EXPECT_EQ(ref.getStorage(), out.getStorage());
+  expectEqual(ref, out);
+  setEngine(Engine::Auto);
+}
+
+}